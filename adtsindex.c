@@ -0,0 +1,421 @@
+#include "adtsindex.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static const int adts_sample_rates[16] = {96000, 88200, 64000, 48000, 44100, 32000, 24000, 22050, 16000, 12000, 11025, 8000, 7350, 0, 0, 0};
+
+typedef struct
+{
+    int frame_length; // header included
+    int header_length;
+    int blocks;       // raw data blocks, 1024 samples each
+    int sample_rate;
+    int channels;
+    int profile;
+} ADTSHeaderInfo;
+
+/* parses and validates the fixed + variable header at p, avail bytes readable */
+static bool adts_parse_header(const uint8_t *p, size_t avail, ADTSHeaderInfo *info)
+{
+    if (avail < 7 || p[0] != 0xFF || (p[1] & 0xF6) != 0xF0) // sync 0xFFF, layer 0
+    {
+        return false;
+    }
+    info->header_length = (p[1] & 0x01) ? 7 : 9; // protection_absent == 0 adds a crc
+    info->profile = p[2] >> 6;
+    info->sample_rate = adts_sample_rates[(p[2] >> 2) & 0x0F];
+    info->channels = ((p[2] & 0x01) << 2) | (p[3] >> 6);
+    info->frame_length = ((p[3] & 0x03) << 11) | (p[4] << 3) | (p[5] >> 5);
+    info->blocks = (p[6] & 0x03) + 1;
+    return info->sample_rate != 0 && info->frame_length > info->header_length && (size_t)info->frame_length <= avail;
+}
+
+/* only the sync word and layer, what follows a frame may be cut off by the end of the file */
+static bool adts_sync(const uint8_t *p, size_t avail)
+{
+    return p[0] == 0xFF && (avail < 2 || (p[1] & 0xF6) == 0xF0);
+}
+
+static bool adts_index_grow(ADTSReader *reader, int64_t *capacity)
+{
+    int64_t new_capacity = *capacity ? *capacity * 2 : 4096;
+    uint64_t *offsets = realloc(reader->offsets, sizeof(uint64_t) * (new_capacity + 1));
+    if (!offsets)
+    {
+        return false;
+    }
+    reader->offsets = offsets;
+    if (reader->pts)
+    {
+        int64_t *pts = realloc(reader->pts, sizeof(int64_t) * new_capacity);
+        if (!pts)
+        {
+            return false;
+        }
+        reader->pts = pts;
+    }
+    *capacity = new_capacity;
+    return true;
+}
+
+/*
+ * walks the mapping frame by frame. a frame only counts when the header is
+ * valid and, unless it is the last one, another sync word follows it, so a
+ * stray 0xFFF inside payload after damage doesn't derail the index. the next
+ * frame itself doesn't have to fit, a truncated tail keeps the frame before it.
+ */
+static bool adts_index_build(ADTSReader *reader)
+{
+    int64_t capacity = 0;
+    int64_t pts = 0;
+    size_t pos = 0;
+    size_t end = 0; // end of the last accepted frame
+    ADTSHeaderInfo info;
+    reader->frame_num = 0;
+    reader->skipped_bytes = 0;
+    while (pos + 7 <= reader->size)
+    {
+        bool valid = adts_parse_header(reader->map + pos, reader->size - pos, &info);
+        if (valid && pos + info.frame_length < reader->size)
+        {
+            valid = adts_sync(reader->map + pos + info.frame_length, reader->size - pos - info.frame_length);
+        }
+        if (!valid)
+        {
+            pos++;
+            reader->skipped_bytes++;
+            continue;
+        }
+        if (reader->frame_num == capacity && !adts_index_grow(reader, &capacity))
+        {
+            perror("adts index alloc failed");
+            return false;
+        }
+        if (reader->frame_num == 0)
+        {
+            reader->sample_rate = info.sample_rate;
+            reader->channels = info.channels;
+            reader->profile = info.profile;
+        }
+        if (info.blocks != 1 && !reader->pts)
+        {
+            // first frame with several blocks, from now on pts are stored
+            reader->pts = malloc(sizeof(int64_t) * capacity);
+            if (!reader->pts)
+            {
+                return false;
+            }
+            for (int64_t i = 0; i < reader->frame_num; i++)
+            {
+                reader->pts[i] = i * ADTS_SAMPLES_PER_BLOCK;
+            }
+        }
+        if (reader->pts)
+        {
+            reader->pts[reader->frame_num] = pts;
+        }
+        reader->offsets[reader->frame_num++] = pos;
+        pts += (int64_t)info.blocks * ADTS_SAMPLES_PER_BLOCK;
+        pos += info.frame_length;
+        end = pos;
+    }
+    if (!reader->offsets && !adts_index_grow(reader, &capacity))
+    {
+        return false;
+    }
+    // not pos, trailing garbage the scan stepped over is no part of the last frame
+    reader->offsets[reader->frame_num] = end;
+    return true;
+}
+
+typedef struct
+{
+    char magic[8];
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int32_t sample_rate;
+    int32_t channels;
+    int32_t profile;
+    int32_t has_pts;
+    int64_t frame_num;
+    int64_t skipped_bytes;
+} ADTSIndexHeader;
+
+static void adts_index_header(ADTSReader *reader, const struct stat *st, ADTSIndexHeader *header)
+{
+    memset(header, 0, sizeof(ADTSIndexHeader));
+    memcpy(header->magic, ADTS_INDEX_MAGIC, sizeof(header->magic));
+    header->file_size = st->st_size;
+    header->mtime_sec = st->st_mtim.tv_sec;
+    header->mtime_nsec = st->st_mtim.tv_nsec;
+    header->sample_rate = reader->sample_rate;
+    header->channels = reader->channels;
+    header->profile = reader->profile;
+    header->has_pts = reader->pts != NULL;
+    header->frame_num = reader->frame_num;
+    header->skipped_bytes = reader->skipped_bytes;
+}
+
+static bool adts_index_load(ADTSReader *reader, const char *idx_path, const struct stat *st)
+{
+    FILE *fp = fopen(idx_path, "rb");
+    if (!fp)
+    {
+        return false;
+    }
+    ADTSIndexHeader header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 && memcmp(header.magic, ADTS_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+              header.file_size == (uint64_t)st->st_size && header.mtime_sec == st->st_mtim.tv_sec && header.mtime_nsec == st->st_mtim.tv_nsec &&
+              header.frame_num >= 0 && (uint64_t)header.frame_num <= (uint64_t)st->st_size / 7;
+    if (ok)
+    {
+        reader->offsets = malloc(sizeof(uint64_t) * (header.frame_num + 1));
+        reader->pts = header.has_pts ? malloc(sizeof(int64_t) * (header.frame_num + 1)) : NULL;
+        ok = reader->offsets && (!header.has_pts || reader->pts) &&
+             fread(reader->offsets, sizeof(uint64_t), header.frame_num + 1, fp) == (size_t)header.frame_num + 1 &&
+             (!header.has_pts || fread(reader->pts, sizeof(int64_t), header.frame_num, fp) == (size_t)header.frame_num);
+        // every frame starts after the previous one and inside the file, views never leave the mapping
+        for (int64_t i = 0; ok && i <= header.frame_num; i++)
+        {
+            ok = reader->offsets[i] <= (uint64_t)st->st_size && (i == 0 || reader->offsets[i] > reader->offsets[i - 1]);
+        }
+    }
+    fclose(fp);
+    if (!ok)
+    {
+        free(reader->offsets);
+        free(reader->pts);
+        reader->offsets = NULL;
+        reader->pts = NULL;
+        return false;
+    }
+    reader->sample_rate = header.sample_rate;
+    reader->channels = header.channels;
+    reader->profile = header.profile;
+    reader->frame_num = header.frame_num;
+    reader->skipped_bytes = header.skipped_bytes;
+    return true;
+}
+
+static void adts_index_save(ADTSReader *reader, const char *idx_path, const struct stat *st)
+{
+    ADTSIndexHeader header;
+    adts_index_header(reader, st, &header);
+    // written under a temporary name and renamed, a reader never sees half an index
+    char tmp_path[4096 + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", idx_path);
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp)
+    {
+        perror("can't write adts index");
+        return;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(reader->offsets, sizeof(uint64_t), reader->frame_num + 1, fp) == (size_t)reader->frame_num + 1 &&
+              (!reader->pts || fwrite(reader->pts, sizeof(int64_t), reader->frame_num, fp) == (size_t)reader->frame_num);
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp_path, idx_path) < 0)
+    {
+        perror("can't write adts index");
+        unlink(tmp_path);
+    }
+}
+
+bool ADTSReaderOpen(ADTSReader *reader, const char *path, bool use_sidecar)
+{
+    memset(reader, 0, sizeof(ADTSReader));
+    reader->fd = open(path, O_RDONLY);
+    struct stat st;
+    if (reader->fd < 0 || fstat(reader->fd, &st) < 0)
+    {
+        perror("open aac file failed");
+        if (reader->fd >= 0)
+        {
+            close(reader->fd);
+        }
+        return false;
+    }
+    reader->size = st.st_size;
+    if (reader->size > 0)
+    {
+        void *map = mmap(NULL, reader->size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+        if (map == MAP_FAILED)
+        {
+            perror("mmap aac file failed");
+            close(reader->fd);
+            return false;
+        }
+        reader->map = map;
+    }
+
+    char idx_path[4096];
+    snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+    if (use_sidecar && adts_index_load(reader, idx_path, &st))
+    {
+        reader->from_sidecar = true;
+        return true;
+    }
+    if (!adts_index_build(reader))
+    {
+        ADTSReaderClose(reader);
+        return false;
+    }
+    if (use_sidecar)
+    {
+        adts_index_save(reader, idx_path, &st);
+    }
+    return true;
+}
+
+/* O(1), the view points into the mapping and is valid until ADTSReaderClose */
+bool ADTSReaderFrame(ADTSReader *reader, int64_t index, ADTSFrameView *view)
+{
+    if (index < 0 || index >= reader->frame_num)
+    {
+        return false;
+    }
+    const uint8_t *p = reader->map + reader->offsets[index];
+    ADTSHeaderInfo info;
+    // a sidecar can't be trusted blindly, the header is checked again
+    if (!adts_parse_header(p, reader->size - reader->offsets[index], &info))
+    {
+        return false;
+    }
+    view->data = p;
+    view->size = info.frame_length;
+    view->payload = p + info.header_length;
+    view->payload_size = info.frame_length - info.header_length;
+    view->pts = reader->pts ? reader->pts[index] : index * ADTS_SAMPLES_PER_BLOCK;
+    view->index = index;
+    return true;
+}
+
+/* frame that contains sample pts, a division unless frames differ in length */
+int64_t ADTSReaderFrameAt(ADTSReader *reader, int64_t pts)
+{
+    if (reader->frame_num == 0 || pts < 0)
+    {
+        return 0;
+    }
+    if (!reader->pts)
+    {
+        int64_t index = pts / ADTS_SAMPLES_PER_BLOCK;
+        return index < reader->frame_num ? index : reader->frame_num - 1;
+    }
+    int64_t low = 0, high = reader->frame_num - 1;
+    while (low < high)
+    {
+        int64_t mid = (low + high + 1) / 2;
+        if (reader->pts[mid] <= pts)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+    return low;
+}
+
+/* in samples */
+int64_t ADTSReaderDuration(ADTSReader *reader)
+{
+    if (reader->frame_num == 0)
+    {
+        return 0;
+    }
+    ADTSFrameView view;
+    if (!ADTSReaderFrame(reader, reader->frame_num - 1, &view))
+    {
+        return 0;
+    }
+    ADTSHeaderInfo info;
+    adts_parse_header(view.data, view.size, &info);
+    return view.pts + (int64_t)info.blocks * ADTS_SAMPLES_PER_BLOCK;
+}
+
+void ADTSReaderClose(ADTSReader *reader)
+{
+    if (reader->map)
+    {
+        munmap((void *)reader->map, reader->size);
+        reader->map = NULL;
+    }
+    if (reader->fd >= 0)
+    {
+        close(reader->fd);
+        reader->fd = -1;
+    }
+    free(reader->offsets);
+    free(reader->pts);
+    reader->offsets = NULL;
+    reader->pts = NULL;
+}
+
+#ifndef LIO_NO_MAIN
+/*
+ * gcc adtsindex.c -o adtsindex
+ * ./adtsindex audio.aac                          建索引 (audio.aac.idx) 并输出帧数, 时长
+ * ./adtsindex audio.aac 12.5 3 clip.aac          从 12.5 秒开始截 3 秒, 直接从映射里写出, 不解码
+ */
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: %s input.aac [start_seconds duration_seconds output.aac]\n", argv[0]);
+        return -1;
+    }
+    ADTSReader reader;
+    if (!ADTSReaderOpen(&reader, argv[1], true))
+    {
+        return -1;
+    }
+    printf("%s: %ld frames, %dHz %d channels, %.2fs, index %s, skipped %ld bytes\n", argv[1], reader.frame_num, reader.sample_rate,
+           reader.channels, reader.sample_rate ? (double)ADTSReaderDuration(&reader) / reader.sample_rate : 0,
+           reader.from_sidecar ? "loaded" : "built", reader.skipped_bytes);
+
+    if (argc >= 5 && reader.sample_rate > 0)
+    {
+        int64_t first = ADTSReaderFrameAt(&reader, (int64_t)(atof(argv[2]) * reader.sample_rate));
+        int64_t end_pts = (int64_t)((atof(argv[2]) + atof(argv[3])) * reader.sample_rate);
+        FILE *out_fp = fopen(argv[4], "wb");
+        if (!out_fp)
+        {
+            printf("无法打开输出文件\n");
+            ADTSReaderClose(&reader);
+            return -1;
+        }
+        // one write per run of adjacent frames, garbage skipped while indexing ends a run and is never copied
+        ADTSFrameView view;
+        int64_t index = first;
+        const uint8_t *run = NULL;
+        size_t run_size = 0;
+        while (ADTSReaderFrame(&reader, index, &view) && view.pts < end_pts)
+        {
+            if (run && run + run_size != view.data)
+            {
+                fwrite(run, 1, run_size, out_fp);
+                run = NULL;
+            }
+            if (!run)
+            {
+                run = view.data;
+                run_size = 0;
+            }
+            run_size += view.size;
+            index++;
+        }
+        if (run)
+        {
+            fwrite(run, 1, run_size, out_fp);
+        }
+        fclose(out_fp);
+        printf("wrote frames %ld-%ld to %s\n", first, index - 1, argv[4]);
+    }
+    ADTSReaderClose(&reader);
+    return 0;
+}
+#endif
@@ -0,0 +1,50 @@
+#ifndef _ADTSINDEX_H
+#define _ADTSINDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define ADTS_INDEX_MAGIC "ADTSIDX2"
+#define ADTS_SAMPLES_PER_BLOCK 1024
+
+/* one frame inside the mapping, nothing copied */
+typedef struct
+{
+    const uint8_t *data; // adts header + payload
+    int size;
+    const uint8_t *payload; // raw aac, what a muxer wants
+    int payload_size;
+    int64_t pts; // in samples
+    int64_t index;
+} ADTSFrameView;
+
+/*
+ * random access into an .aac (adts) file. the file is mmap'd read only and
+ * indexed once: offsets[i] is where frame i starts, offsets[frame_num] is the
+ * end of the last one. the index is kept in "<file>.idx" next to it and is
+ * only rebuilt when the file size or mtime no longer match.
+ * when every frame holds one raw data block (what libavcodec writes) pts is
+ * index * 1024 and the pts array is left out, so seeking is a division.
+ */
+typedef struct
+{
+    int fd;
+    const uint8_t *map;
+    size_t size;
+    int sample_rate;
+    int channels;
+    int profile;
+    int64_t frame_num;
+    uint64_t *offsets;
+    int64_t *pts; // NULL when every frame is 1024 samples
+    int64_t skipped_bytes; // garbage between frames found while indexing
+    bool from_sidecar;
+} ADTSReader;
+
+bool ADTSReaderOpen(ADTSReader *reader, const char *path, bool use_sidecar);
+bool ADTSReaderFrame(ADTSReader *reader, int64_t index, ADTSFrameView *view);
+int64_t ADTSReaderFrameAt(ADTSReader *reader, int64_t pts);
+int64_t ADTSReaderDuration(ADTSReader *reader);
+void ADTSReaderClose(ADTSReader *reader);
+#endif
@@ -1,4 +1,6 @@
 #include "codeaac.h"
+#include "sampleconvert.h"
+#include <string.h>
 
 void AACEnCoderInit(AACEnCoder *aac_encoder, int64_t bit_rate, uint64_t channel_layout, int sample_rate, int profile, enum AVSampleFormat sample_fmt)
 {
@@ -66,6 +68,24 @@ void AACEnCoderInit(AACEnCoder *aac_encoder, int64_t bit_rate, uint64_t channel_
     }
 
     aac_encoder->frame->pts = 0;
+    aac_encoder->in_sample_fmt = aac_encoder->codec_ctx->sample_fmt;
+
+    // 9.输入fifo, 预留几帧, 平时不会再分配
+    int linesize;
+    memset(aac_encoder->fifo, 0, sizeof(aac_encoder->fifo));
+    aac_encoder->fifo_capacity = aac_encoder->codec_ctx->frame_size * AAC_FIFO_FRAMES;
+    if (av_samples_alloc(aac_encoder->fifo, &linesize, aac_encoder->codec_ctx->channels, aac_encoder->fifo_capacity, aac_encoder->codec_ctx->sample_fmt, 0) < 0)
+    {
+        perror("Could not allocate audio fifo\n");
+        exit(1);
+    }
+    aac_encoder->fifo_read = 0;
+    aac_encoder->fifo_size = 0;
+    aac_encoder->fifo_grows = 0;
+    aac_encoder->next_pts = 0;
+    aac_encoder->flushing = false;
+    aac_encoder->flush_sent = false;
+    memset(&aac_encoder->stats, 0, sizeof(EncoderStats));
 }
 
 bool AACEnCoderCheckFormat(AACEnCoder *aac_encoder)
@@ -168,57 +188,209 @@ bool AACEncoderCheck(AACEnCoder *aac_encoder)
     return true;
 }
 
-bool AACEnCoderFetchFrame(AACEnCoder *aac_encoder, void *frame_buf)
+/*
+ * capture devices deliver interleaved s16/s32/flt while the native aac encoder
+ * wants fltp. with a different input format the samples are converted while
+ * they are written into the fifo, so there is no separate conversion pass.
+ */
+bool AACEnCoderSetInputFormat(AACEnCoder *aac_encoder, enum AVSampleFormat in_sample_fmt)
 {
-    if (av_frame_make_writable(aac_encoder->frame) != 0)
+    if (in_sample_fmt != aac_encoder->codec_ctx->sample_fmt &&
+        (aac_encoder->codec_ctx->sample_fmt != AV_SAMPLE_FMT_FLTP || !sample_convert_supported(in_sample_fmt)))
     {
-        perror("av_frame write failed");
+        printf("can't convert %s to %s\n", av_get_sample_fmt_name(in_sample_fmt), av_get_sample_fmt_name(aac_encoder->codec_ctx->sample_fmt));
         return false;
     }
-    if (av_samples_fill_arrays(aac_encoder->frame->data, aac_encoder->frame->linesize, frame_buf, aac_encoder->frame->channels, aac_encoder->frame->nb_samples, aac_encoder->frame->format, 0) < 0)
+    aac_encoder->in_sample_fmt = in_sample_fmt;
+    return true;
+}
+
+/* makes room for nb_samples more samples, only reallocates when a chunk is larger than any before */
+static bool aac_fifo_reserve(AACEnCoder *aac_encoder, int nb_samples)
+{
+    int channels = aac_encoder->codec_ctx->channels;
+    enum AVSampleFormat sample_fmt = aac_encoder->codec_ctx->sample_fmt;
+    if (aac_encoder->fifo_read + aac_encoder->fifo_size + nb_samples <= aac_encoder->fifo_capacity)
     {
-        perror("frame samples fill arrays failed");
-        return false;
+        return true;
+    }
+    if (aac_encoder->fifo_size + nb_samples <= aac_encoder->fifo_capacity)
+    {
+        av_samples_copy(aac_encoder->fifo, aac_encoder->fifo, 0, aac_encoder->fifo_read, aac_encoder->fifo_size, channels, sample_fmt);
+        aac_encoder->fifo_read = 0;
+        return true;
     }
-    aac_encoder->frame->pts += aac_encoder->frame->nb_samples;
 
-    /* send the frame for encoding */
-    int ret;
-    ret = avcodec_send_frame(aac_encoder->codec_ctx, aac_encoder->frame);
-    if (ret < 0)
+    int capacity = aac_encoder->fifo_capacity * 2;
+    while (capacity < aac_encoder->fifo_size + nb_samples)
+    {
+        capacity *= 2;
+    }
+    uint8_t *fifo[AV_NUM_DATA_POINTERS] = {NULL};
+    int linesize;
+    if (av_samples_alloc(fifo, &linesize, channels, capacity, sample_fmt, 0) < 0)
     {
-        perror("Error sending the frame to the encoder\n");
+        perror("aac fifo alloc failed");
         return false;
     }
+    av_samples_copy(fifo, aac_encoder->fifo, 0, aac_encoder->fifo_read, aac_encoder->fifo_size, channels, sample_fmt);
+    av_freep(&aac_encoder->fifo[0]);
+    memcpy(aac_encoder->fifo, fifo, sizeof(fifo));
+    aac_encoder->fifo_read = 0;
+    aac_encoder->fifo_capacity = capacity;
+    aac_encoder->fifo_grows++;
     return true;
 }
 
-int AACEnCoderEnCode(AACEnCoder *aac_encoder)
+/*
+ * sends every full frame the encoder accepts, then the flush once the fifo is
+ * empty. returns how many sends were made, -1 on error.
+ */
+static int aac_fifo_send(AACEnCoder *aac_encoder)
 {
-    int ret = avcodec_receive_packet(aac_encoder->codec_ctx, aac_encoder->pkt);
-    if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
+    int channels = aac_encoder->codec_ctx->channels;
+    enum AVSampleFormat sample_fmt = aac_encoder->codec_ctx->sample_fmt;
+    int frame_size = aac_encoder->frame->nb_samples;
+    int sent = 0;
+    while (aac_encoder->fifo_size >= frame_size)
     {
-        return 0;
+        if (av_frame_make_writable(aac_encoder->frame) != 0)
+        {
+            perror("av_frame write failed");
+            return -1;
+        }
+        av_samples_copy(aac_encoder->frame->extended_data, aac_encoder->fifo, 0, aac_encoder->fifo_read, frame_size, channels, sample_fmt);
+        aac_encoder->frame->pts = aac_encoder->next_pts;
+        int64_t start = aac_encoder->stats.enabled ? EncoderStatsEnter(&aac_encoder->stats) : 0;
+        int ret = avcodec_send_frame(aac_encoder->codec_ctx, aac_encoder->frame);
+        if (aac_encoder->stats.enabled)
+        {
+            EncoderStatsSend(&aac_encoder->stats, start, ret);
+        }
+        if (ret == AVERROR(EAGAIN))
+        {
+            // encoder is full, the samples stay queued until packets are taken out
+            return sent;
+        }
+        if (ret < 0)
+        {
+            perror("Error sending the frame to the encoder\n");
+            return -1;
+        }
+        aac_encoder->next_pts += frame_size;
+        aac_encoder->fifo_read += frame_size;
+        aac_encoder->fifo_size -= frame_size;
+        sent++;
     }
-    else if (ret < 0)
+    if (aac_encoder->fifo_size == 0)
     {
-        perror("Error encoding audio frame\n");
-        return -1;
+        aac_encoder->fifo_read = 0;
+        if (aac_encoder->flushing && !aac_encoder->flush_sent)
+        {
+            int ret = avcodec_send_frame(aac_encoder->codec_ctx, NULL);
+            if (ret == AVERROR(EAGAIN))
+            {
+                return sent;
+            }
+            if (ret < 0)
+            {
+                perror("Error sending the frame to the encoder\n");
+                return -1;
+            }
+            aac_encoder->flush_sent = true;
+            sent++;
+        }
     }
-    return aac_encoder->pkt->size;
+    return sent;
 }
 
-bool AACEncoderFlush(AACEnCoder *aac_encoder)
+/*
+ * queues nb_samples samples of any count, in_sample_fmt layout (planar input
+ * is nb_samples per channel back to back). full encoder frames are sent as
+ * they fill up, their pts is the number of samples queued before them.
+ */
+bool AACEnCoderFetchSamples(AACEnCoder *aac_encoder, const void *buf, int nb_samples)
 {
-    /* send the frame for encoding */
-    int ret;
-    ret = avcodec_send_frame(aac_encoder->codec_ctx, NULL);
-    if (ret < 0)
+    int channels = aac_encoder->codec_ctx->channels;
+    enum AVSampleFormat sample_fmt = aac_encoder->codec_ctx->sample_fmt;
+    if (aac_encoder->flushing || !aac_fifo_reserve(aac_encoder, nb_samples))
     {
-        perror("Error sending the frame to the encoder\n");
         return false;
     }
-    return true;
+    int offset = aac_encoder->fifo_read + aac_encoder->fifo_size;
+    if (aac_encoder->in_sample_fmt != sample_fmt)
+    {
+        sample_convert_to_fltp(buf, aac_encoder->in_sample_fmt, (float *const *)aac_encoder->fifo, offset, channels, nb_samples);
+    }
+    else
+    {
+        uint8_t *src[AV_NUM_DATA_POINTERS];
+        int linesize;
+        if (av_samples_fill_arrays(src, &linesize, buf, channels, nb_samples, sample_fmt, 1) < 0)
+        {
+            perror("frame samples fill arrays failed");
+            return false;
+        }
+        av_samples_copy(aac_encoder->fifo, src, offset, 0, nb_samples, channels, sample_fmt);
+    }
+    aac_encoder->fifo_size += nb_samples;
+    return aac_fifo_send(aac_encoder) >= 0;
+}
+
+bool AACEnCoderFetchFrame(AACEnCoder *aac_encoder, void *frame_buf)
+{
+    return AACEnCoderFetchSamples(aac_encoder, frame_buf, aac_encoder->frame->nb_samples);
+}
+
+int AACEnCoderEnCode(AACEnCoder *aac_encoder)
+{
+    while (true)
+    {
+        int64_t start = aac_encoder->stats.enabled ? EncoderStatsEnter(&aac_encoder->stats) : 0;
+        int ret = avcodec_receive_packet(aac_encoder->codec_ctx, aac_encoder->pkt);
+        if (aac_encoder->stats.enabled)
+        {
+            EncoderStatsReceive(&aac_encoder->stats, start, ret, aac_encoder->pkt);
+        }
+        if (ret == AVERROR(EAGAIN))
+        {
+            // encoder drained, feed it whatever the fifo still holds
+            int sent = aac_fifo_send(aac_encoder);
+            if (sent > 0)
+            {
+                continue;
+            }
+            return sent < 0 ? -1 : 0;
+        }
+        else if (ret == AVERROR_EOF)
+        {
+            return 0;
+        }
+        else if (ret < 0)
+        {
+            perror("Error encoding audio frame\n");
+            return -1;
+        }
+        return aac_encoder->pkt->size;
+    }
+}
+
+/* pads the last partial frame with silence, the rest goes out through AACEnCoderEnCode */
+bool AACEncoderFlush(AACEnCoder *aac_encoder)
+{
+    int frame_size = aac_encoder->frame->nb_samples;
+    int pad = (frame_size - aac_encoder->fifo_size % frame_size) % frame_size;
+    if (!aac_encoder->flushing && pad > 0)
+    {
+        if (!aac_fifo_reserve(aac_encoder, pad))
+        {
+            return false;
+        }
+        av_samples_set_silence(aac_encoder->fifo, aac_encoder->fifo_read + aac_encoder->fifo_size, pad, aac_encoder->codec_ctx->channels, aac_encoder->codec_ctx->sample_fmt);
+        aac_encoder->fifo_size += pad;
+    }
+    aac_encoder->flushing = true;
+    return aac_fifo_send(aac_encoder) >= 0;
 }
 
 void AACAdtsHeaderGen(ADTSHeader *adts_header, AVCodecContext *codec_ctx, int data_size, IS_VARIABLE_BITSTREAM is_variable)
@@ -288,28 +460,78 @@ void AACAdtsHeaderGen(ADTSHeader *adts_header, AVCodecContext *codec_ctx, int da
     }
 }
 
+/* same as H264EnCoderEnableStats, pts are counted in samples */
+void AACEnCoderEnableStats(AACEnCoder *aac_encoder, FILE *json_fp, int json_interval_ms)
+{
+    EncoderStatsEnable(&aac_encoder->stats, "aac", (AVRational){1, aac_encoder->codec_ctx->sample_rate}, json_fp, json_interval_ms);
+}
+
+void AACEnCoderGetStats(AACEnCoder *aac_encoder, EncoderStats *snapshot)
+{
+    *snapshot = aac_encoder->stats;
+}
+
 void AACEncoderDestroy(AACEnCoder *aac_encoder)
 {
+    av_freep(&aac_encoder->fifo[0]);
     av_frame_free(&aac_encoder->frame);
     av_packet_free(&aac_encoder->pkt);
     avcodec_free_context(&aac_encoder->codec_ctx);
 }
 
+#ifndef LIO_NO_MAIN
+#include "packetwriter.h"
+#include <string.h>
+/*
+ * gcc codeaac.c sampleconvert.c encstats.c packetwriter.c outputsink.c -o aac -lavcodec -lavutil -lpthread
+ *     有 liburing 时加 -DHAVE_LIBURING -luring
+ * ./aac [batch|thread|uring|fwrite]
+ * batch: adts 头和数据攒成一批用 writev 写出, thread: 同上但在写线程里写, uring: 批次交给 io_uring 异步写,
+ * fwrite: 原来每个包两次 fwrite, 用来对比, 报告里是 stdio 缓冲后实际的 write 次数
+ */
 #define INPUT_FILE "audio.pcm"
 #define OUTPUT_FILE "audio.aac"
 
-int main(void)
+static bool aac_write_packet(AACEnCoder *aac_encoder, PacketWriter *writer)
 {
+    ADTSHeader adts_header;
+    AACAdtsHeaderGen(&adts_header, aac_encoder->codec_ctx, aac_encoder->pkt->size, NONVARIABLE);
+    return PacketWriterWrite(writer, aac_encoder->pkt, adts_header.header, sizeof(adts_header.header));
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = argc > 1 ? argv[1] : "batch";
+    bool use_fwrite = strcmp(mode, "fwrite") == 0;
     AACEnCoder aac_encoder;
     AACEnCoderInit(&aac_encoder, 128 * 1024, AV_CH_LAYOUT_STEREO, 44100, FF_PROFILE_AAC_LOW, AV_SAMPLE_FMT_FLTP);
+    // audio.pcm 是 package --dump-raw 录的 s16 交错数据
+    AACEnCoderSetInputFormat(&aac_encoder, AV_SAMPLE_FMT_S16);
     FILE *in_fp = fopen(INPUT_FILE, "rb");
-    FILE *out_fp = fopen(OUTPUT_FILE, "wb");
-    float pcm_buf[1024 * 2];
-    ADTSHeader adts_header;
+    PacketWriter writer;
+    OutputSinkOption sink_option;
+    OutputSinkOptionDefault(&sink_option);
+    if (strcmp(mode, "uring") == 0)
+    {
+        sink_option.backend = OUTPUT_SINK_URING;
+    }
+    if (!in_fp)
+    {
+        printf("无法打开输入文件\n");
+        return -1;
+    }
+    // 64KB 或 200ms 写一次
+    if (use_fwrite ? !PacketWriterOpenStdio(&writer, OUTPUT_FILE) : !PacketWriterOpen(&writer, OUTPUT_FILE, 64 * 1024, 200, strcmp(mode, "thread") == 0, &sink_option))
+    {
+        printf("无法打开输出文件\n");
+        return -1;
+    }
+    int16_t pcm_buf[1024 * 2];
     int ret = 0;
-    while (fread(pcm_buf, sizeof(float), 2048, in_fp))
+    size_t nb_samples;
+    while ((nb_samples = fread(pcm_buf, sizeof(int16_t) * 2, 1024, in_fp)) > 0)
     {
-        AACEnCoderFetchFrame(&aac_encoder, pcm_buf);
+        AACEnCoderFetchSamples(&aac_encoder, pcm_buf, nb_samples);
         while (true)
         {
             ret = AACEnCoderEnCode(&aac_encoder);
@@ -322,9 +544,11 @@ int main(void)
             {
                 break;
             }
-            AACAdtsHeaderGen(&adts_header, aac_encoder.codec_ctx, aac_encoder.pkt->size, NONVARIABLE);
-            fwrite(&adts_header, sizeof(ADTSHeader), 1, out_fp);
-            fwrite(aac_encoder.pkt->data, 1, aac_encoder.pkt->size, out_fp);
+            if (!aac_write_packet(&aac_encoder, &writer))
+            {
+                printf("写文件失败\n");
+                exit(0);
+            }
         }
     }
     AACEncoderFlush(&aac_encoder);
@@ -340,9 +564,13 @@ int main(void)
         {
             break;
         }
-        AACAdtsHeaderGen(&adts_header, aac_encoder.codec_ctx, aac_encoder.pkt->size, NONVARIABLE);
-        fwrite(&adts_header, sizeof(ADTSHeader), 1, out_fp);
-        fwrite(aac_encoder.pkt->data, 1, aac_encoder.pkt->size, out_fp);
+        aac_write_packet(&aac_encoder, &writer);
     }
+    // 关闭之后最后一批才写完, 写线程也已退出, 统计才完整
+    PacketWriterClose(&writer);
+    PacketWriterReport(&writer, "aac");
+    fclose(in_fp);
+    AACEncoderDestroy(&aac_encoder);
     return 0;
-}
\ No newline at end of file
+}
+#endif
@@ -11,6 +11,7 @@
 #include <libavutil/frame.h>
 #include <libavutil/samplefmt.h>
 #include <libavutil/opt.h>
+#include "encstats.h"
 
 typedef enum
 {
@@ -18,12 +19,29 @@ typedef enum
     NONVARIABLE
 } IS_VARIABLE_BITSTREAM;
 
+#define AAC_FIFO_FRAMES 4
+
+/*
+ * samples go through a fifo in the codec sample format, so callers can hand
+ * over chunks of any size (alsa periods don't have to match frame_size).
+ * valid samples are [fifo_read, fifo_read + fifo_size) of every plane.
+ */
 typedef struct
 {
     AVCodec *codec;
     AVCodecContext *codec_ctx;
     AVPacket *pkt;
     AVFrame *frame;
+    enum AVSampleFormat in_sample_fmt; // layout of the buffers given to AACEnCoderFetchSamples
+    uint8_t *fifo[AV_NUM_DATA_POINTERS];
+    int fifo_capacity;
+    int fifo_read;
+    int fifo_size;
+    int fifo_grows;   // reallocations after init, stays 0 in steady state
+    int64_t next_pts; // samples sent to the encoder so far
+    bool flushing;
+    bool flush_sent;
+    EncoderStats stats; // off unless AACEnCoderEnableStats is called
 } AACEnCoder;
 
 typedef struct
@@ -37,9 +55,13 @@ bool AACEnCoderCheckSampleRate(AACEnCoder *aac_encoder);
 bool AACEnCoderCheckChannelLayout(AACEnCoder *aac_encoder);
 bool AACEnCoderCheckProfile(AACEnCoder *aac_encoder);
 bool AACEncoderCheck(AACEnCoder *aac_encoder);
+bool AACEnCoderSetInputFormat(AACEnCoder *aac_encoder, enum AVSampleFormat in_sample_fmt);
+bool AACEnCoderFetchSamples(AACEnCoder *aac_encoder, const void *buf, int nb_samples);
 bool AACEnCoderFetchFrame(AACEnCoder *aac_encoder, void *frame_buf);
 int AACEnCoderEnCode(AACEnCoder *aac_encoder);
 bool AACEncoderFlush(AACEnCoder *aac_encoder);
 void AACAdtsHeaderGen(ADTSHeader *adts_header, AVCodecContext *codec_ctx, int data_size, IS_VARIABLE_BITSTREAM is_variable);
+void AACEnCoderEnableStats(AACEnCoder *aac_encoder, FILE *json_fp, int json_interval_ms);
+void AACEnCoderGetStats(AACEnCoder *aac_encoder, EncoderStats *snapshot);
 void AACEncoderDestroy(AACEnCoder *aac_encoder);
 #endif
\ No newline at end of file
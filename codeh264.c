@@ -1,6 +1,115 @@
 #include "codeh264.h"
+#include <string.h>
+#include <unistd.h>
+
+void H264EnCoderOptionDefault(H264EnCoderOption *option)
+{
+    option->preset = "slow";
+    option->gop_size = 10;
+    option->max_b_frames = 1;
+    option->thread_count = 0;
+    option->latency = H264_LATENCY_NORMAL;
+    option->vbv_ms = 0;
+    option->intra_refresh = false;
+    option->peak_ratio = 0;
+    option->x264_params = NULL;
+    option->requested_idr_only = false;
+}
+
+/* live monitoring profile, a fast preset and a vbv of two frames at 10 fps */
+void H264EnCoderOptionLowLatency(H264EnCoderOption *option)
+{
+    H264EnCoderOptionDefault(option);
+    option->preset = "veryfast";
+    option->max_b_frames = 0;
+    option->latency = H264_LATENCY_LOW;
+    option->vbv_ms = 200;
+}
 
 void H264EnCoderInit(H264EnCoder *h264_encoder, int64_t bit_rate, int width, int height, AVRational rational, int profile, enum AVPixelFormat pixel_format)
+{
+    H264EnCoderOption option;
+    H264EnCoderOptionDefault(&option);
+    H264EnCoderInitWithOption(h264_encoder, bit_rate, width, height, rational, profile, pixel_format, &option);
+}
+
+/* a configured but not yet opened context, shared by init and H264EnCoderPrepareContext */
+static AVCodecContext *h264_context_alloc(AVCodec *codec, int64_t bit_rate, int width, int height, AVRational rational, int profile, enum AVPixelFormat pixel_format, const H264EnCoderOption *option)
+{
+    AVCodecContext *codec_ctx = avcodec_alloc_context3(codec);
+    if (!codec_ctx)
+    {
+        return NULL;
+    }
+    codec_ctx->codec_type = AVMEDIA_TYPE_VIDEO;
+    codec_ctx->bit_rate = bit_rate;
+    codec_ctx->width = width;
+    codec_ctx->height = height;
+    codec_ctx->framerate = rational;
+    codec_ctx->time_base = (AVRational){rational.den, rational.num};
+    codec_ctx->profile = profile;
+    codec_ctx->pix_fmt = pixel_format;
+    codec_ctx->gop_size = option->gop_size;
+    codec_ctx->max_b_frames = option->max_b_frames;
+    codec_ctx->thread_count = option->thread_count;
+    av_opt_set(codec_ctx->priv_data, "preset", option->preset, 0);
+    if (option->latency == H264_LATENCY_LOW)
+    {
+        // b-frames, lookahead and frame threads each hold frames back before the first packet
+        av_opt_set(codec_ctx->priv_data, "tune", "zerolatency", 0);
+        av_opt_set_int(codec_ctx->priv_data, "rc-lookahead", 0, 0);
+        codec_ctx->max_b_frames = 0;
+        codec_ctx->thread_type = FF_THREAD_SLICE;
+    }
+    if (option->vbv_ms > 0)
+    {
+        codec_ctx->rc_max_rate = bit_rate;
+        codec_ctx->rc_buffer_size = bit_rate * option->vbv_ms / 1000;
+    }
+    if (option->intra_refresh)
+    {
+        av_opt_set_int(codec_ctx->priv_data, "intra-refresh", 1, 0);
+    }
+    if (option->peak_ratio > 0)
+    {
+        // a frame can't be larger than the vbv buffer, so size it to peak_ratio average frames
+        int64_t frame_bits = bit_rate * rational.den / rational.num;
+        codec_ctx->rc_max_rate = bit_rate;
+        codec_ctx->rc_buffer_size = frame_bits * option->peak_ratio;
+    }
+    // key frame requests become real IDRs that a new viewer can start from
+    av_opt_set_int(codec_ctx->priv_data, "forced-idr", 1, 0);
+    char params[256];
+    const char *x264_params = option->x264_params;
+    if (option->requested_idr_only)
+    {
+        // x264's own keyint count and scene cuts would put extra idrs next to the requested ones
+        snprintf(params, sizeof(params), "keyint=infinite:scenecut=0%s%s", x264_params ? ":" : "", x264_params ? x264_params : "");
+        x264_params = params;
+    }
+    if (x264_params)
+    {
+        av_opt_set(codec_ctx->priv_data, "x264-params", x264_params, 0);
+    }
+    return codec_ctx;
+}
+
+/* a pool for pictures of codec_ctx's size and the first frame out of it */
+static AVFrame *h264_frame_alloc(AVCodecContext *codec_ctx, FramePool **pool)
+{
+    // the frame plus one more while the encoder still references the previous picture
+    *pool = FramePoolAlloc(FramePoolImageSize(codec_ctx->pix_fmt, codec_ctx->width, codec_ctx->height), 2, false);
+    AVFrame *frame = *pool ? av_frame_alloc() : NULL;
+    if (!frame || !FramePoolGetFrame(*pool, frame, codec_ctx->pix_fmt, codec_ctx->width, codec_ctx->height))
+    {
+        av_frame_free(&frame);
+        FramePoolFree(pool);
+        return NULL;
+    }
+    return frame;
+}
+
+void H264EnCoderInitWithOption(H264EnCoder *h264_encoder, int64_t bit_rate, int width, int height, AVRational rational, int profile, enum AVPixelFormat pixel_format, const H264EnCoderOption *option)
 {
 
     h264_encoder->codec = avcodec_find_encoder(AV_CODEC_ID_H264);
@@ -10,23 +119,13 @@ void H264EnCoderInit(H264EnCoder *h264_encoder, int64_t bit_rate, int width, int
         exit(0);
     }
 
-    h264_encoder->codec_ctx = avcodec_alloc_context3(h264_encoder->codec);
+    h264_encoder->codec_ctx = h264_context_alloc(h264_encoder->codec, bit_rate, width, height, rational, profile, pixel_format, option);
     if (!h264_encoder->codec_ctx)
     {
         perror("can't alloc code context");
         exit(0);
     }
-    h264_encoder->codec_ctx->codec_type = AVMEDIA_TYPE_VIDEO;
-    h264_encoder->codec_ctx->bit_rate = bit_rate;
-    h264_encoder->codec_ctx->width = width;
-    h264_encoder->codec_ctx->height = height;
-    h264_encoder->codec_ctx->framerate = rational;
-    h264_encoder->codec_ctx->time_base = (AVRational){rational.den, rational.num};
-    h264_encoder->codec_ctx->profile = profile;
-    h264_encoder->codec_ctx->pix_fmt = pixel_format;
-    h264_encoder->codec_ctx->gop_size = 10;
-    h264_encoder->codec_ctx->max_b_frames = 1;
-    av_opt_set(h264_encoder->codec_ctx->priv_data, "preset", "slow", 0);
+    h264_encoder->option = *option;
     if (!H264EnCoderCheck(h264_encoder))
     {
         exit(0);
@@ -45,25 +144,34 @@ void H264EnCoderInit(H264EnCoder *h264_encoder, int64_t bit_rate, int width, int
         exit(1);
     }
 
-    // 7.分配frame
-    h264_encoder->frame = av_frame_alloc();
+    // 7.分配frame和buffer
+    h264_encoder->frame = h264_frame_alloc(h264_encoder->codec_ctx, &h264_encoder->pool);
     if (!h264_encoder->frame)
     {
-        perror("Could not allocate audio frame\n");
+        perror("Could not allocate video frame\n");
         exit(1);
     }
+    h264_encoder->frame->pts = 0;
+    memset(&h264_encoder->stats, 0, sizeof(EncoderStats));
+    atomic_init(&h264_encoder->key_frame_request, false);
+    h264_encoder->send_ctx = h264_encoder->codec_ctx;
+    h264_encoder->next_ctx = NULL;
+    h264_encoder->next_frame = NULL;
+    h264_encoder->next_pool = NULL;
+    h264_encoder->switching = false;
+    h264_encoder->flushing = false;
+    h264_encoder->held_num = 0;
+    h264_encoder->held_pos = 0;
+    h264_encoder->preparing = false;
+    atomic_init(&h264_encoder->prepare_done, false);
+    h264_encoder->prepare_rate_change = 0;
 
-    h264_encoder->frame->format = h264_encoder->codec_ctx->pix_fmt;
-    h264_encoder->frame->width = h264_encoder->codec_ctx->width;
-    h264_encoder->frame->height = h264_encoder->codec_ctx->height;
-
-    // 8.为frame分配buffer
-    if (av_frame_get_buffer(h264_encoder->frame, 32) < 0)
+    h264_encoder->ext_frame = av_frame_alloc();
+    if (!h264_encoder->ext_frame)
     {
-        perror("Could not allocate audio data buffers\n");
+        perror("Could not allocate video frame\n");
         exit(1);
     }
-    h264_encoder->frame->pts = 0;
 }
 
 bool H264EnCoderCheckFormat(H264EnCoder *h264_encoder)
@@ -143,13 +251,41 @@ bool H264EnCoderCheck(H264EnCoder *h264_encoder)
     return true;
 }
 
+/*
+ * call before filling h264_encoder->frame with a whole new picture. while
+ * the encoder still references the last one, a pool buffer takes its place
+ * instead of the malloc and copy of av_frame_make_writable.
+ */
+bool H264EnCoderFrameWritable(H264EnCoder *h264_encoder)
+{
+    AVFrame *frame = h264_encoder->frame;
+    if (av_frame_is_writable(frame))
+    {
+        return true;
+    }
+    int64_t pts = frame->pts;
+    av_frame_unref(frame);
+    if (!FramePoolGetFrame(h264_encoder->pool, frame, h264_encoder->send_ctx->pix_fmt, h264_encoder->send_ctx->width, h264_encoder->send_ctx->height))
+    {
+        return false;
+    }
+    frame->pts = pts;
+    return true;
+}
+
 bool H264EnCoderFetchFrame(H264EnCoder *h264_encoder)
 {
     // av_init_packet(h264_encoder->pkt);
     // h264_encoder->pkt->data = NULL;
     // h264_encoder->pkt->size = 0;
 
-    int ret = avcodec_send_frame(h264_encoder->codec_ctx, h264_encoder->frame);
+    h264_encoder->frame->pict_type = atomic_exchange(&h264_encoder->key_frame_request, false) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+    int64_t start = h264_encoder->stats.enabled ? EncoderStatsEnter(&h264_encoder->stats) : 0;
+    int ret = avcodec_send_frame(h264_encoder->send_ctx, h264_encoder->frame);
+    if (h264_encoder->stats.enabled)
+    {
+        EncoderStatsSend(&h264_encoder->stats, start, ret);
+    }
     if (ret < 0)
     {
         return false;
@@ -159,9 +295,349 @@ bool H264EnCoderFetchFrame(H264EnCoder *h264_encoder)
     return true;
 }
 
+/*
+ * sends planes that the encoder does not own. buf is the reference that keeps
+ * them alive and is consumed by this call; the encoder keeps its own reference
+ * only until x264 has copied the picture, so no av_frame_make_writable copy and
+ * no memcpy into h264_encoder->frame is needed. pts comes from frame->pts like
+ * H264EnCoderFetchFrame.
+ */
+bool H264EnCoderFetchBuffer(H264EnCoder *h264_encoder, AVBufferRef *buf, uint8_t *const data[3], const int linesize[3])
+{
+    AVFrame *ext_frame = h264_encoder->ext_frame;
+    ext_frame->format = h264_encoder->send_ctx->pix_fmt;
+    ext_frame->width = h264_encoder->send_ctx->width;
+    ext_frame->height = h264_encoder->send_ctx->height;
+    ext_frame->buf[0] = buf;
+    for (int i = 0; i < 3; i++)
+    {
+        ext_frame->data[i] = data[i];
+        ext_frame->linesize[i] = linesize[i];
+    }
+    ext_frame->pts = h264_encoder->frame->pts;
+    ext_frame->pict_type = atomic_exchange(&h264_encoder->key_frame_request, false) ? AV_PICTURE_TYPE_I : AV_PICTURE_TYPE_NONE;
+
+    int64_t start = h264_encoder->stats.enabled ? EncoderStatsEnter(&h264_encoder->stats) : 0;
+    int ret = avcodec_send_frame(h264_encoder->send_ctx, ext_frame);
+    av_frame_unref(ext_frame);
+    if (h264_encoder->stats.enabled)
+    {
+        EncoderStatsSend(&h264_encoder->stats, start, ret);
+    }
+    if (ret < 0)
+    {
+        return false;
+    }
+
+    h264_encoder->frame->pts++;
+    return true;
+}
+
+/*
+ * wraps caller owned planes (a pooled buffer, a mmap'd camera buffer...) and
+ * sends them. release(opaque, data[0]) is called exactly once, when the encoder
+ * is done with the picture or straight away if sending fails.
+ */
+bool H264EnCoderFetchExternalFrame(H264EnCoder *h264_encoder, uint8_t *const data[3], const int linesize[3], H264EnCoderRelease release, void *opaque)
+{
+    // whole picture with every plane, the planes follow each other at linesize[0] stride
+    int size = av_image_get_buffer_size(h264_encoder->send_ctx->pix_fmt, linesize[0], h264_encoder->send_ctx->height, 1);
+    AVBufferRef *buf = size > 0 ? av_buffer_create(data[0], size, release, opaque, AV_BUFFER_FLAG_READONLY) : NULL;
+    if (!buf)
+    {
+        release(opaque, data[0]);
+        return false;
+    }
+    return H264EnCoderFetchBuffer(h264_encoder, buf, data, linesize);
+}
+
+/* the next frame sent is encoded as an IDR, safe to call from any thread */
+void H264EnCoderRequestKeyFrame(H264EnCoder *h264_encoder)
+{
+    atomic_store(&h264_encoder->key_frame_request, true);
+}
+
+static void h264_context_set_bit_rate(AVCodecContext *codec_ctx, int64_t bit_rate)
+{
+    if (!codec_ctx || codec_ctx->bit_rate == bit_rate)
+    {
+        return;
+    }
+    if (codec_ctx->rc_max_rate > 0)
+    {
+        codec_ctx->rc_buffer_size = (int64_t)codec_ctx->rc_buffer_size * bit_rate / codec_ctx->bit_rate;
+        codec_ctx->rc_max_rate = bit_rate;
+    }
+    codec_ctx->bit_rate = bit_rate;
+}
+
+/*
+ * changes the target bitrate of the running encoder, libx264 picks it up on
+ * the next frame without a new IDR. a vbv keeps its length in time, so the
+ * buffer scales with the rate.
+ */
+void H264EnCoderSetBitRate(H264EnCoder *h264_encoder, int64_t bit_rate)
+{
+    h264_context_set_bit_rate(h264_encoder->send_ctx, bit_rate);
+    // a draining codec_ctx belongs to the drain thread and a preparing next_ctx to the prepare thread,
+    // which took its rate before this call: H264EnCoderPrepared applies it once the thread is joined
+    if (h264_encoder->preparing)
+    {
+        h264_encoder->prepare_rate_change = bit_rate;
+    }
+    else if (!h264_encoder->switching)
+    {
+        h264_context_set_bit_rate(h264_encoder->next_ctx, bit_rate);
+    }
+}
+
+static bool h264_prepare_context(H264EnCoder *h264_encoder, int width, int height, int64_t bit_rate, const H264EnCoderOption *option)
+{
+    avcodec_free_context(&h264_encoder->next_ctx);
+    av_frame_free(&h264_encoder->next_frame);
+    FramePoolFree(&h264_encoder->next_pool);
+
+    AVCodecContext *send_ctx = h264_encoder->send_ctx;
+    h264_encoder->next_option = option ? *option : h264_encoder->option;
+    h264_encoder->next_ctx = h264_context_alloc(h264_encoder->codec, bit_rate > 0 ? bit_rate : send_ctx->bit_rate, width, height,
+                                                send_ctx->framerate, send_ctx->profile, send_ctx->pix_fmt, &h264_encoder->next_option);
+    if (!h264_encoder->next_ctx || avcodec_open2(h264_encoder->next_ctx, h264_encoder->codec, NULL) < 0)
+    {
+        perror("could not open codec for switch");
+        avcodec_free_context(&h264_encoder->next_ctx);
+        return false;
+    }
+    h264_encoder->next_frame = h264_frame_alloc(h264_encoder->next_ctx, &h264_encoder->next_pool);
+    if (!h264_encoder->next_frame)
+    {
+        perror("Could not allocate video frame\n");
+        avcodec_free_context(&h264_encoder->next_ctx);
+        return false;
+    }
+    return true;
+}
+
+/*
+ * opens a second context ahead of time, so the switch itself costs nothing
+ * on the encode thread. bit_rate 0 keeps the current rate, a NULL option the
+ * current option. can be called again to replace a prepared context that was
+ * not switched to yet.
+ */
+bool H264EnCoderPrepareContext(H264EnCoder *h264_encoder, int width, int height, int64_t bit_rate, const H264EnCoderOption *option)
+{
+    if (h264_encoder->switching || h264_encoder->preparing)
+    {
+        printf("h264 context switch already in progress\n");
+        return false;
+    }
+    return h264_prepare_context(h264_encoder, width, height, bit_rate, option);
+}
+
+static void *h264_prepare_pthread(void *args)
+{
+    H264EnCoder *h264_encoder = args;
+    h264_encoder->prepare_ok = h264_prepare_context(h264_encoder, h264_encoder->prepare_width, h264_encoder->prepare_height,
+                                                    h264_encoder->prepare_bit_rate, &h264_encoder->prepare_option);
+    atomic_store(&h264_encoder->prepare_done, true);
+    return NULL;
+}
+
+/*
+ * H264EnCoderPrepareContext on a helper thread, avcodec_open2 and the lookahead
+ * setup of a slow preset then never stall the encode thread. frames keep going
+ * to the current context meanwhile; poll H264EnCoderPrepared before switching.
+ */
+bool H264EnCoderPrepareContextAsync(H264EnCoder *h264_encoder, int width, int height, int64_t bit_rate, const H264EnCoderOption *option)
+{
+    if (h264_encoder->switching || h264_encoder->preparing)
+    {
+        return false;
+    }
+    h264_encoder->prepare_width = width;
+    h264_encoder->prepare_height = height;
+    h264_encoder->prepare_bit_rate = bit_rate > 0 ? bit_rate : h264_encoder->send_ctx->bit_rate;
+    h264_encoder->prepare_option = option ? *option : h264_encoder->option;
+    atomic_store(&h264_encoder->prepare_done, false);
+    h264_encoder->prepare_rate_change = 0;
+    if (pthread_create(&h264_encoder->prepare_thread, NULL, h264_prepare_pthread, h264_encoder) != 0)
+    {
+        perror("create prepare thread failed");
+        return false;
+    }
+    h264_encoder->preparing = true;
+    return true;
+}
+
+/* -1 while the helper thread still works, 0 when preparing failed, 1 once next_ctx is ready to switch to */
+int H264EnCoderPrepared(H264EnCoder *h264_encoder)
+{
+    if (!h264_encoder->preparing)
+    {
+        return h264_encoder->next_ctx != NULL;
+    }
+    if (!atomic_load(&h264_encoder->prepare_done))
+    {
+        return -1;
+    }
+    pthread_join(h264_encoder->prepare_thread, NULL);
+    h264_encoder->preparing = false;
+    if (h264_encoder->prepare_ok && h264_encoder->prepare_rate_change > 0)
+    {
+        h264_context_set_bit_rate(h264_encoder->next_ctx, h264_encoder->prepare_rate_change);
+    }
+    h264_encoder->prepare_rate_change = 0;
+    return h264_encoder->prepare_ok;
+}
+
+/* a context at the new size, switched to with H264EnCoderSwitchContext */
+bool H264EnCoderPrepareResize(H264EnCoder *h264_encoder, int width, int height, int64_t bit_rate)
+{
+    return H264EnCoderPrepareContext(h264_encoder, width, height, bit_rate, NULL);
+}
+
+/* receives the flushed old context's packets, so its lookahead is encoded off the encode thread */
+static void *h264_drain_pthread(void *args)
+{
+    H264EnCoder *h264_encoder = args;
+    AVPacket *pkt = av_packet_alloc();
+    while (pkt && avcodec_receive_packet(h264_encoder->codec_ctx, pkt) == 0)
+    {
+        if (!FrameQueuePush(&h264_encoder->drained, pkt))
+        {
+            break;
+        }
+        pkt = av_packet_alloc();
+    }
+    av_packet_free(&pkt);
+    FrameQueueClose(&h264_encoder->drained);
+    return NULL;
+}
+
+/*
+ * flushes the current context and sends every following frame to the
+ * prepared one, h264_encoder->frame is replaced by a frame of its size.
+ * the old context is drained on a thread of its own; H264EnCoderEncode hands
+ * out its packets first and swaps the contexts when they are through, pts keep
+ * counting across the switch.
+ */
+bool H264EnCoderSwitchContext(H264EnCoder *h264_encoder)
+{
+    // held packets of the previous switch have to go out before this one's drain
+    if (!h264_encoder->next_ctx || h264_encoder->switching || h264_encoder->preparing || h264_encoder->held_num > 0)
+    {
+        return false;
+    }
+    if (avcodec_send_frame(h264_encoder->codec_ctx, NULL) < 0)
+    {
+        perror("Error sending the frame to the encoder\n");
+        return false;
+    }
+    if (!FrameQueueInit(&h264_encoder->drained, H264_SWITCH_HELD))
+    {
+        return false;
+    }
+    if (pthread_create(&h264_encoder->drain_thread, NULL, h264_drain_pthread, h264_encoder) != 0)
+    {
+        perror("create drain thread failed");
+        FrameQueueDestroy(&h264_encoder->drained);
+        return false;
+    }
+    h264_encoder->next_frame->pts = h264_encoder->frame->pts;
+    av_frame_free(&h264_encoder->frame);
+    // buffers x264 may still hold keep the old pool alive until they come back
+    FramePoolFree(&h264_encoder->pool);
+    h264_encoder->frame = h264_encoder->next_frame;
+    h264_encoder->pool = h264_encoder->next_pool;
+    h264_encoder->next_frame = NULL;
+    h264_encoder->next_pool = NULL;
+    h264_encoder->send_ctx = h264_encoder->next_ctx;
+    h264_encoder->option = h264_encoder->next_option;
+    h264_encoder->switching = true;
+    return true;
+}
+
+/* the next packet of the draining context, AVERROR_EOF once it is through and the switch is complete */
+static int h264_drained_packet(H264EnCoder *h264_encoder, bool wait)
+{
+    AVPacket *pkt = wait ? FrameQueuePop(&h264_encoder->drained) : FrameQueueTryPop(&h264_encoder->drained);
+    if (!pkt && !wait)
+    {
+        if (!FrameQueueClosed(&h264_encoder->drained))
+        {
+            return AVERROR(EAGAIN);
+        }
+        // pushed right before the close
+        pkt = FrameQueueTryPop(&h264_encoder->drained);
+    }
+    if (pkt)
+    {
+        av_packet_unref(h264_encoder->pkt);
+        av_packet_move_ref(h264_encoder->pkt, pkt);
+        av_packet_free(&pkt);
+        return 0;
+    }
+    // old context fully drained, continue with the prepared one
+    pthread_join(h264_encoder->drain_thread, NULL);
+    FrameQueueDestroy(&h264_encoder->drained);
+    avcodec_free_context(&h264_encoder->codec_ctx);
+    h264_encoder->codec_ctx = h264_encoder->next_ctx;
+    h264_encoder->next_ctx = NULL;
+    h264_encoder->switching = false;
+    return AVERROR_EOF;
+}
+
+static int h264_receive_packet(H264EnCoder *h264_encoder)
+{
+    while (h264_encoder->switching)
+    {
+        // only block on the drain at the end of the stream, or when there is no room left to hold packets
+        int ret = h264_drained_packet(h264_encoder, h264_encoder->flushing || h264_encoder->held_num == H264_SWITCH_HELD);
+        if (ret != AVERROR(EAGAIN))
+        {
+            if (ret == 0)
+            {
+                return 0;
+            }
+            break;
+        }
+        // the new context refuses the next frame until its packet is taken, so take it and hold it back
+        ret = avcodec_receive_packet(h264_encoder->send_ctx, h264_encoder->pkt);
+        if (ret < 0)
+        {
+            return ret;
+        }
+        AVPacket *pkt = av_packet_alloc();
+        if (!pkt)
+        {
+            return AVERROR(ENOMEM);
+        }
+        av_packet_move_ref(pkt, h264_encoder->pkt);
+        h264_encoder->held[h264_encoder->held_num++] = pkt;
+    }
+    if (h264_encoder->held_pos < h264_encoder->held_num)
+    {
+        AVPacket *pkt = h264_encoder->held[h264_encoder->held_pos++];
+        av_packet_unref(h264_encoder->pkt);
+        av_packet_move_ref(h264_encoder->pkt, pkt);
+        av_packet_free(&pkt);
+        if (h264_encoder->held_pos == h264_encoder->held_num)
+        {
+            h264_encoder->held_num = 0;
+            h264_encoder->held_pos = 0;
+        }
+        return 0;
+    }
+    return avcodec_receive_packet(h264_encoder->codec_ctx, h264_encoder->pkt);
+}
+
 int H264EnCoderEncode(H264EnCoder *h264_encoder)
 {
-    int ret = avcodec_receive_packet(h264_encoder->codec_ctx, h264_encoder->pkt);
+    int64_t start = h264_encoder->stats.enabled ? EncoderStatsEnter(&h264_encoder->stats) : 0;
+    int ret = h264_receive_packet(h264_encoder);
+    if (h264_encoder->stats.enabled)
+    {
+        EncoderStatsReceive(&h264_encoder->stats, start, ret, h264_encoder->pkt);
+    }
     if (ret == AVERROR(EAGAIN) || ret == AVERROR_EOF)
     {
         return 0;
@@ -177,65 +653,250 @@ int H264EnCoderEncode(H264EnCoder *h264_encoder)
 bool H264EnCoderFlush(H264EnCoder *h264_encoder)
 {
     int ret;
-    ret = avcodec_send_frame(h264_encoder->codec_ctx, NULL);
+    ret = avcodec_send_frame(h264_encoder->send_ctx, NULL);
     if (ret < 0)
     {
         perror("Error sending the frame to the encoder\n");
         return false;
     }
+    h264_encoder->flushing = true;
     return true;
 }
 
+/* rc-lookahead of x264's presets, the governor's speed levels never go above the configured one */
+static const struct
+{
+    const char *preset;
+    int lookahead;
+} h264_preset_lookahead[] = {{"ultrafast", 0}, {"superfast", 0}, {"veryfast", 10}, {"faster", 20}, {"fast", 30},
+                             {"medium", 40},   {"slow", 50},     {"slower", 60},   {"veryslow", 60}, {"placebo", 60}};
+
+/*
+ * how many frames x264 may hold before the packet of the first one comes
+ * out: lookahead, b-frames and frame threads, plus the sync lookahead that
+ * comes with frame threads. an upper bound, for sizing what has to wait on
+ * video, like the muxer's audio queue.
+ */
+int H264EnCoderDelay(H264EnCoder *h264_encoder)
+{
+    const H264EnCoderOption *option = &h264_encoder->option;
+    if (option->latency == H264_LATENCY_LOW)
+    {
+        return 0;
+    }
+    int lookahead = 40;
+    for (size_t i = 0; i < sizeof(h264_preset_lookahead) / sizeof(h264_preset_lookahead[0]); i++)
+    {
+        if (strcmp(h264_preset_lookahead[i].preset, option->preset) == 0)
+        {
+            lookahead = h264_preset_lookahead[i].lookahead;
+        }
+    }
+    // x264 picks 1.5 frame threads per core when left to decide
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = option->thread_count > 0 ? option->thread_count : cores > 0 ? cores * 3 / 2 : 1;
+    int b_frames = option->max_b_frames > 0 ? option->max_b_frames : 0;
+    return lookahead + b_frames + threads + (threads > 1 ? b_frames + 1 : 0);
+}
+
+/*
+ * starts collecting per call timings and packet statistics. with json_fp set a
+ * JSON line is written there at most every json_interval_ms, on packet output.
+ */
+void H264EnCoderEnableStats(H264EnCoder *h264_encoder, FILE *json_fp, int json_interval_ms)
+{
+    EncoderStatsEnable(&h264_encoder->stats, "h264", h264_encoder->codec_ctx->time_base, json_fp, json_interval_ms);
+}
+
+void H264EnCoderGetStats(H264EnCoder *h264_encoder, EncoderStats *snapshot)
+{
+    *snapshot = h264_encoder->stats;
+}
+
 void H264EnCoderDestroy(H264EnCoder *h264_encoder)
 {
+    if (h264_encoder->preparing)
+    {
+        pthread_join(h264_encoder->prepare_thread, NULL);
+        h264_encoder->preparing = false;
+    }
+    if (h264_encoder->switching)
+    {
+        // the drain thread stops at its next push
+        FrameQueueClose(&h264_encoder->drained);
+        AVPacket *pkt;
+        while ((pkt = FrameQueueTryPop(&h264_encoder->drained)) != NULL)
+        {
+            av_packet_free(&pkt);
+        }
+        pthread_join(h264_encoder->drain_thread, NULL);
+        while ((pkt = FrameQueueTryPop(&h264_encoder->drained)) != NULL)
+        {
+            av_packet_free(&pkt);
+        }
+        FrameQueueDestroy(&h264_encoder->drained);
+        avcodec_free_context(&h264_encoder->next_ctx);
+        h264_encoder->switching = false;
+    }
+    for (int i = h264_encoder->held_pos; i < h264_encoder->held_num; i++)
+    {
+        av_packet_free(&h264_encoder->held[i]);
+    }
     av_frame_free(&h264_encoder->frame);
+    av_frame_free(&h264_encoder->ext_frame);
+    av_frame_free(&h264_encoder->next_frame);
+    FramePoolFree(&h264_encoder->pool);
+    FramePoolFree(&h264_encoder->next_pool);
     av_packet_free(&h264_encoder->pkt);
     avcodec_free_context(&h264_encoder->codec_ctx);
+    avcodec_free_context(&h264_encoder->next_ctx);
+}
+
+#ifndef LIO_NO_MAIN
+#include "yuvreader.h"
+#include "framediff.h"
+#include "packetwriter.h"
+#include <time.h>
+#include <sys/resource.h>
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double cpu_seconds(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec / 1e6 + usage.ru_stime.tv_sec + usage.ru_stime.tv_usec / 1e6;
+}
+
+static void yuv_view_release(void *opaque, uint8_t *data)
+{
+    YUVReaderRelease(opaque, data);
+}
+
+/* reads one byte per page, so page faults of a mapped view are counted as input wait and not as encode time */
+static void yuv_view_prefault(const YUVFrameView *view, int width, int height)
+{
+    const int sizes[3] = {width * height, width * height / 4, width * height / 4};
+    long page = sysconf(_SC_PAGESIZE);
+    volatile uint8_t sink = 0;
+    for (int i = 0; i < 3; i++)
+    {
+        for (int offset = 0; offset < sizes[i]; offset += page)
+        {
+            sink += view->data[i][offset];
+        }
+        sink += view->data[i][sizes[i] - 1];
+    }
+    (void)sink;
 }
 
-int main(void)
+/*
+ * gcc codeh264.c encstats.c framepool.c yuvreader.c framequeue.c framediff.c packetwriter.c outputsink.c -o codeh264 -lavcodec -lavformat -lavutil -lswscale -lpthread
+ *     有 liburing 时加 -DHAVE_LIBURING -luring
+ * ./codeh264 [mmap|readahead|fread] [static_threshold] [batch|thread|uring|fwrite]
+ * 输出编码线程等待输入的时间, fread 是原来每帧三次 fread 的方式, 用来对比
+ * 给了 static_threshold (比如 1.5) 时跳过和上一编码帧几乎一样的帧, 对比有无该参数时的 cpu 时间就是省下的开销
+ * 输出默认攒批用 writev 写 (batch), thread 在写线程里写, uring 交给 io_uring 异步写, fwrite 是原来每个包一次 fwrite, 统计的是 stdio 缓冲后实际的 write 次数
+ */
+int main(int argc, char **argv)
 {
     int width = 1280;
     int height = 720;
-    FILE *inputFile;
-    FILE *outputFile;
+    const char *mode = argc > 1 ? argv[1] : "mmap";
+    FILE *inputFile = NULL;
+    PacketWriter writer;
+    const char *write_mode = argc > 3 ? argv[3] : "batch";
+    bool use_fwrite = strcmp(write_mode, "fwrite") == 0;
+    OutputSinkOption sink_option;
+    OutputSinkOptionDefault(&sink_option);
+    if (strcmp(write_mode, "uring") == 0)
+    {
+        sink_option.backend = OUTPUT_SINK_URING;
+    }
+    YUVReader reader;
+    YUVFrameView view;
+    double input_wait = 0;
+    int64_t frame_count = 0;
+    double static_threshold = argc > 2 ? atof(argv[2]) : 0;
+    StaticDetector detector;
+    if (static_threshold > 0 && !StaticDetectorInit(&detector, width, height, static_threshold, 10))
+    {
+        return -1;
+    }
 
     H264EnCoder h264_encoder;
     H264EnCoderInit(&h264_encoder, 400 * 1024, width, height, (AVRational){10, 1}, FF_PROFILE_H264_HIGH_444, AV_PIX_FMT_YUV420P);
 
     // 打开输入文件
-    inputFile = fopen("video.yuv", "rb");
-    if (!inputFile)
+    bool use_fread = strcmp(mode, "fread") == 0;
+    if (use_fread)
+    {
+        inputFile = fopen("video.yuv", "rb");
+    }
+    if (use_fread ? !inputFile : !YUVReaderOpen(&reader, "video.yuv", width, height, strcmp(mode, "readahead") == 0 ? YUV_READER_READAHEAD : YUV_READER_MMAP))
     {
         printf("无法打开输入文件\n");
         return -1;
     }
 
     // 打开输出文件
-    outputFile = fopen("video.h264", "wb");
-    if (!outputFile)
+    if (use_fwrite ? !PacketWriterOpenStdio(&writer, "video.h264") : !PacketWriterOpen(&writer, "video.h264", 256 * 1024, 200, strcmp(write_mode, "thread") == 0, &sink_option))
     {
         printf("无法打开输出文件\n");
         return -1;
     }
 
     // 逐帧读取 YUV 数据并编码为 H.264
-
+    double start = now_seconds();
     while (1)
     {
-        int ret = av_frame_make_writable(h264_encoder.frame);
-        if (ret < 0)
+        double wait_start = now_seconds();
+        bool fetched;
+        if (use_fread)
         {
-            break;
+            if (!H264EnCoderFrameWritable(&h264_encoder))
+            {
+                break;
+            }
+            if (fread(h264_encoder.frame->data[0], 1, width * height, inputFile) <= 0 ||
+                fread(h264_encoder.frame->data[1], 1, width * height / 4, inputFile) <= 0 ||
+                fread(h264_encoder.frame->data[2], 1, width * height / 4, inputFile) <= 0)
+            {
+                break;
+            }
+            input_wait += now_seconds() - wait_start;
+            h264_encoder.frame->pts = frame_count++;
+            if (static_threshold > 0 && StaticDetectorSkip(&detector, h264_encoder.frame->data, h264_encoder.frame->linesize))
+            {
+                continue;
+            }
+            fetched = H264EnCoderFetchFrame(&h264_encoder);
         }
-        if (fread(h264_encoder.frame->data[0], 1, width * height, inputFile) <= 0 ||
-            fread(h264_encoder.frame->data[1], 1, width * height / 4, inputFile) <= 0 ||
-            fread(h264_encoder.frame->data[2], 1, width * height / 4, inputFile) <= 0)
+        else
         {
-            break;
+            // 直接把 mmap 或预读缓冲区的指针交给编码器, 不再拷贝
+            if (!YUVReaderNext(&reader, &view))
+            {
+                break;
+            }
+            // mmap 的 I/O 发生在第一次访问页的时候, 在这里碰一遍, 三种方式的等待时间才可比
+            yuv_view_prefault(&view, width, height);
+            input_wait += now_seconds() - wait_start;
+            // 跳过的帧不占 pts, 下一个编码帧带着自己的序号, 上一帧的显示时间自然变长
+            h264_encoder.frame->pts = frame_count++;
+            if (static_threshold > 0 && StaticDetectorSkip(&detector, view.data, view.linesize))
+            {
+                YUVReaderRelease(&reader, view.data[0]);
+                continue;
+            }
+            fetched = H264EnCoderFetchExternalFrame(&h264_encoder, view.data, view.linesize, yuv_view_release, &reader);
         }
-
-        if (!H264EnCoderFetchFrame(&h264_encoder))
+        if (!fetched)
         {
             printf("fetch error!\n");
             break;
@@ -244,19 +905,38 @@ int main(void)
         while (H264EnCoderEncode(&h264_encoder) > 0)
         {
             // 写入编码数据到输出文件
-            fwrite(h264_encoder.pkt->data, 1, h264_encoder.pkt->size, outputFile);
+            PacketWriterWrite(&writer, h264_encoder.pkt, NULL, 0);
         }
     }
     H264EnCoderFlush(&h264_encoder);
     while (H264EnCoderEncode(&h264_encoder) > 0)
     {
         // 写入编码数据到输出文件
-        fwrite(h264_encoder.pkt->data, 1, h264_encoder.pkt->size, outputFile);
+        PacketWriterWrite(&writer, h264_encoder.pkt, NULL, 0);
         av_packet_unref(h264_encoder.pkt);
     }
+    double elapsed = now_seconds() - start;
+    printf("%s: %ld frames in %.2fs, encoder idle waiting for input %.1fms (%.1f%%)\n", mode, frame_count, elapsed, input_wait * 1000, elapsed > 0 ? input_wait * 100 / elapsed : 0);
+    printf("cpu time %.2fs\n", cpu_seconds());
+    if (static_threshold > 0)
+    {
+        StaticDetectorReport(&detector, "video");
+        StaticDetectorDestroy(&detector);
+    }
+
     // 释放资源
-    fclose(inputFile);
-    fclose(outputFile);
+    if (use_fread)
+    {
+        fclose(inputFile);
+    }
+    else
+    {
+        YUVReaderClose(&reader);
+    }
+    // 关闭之后最后一批才写完, 写线程也已退出, 统计才完整
+    PacketWriterClose(&writer);
+    PacketWriterReport(&writer, "h264");
     H264EnCoderDestroy(&h264_encoder);
     return 0;
 }
+#endif
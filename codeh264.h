@@ -4,11 +4,38 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
 #include <libavcodec/avcodec.h>
 #include <libavformat/avformat.h>
 #include <libswscale/swscale.h>
 #include <libavutil/opt.h>
 #include <libavutil/imgutils.h>
+#include "encstats.h"
+#include "framepool.h"
+#include "framequeue.h"
+
+#define H264_SWITCH_HELD 64 // packets of the new context held back while the old one drains
+
+typedef enum
+{
+    H264_LATENCY_NORMAL,
+    H264_LATENCY_LOW // zerolatency tune, no b-frames, no lookahead, sliced threads: one packet out per frame in
+} H264EnCoderLatency;
+
+typedef struct
+{
+    const char *preset;
+    int gop_size;
+    int max_b_frames;
+    int thread_count; // 0: let x264 decide
+    H264EnCoderLatency latency;
+    int vbv_ms; // vbv buffer in ms of bit_rate, max rate = bit_rate. 0: no vbv
+    bool intra_refresh; // one IDR at start, then a column of intra blocks sweeps over every gop_size frames
+    double peak_ratio;  // caps a packet at peak_ratio times the average frame size through the vbv. 0: off
+    const char *x264_params; // "key=value:..." applied on top of the preset, NULL: none
+    bool requested_idr_only; // no idr but the first unless H264EnCoderRequestKeyFrame asks, gop_size is then the caller's schedule
+} H264EnCoderOption;
 
 typedef struct
 {
@@ -16,15 +43,59 @@ typedef struct
     AVCodecContext *codec_ctx;
     AVPacket *pkt;
     AVFrame *frame;
+    AVFrame *ext_frame; // wraps caller owned planes, see H264EnCoderFetchBuffer
+    FramePool *pool;    // buffers of frame, sized for send_ctx
+    EncoderStats stats; // off unless H264EnCoderEnableStats is called
+    _Atomic bool key_frame_request; // set by H264EnCoderRequestKeyFrame, taken by the next send
+    H264EnCoderOption option;
+    AVCodecContext *send_ctx;  // where frames go: codec_ctx, or next_ctx while a resize drains
+    AVCodecContext *next_ctx;  // opened by H264EnCoderPrepareContext
+    AVFrame *next_frame;
+    FramePool *next_pool;
+    H264EnCoderOption next_option;
+    bool switching;            // codec_ctx is flushed and is replaced by next_ctx at its EOF
+    bool flushing;             // H264EnCoderFlush was called
+    pthread_t drain_thread;    // receives the flushed codec_ctx's packets while switching
+    FrameQueue drained;        // AVPacket *, closed at codec_ctx's EOF
+    AVPacket *held[H264_SWITCH_HELD]; // next_ctx's packets, sent once the old ones are out
+    int held_num;
+    int held_pos;
+    pthread_t prepare_thread;  // H264EnCoderPrepareContextAsync
+    bool preparing;
+    _Atomic bool prepare_done;
+    bool prepare_ok;
+    int prepare_width;
+    int prepare_height;
+    int64_t prepare_bit_rate;
+    H264EnCoderOption prepare_option;
+    int64_t prepare_rate_change; // H264EnCoderSetBitRate while preparing, 0: none
 } H264EnCoder;
 
+typedef void (*H264EnCoderRelease)(void *opaque, uint8_t *data);
+
+void H264EnCoderOptionDefault(H264EnCoderOption *option);
+void H264EnCoderOptionLowLatency(H264EnCoderOption *option);
 void H264EnCoderInit(H264EnCoder *h264_encoder, int64_t bit_rate, int width, int height, AVRational rational, int profile, enum AVPixelFormat pixel_format);
+void H264EnCoderInitWithOption(H264EnCoder *h264_encoder, int64_t bit_rate, int width, int height, AVRational rational, int profile, enum AVPixelFormat pixel_format, const H264EnCoderOption *option);
 bool H264EnCoderCheckFormat(H264EnCoder *h264_encoder);
 bool H264EnCoderCheckFramerates(H264EnCoder *h264_encoder);
 bool H264EnCoderCheckProfile(H264EnCoder *h264_encoder);
 bool H264EnCoderCheck(H264EnCoder *h264_encoder);
+bool H264EnCoderFrameWritable(H264EnCoder *h264_encoder);
 bool H264EnCoderFetchFrame(H264EnCoder *h264_encoder);
+bool H264EnCoderFetchBuffer(H264EnCoder *h264_encoder, AVBufferRef *buf, uint8_t *const data[3], const int linesize[3]);
+bool H264EnCoderFetchExternalFrame(H264EnCoder *h264_encoder, uint8_t *const data[3], const int linesize[3], H264EnCoderRelease release, void *opaque);
+void H264EnCoderRequestKeyFrame(H264EnCoder *h264_encoder);
+void H264EnCoderSetBitRate(H264EnCoder *h264_encoder, int64_t bit_rate);
+bool H264EnCoderPrepareContext(H264EnCoder *h264_encoder, int width, int height, int64_t bit_rate, const H264EnCoderOption *option);
+bool H264EnCoderPrepareContextAsync(H264EnCoder *h264_encoder, int width, int height, int64_t bit_rate, const H264EnCoderOption *option);
+int H264EnCoderPrepared(H264EnCoder *h264_encoder);
+bool H264EnCoderPrepareResize(H264EnCoder *h264_encoder, int width, int height, int64_t bit_rate);
+bool H264EnCoderSwitchContext(H264EnCoder *h264_encoder);
 int H264EnCoderEncode(H264EnCoder *h264_encoder);
 bool H264EnCoderFlush(H264EnCoder *h264_encoder);
+int H264EnCoderDelay(H264EnCoder *h264_encoder);
+void H264EnCoderEnableStats(H264EnCoder *h264_encoder, FILE *json_fp, int json_interval_ms);
+void H264EnCoderGetStats(H264EnCoder *h264_encoder, EncoderStats *snapshot);
 void H264EnCoderDestroy(H264EnCoder *h264_encoder);
 #endif
\ No newline at end of file
@@ -0,0 +1,139 @@
+/*
+ * yuyv422 -> yuv420p 转换速度测试
+ * 先校验每个 simd 实现和 c 实现输出逐字节一致, drop 模式还要和原来的
+ * yuyv422_to_yuv420 一致, 然后输出每种实现的吞吐(MB/s, 按输入 yuyv 字节算)
+ *
+ * gcc -O2 convertbench.c yuvconvert.c -o convertbench -lpthread
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <string.h>
+#include <time.h>
+#include "yuvconvert.h"
+
+#define ITERATIONS 200
+
+/* ../video/format_convert.c 里的 yuyv422_to_yuv420, 作为 drop 模式的参考 */
+static void yuyv422_to_yuv420_ref(unsigned char *yuyv_ptr, unsigned char *yuv_ptr, int width, int height)
+{
+    int length = width * height;
+    unsigned char *y = yuv_ptr;
+    unsigned char *u = y + length;
+    unsigned char *v = u + length / 4;
+    int y_length = length * 2;
+    for (int i = 0; i < y_length; i += 2)
+    {
+        *y++ = yuyv_ptr[i];
+    }
+    int base_h = 0;
+    bool is_u = true;
+    for (int j = 0; j < height; j += 2)
+    {
+        base_h = j * width * 2;
+        for (int i = base_h + 1; i < base_h + width * 2; i += 2)
+        {
+            if (is_u)
+            {
+                *u++ = yuyv_ptr[i];
+                is_u = false;
+            }
+            else
+            {
+                *v++ = yuyv_ptr[i];
+                is_u = true;
+            }
+        }
+    }
+}
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void convert_packed(YUYVConvertFunc func, const uint8_t *yuyv, uint8_t *yuv, int width, int height, YUYV_CHROMA_MODE chroma_mode)
+{
+    uint8_t *dst[3] = {yuv, yuv + width * height, yuv + width * height + width * height / 4};
+    const int dst_stride[3] = {width, width / 2, width / 2};
+    func(yuyv, width * 2, dst, dst_stride, width, height, chroma_mode);
+}
+
+int main(void)
+{
+    const struct
+    {
+        int width;
+        int height;
+    } sizes[] = {{1280, 720}, {1920, 1080}, {3840, 2160}, {646, 362}};
+    const struct
+    {
+        const char *name;
+        YUYVConvertFunc func;
+    } impls[] = {{"c", yuyv422_to_yuv420p_c}, {"sse2", yuyv422_to_yuv420p_sse2}, {"avx2", yuyv422_to_yuv420p_avx2}};
+    const int impl_num = sizeof(impls) / sizeof(impls[0]);
+    int failed = 0;
+
+    printf("dispatch: %s\n", yuyv422_to_yuv420p_name());
+    srand(1);
+    for (size_t s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+    {
+        int width = sizes[s].width;
+        int height = sizes[s].height;
+        size_t yuyv_size = (size_t)width * height * 2;
+        size_t yuv_size = (size_t)width * height * 3 / 2;
+        uint8_t *yuyv = malloc(yuyv_size);
+        uint8_t *ref = malloc(yuv_size);
+        uint8_t *out = malloc(yuv_size);
+        if (!yuyv || !ref || !out)
+        {
+            perror("malloc failed");
+            exit(1);
+        }
+        for (size_t i = 0; i < yuyv_size; i++)
+        {
+            yuyv[i] = rand() & 0xFF;
+        }
+
+        yuyv422_to_yuv420_ref(yuyv, ref, width, height);
+        for (int i = 0; i < impl_num; i++)
+        {
+            memset(out, 0, yuv_size);
+            convert_packed(impls[i].func, yuyv, out, width, height, YUYV_CHROMA_DROP);
+            if (memcmp(out, ref, yuv_size) != 0)
+            {
+                printf("%dx%d %s drop mode differs from yuyv422_to_yuv420\n", width, height, impls[i].name);
+                failed = 1;
+            }
+        }
+        convert_packed(yuyv422_to_yuv420p_c, yuyv, ref, width, height, YUYV_CHROMA_AVERAGE);
+        for (int i = 1; i < impl_num; i++)
+        {
+            memset(out, 0, yuv_size);
+            convert_packed(impls[i].func, yuyv, out, width, height, YUYV_CHROMA_AVERAGE);
+            if (memcmp(out, ref, yuv_size) != 0)
+            {
+                printf("%dx%d %s average mode differs from c\n", width, height, impls[i].name);
+                failed = 1;
+            }
+        }
+
+        for (int i = 0; i < impl_num; i++)
+        {
+            double start = now_seconds();
+            for (int n = 0; n < ITERATIONS; n++)
+            {
+                convert_packed(impls[i].func, yuyv, out, width, height, YUYV_CHROMA_AVERAGE);
+            }
+            double elapsed = now_seconds() - start;
+            printf("%dx%d\t%s\t%.1f MB/s\t%.3f ms/frame\n", width, height, impls[i].name,
+                   yuyv_size * (double)ITERATIONS / elapsed / (1024 * 1024), elapsed * 1000 / ITERATIONS);
+        }
+        free(yuyv);
+        free(ref);
+        free(out);
+    }
+    return failed;
+}
@@ -0,0 +1,429 @@
+/*
+ * H264EnCoder / AACEnCoder 性能测试
+ * 输入是确定性的合成 yuv (移动的渐变加噪声) 和 pcm (正弦扫频), 不需要摄像头, 声卡或样本文件,
+ * 输出 帧率, 每帧 send->packet 延迟分位数, 输出字节数, 峰值 RSS, 文本和一行 JSON 各一份
+ * --latency low 使用低延迟配置, 并检查每送入一帧都立刻取出一个 packet
+ * --intra-refresh 1 用滚动帧内刷新代替周期 IDR, --peak-ratio 限制单个 packet 相对平均大小的峰值, 输出里的 peak 是实测值
+ * --bitrate-at N 在第 N 帧把码率减半, --resize-at N 在第 N 帧切换到一半分辨率, 输出预热和切换花的时间
+ * --governor 0.8 按 10fps 帧间隔的 80% 作为编码时间预算自动调整编码速度 (只改 subme/me/trellis/lookahead, 码流头不变), 输出每次调整
+ * --stats 1 打开编码器内部统计, 结束时输出 EncoderStats 快照, 也可以用来对比统计本身的开销
+ *
+ * gcc -O2 encbench.c codeh264.c framepool.c framequeue.c h264governor.c codeaac.c encstats.c sampleconvert.c -DLIO_NO_MAIN -o encbench -lavcodec -lavformat -lavutil -lswscale -lpthread -lm
+ * ./encbench [--codec h264|aac|both] [--preset slow|veryfast...] [--width 1280] [--height 720] [--threads 0] [--frames 300] [--json out.json] [--stats 1] [--latency normal|low]
+ *            [--intra-refresh 1] [--peak-ratio 2.5] [--bitrate-at 100] [--resize-at 200] [--governor 0.8]
+ */
+#include "codeh264.h"
+#include "codeaac.h"
+#include "h264governor.h"
+#include <math.h>
+#include <string.h>
+#include <time.h>
+#include <sys/resource.h>
+
+typedef struct
+{
+    const char *codec;
+    const char *preset;
+    int width;
+    int height;
+    int threads;
+    int frames;
+    const char *json_path;
+    bool stats;
+    const char *latency;
+    bool intra_refresh;
+    double peak_ratio;
+    int bitrate_at; // -1: never
+    int resize_at;  // -1: never
+    double cpu_budget; // 0: no governor
+} BenchConfig;
+
+typedef struct
+{
+    const char *name;
+    int frames;
+    int packets;
+    double elapsed;
+    int64_t bytes;
+    int held; // sends that did not give a packet back straight away
+    int max_size;
+    double *latency; // ms, per packet
+    double p50;
+    double p90;
+    double p99;
+    double max;
+} BenchResult;
+
+static double now_seconds(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int compare_double(const void *a, const void *b)
+{
+    double x = *(const double *)a;
+    double y = *(const double *)b;
+    return x < y ? -1 : x > y;
+}
+
+static void bench_result_finish(BenchResult *result)
+{
+    if (result->packets == 0)
+    {
+        return;
+    }
+    qsort(result->latency, result->packets, sizeof(double), compare_double);
+    result->p50 = result->latency[(int)(result->packets * 0.50)];
+    result->p90 = result->latency[(int)(result->packets * 0.90)];
+    result->p99 = result->latency[(int)(result->packets * 0.99)];
+    result->max = result->latency[result->packets - 1];
+}
+
+/* same picture for the same index on every run */
+static void synth_yuv(AVFrame *frame, int index)
+{
+    uint32_t seed = 0x9E3779B9u * (index + 1);
+    for (int y = 0; y < frame->height; y++)
+    {
+        uint8_t *row = frame->data[0] + y * frame->linesize[0];
+        for (int x = 0; x < frame->width; x++)
+        {
+            seed = seed * 1664525u + 1013904223u;
+            row[x] = (uint8_t)(x + y + index * 4) + (seed >> 29);
+        }
+    }
+    for (int p = 1; p < 3; p++)
+    {
+        for (int y = 0; y < frame->height / 2; y++)
+        {
+            memset(frame->data[p] + y * frame->linesize[p], (uint8_t)(128 + (p == 1 ? y : -y) + index), frame->width / 2);
+        }
+    }
+}
+
+static void synth_pcm(int16_t *pcm, int nb_samples, int channels, int sample_rate, int64_t start)
+{
+    for (int i = 0; i < nb_samples; i++)
+    {
+        double t = (double)(start + i) / sample_rate;
+        // 220Hz -> 880Hz sweep every second
+        double freq = 220 + 660 * fmod(t, 1.0);
+        int16_t value = (int16_t)(sin(2 * M_PI * freq * t) * 12000);
+        for (int c = 0; c < channels; c++)
+        {
+            pcm[i * channels + c] = value;
+        }
+    }
+}
+
+static int bench_h264_drain(H264EnCoder *h264_encoder, BenchResult *result, const double *send_time)
+{
+    int packets = 0;
+    while (H264EnCoderEncode(h264_encoder) > 0)
+    {
+        int64_t pts = h264_encoder->pkt->pts;
+        if (pts >= 0 && pts < result->frames)
+        {
+            result->latency[result->packets++] = (now_seconds() - send_time[pts]) * 1000;
+        }
+        result->bytes += h264_encoder->pkt->size;
+        result->max_size = FFMAX(result->max_size, h264_encoder->pkt->size);
+        packets++;
+    }
+    return packets;
+}
+
+static bool bench_h264(const BenchConfig *config, BenchResult *result)
+{
+    H264EnCoder h264_encoder;
+    H264EnCoderOption option;
+    bool low_latency = strcmp(config->latency, "low") == 0;
+    if (low_latency)
+    {
+        H264EnCoderOptionLowLatency(&option);
+    }
+    else
+    {
+        H264EnCoderOptionDefault(&option);
+    }
+    if (config->preset)
+    {
+        option.preset = config->preset;
+    }
+    option.intra_refresh = config->intra_refresh;
+    option.peak_ratio = config->peak_ratio;
+    option.thread_count = config->threads;
+    H264EnCoderInitWithOption(&h264_encoder, 400 * 1024, config->width, config->height, (AVRational){10, 1}, FF_PROFILE_H264_HIGH, AV_PIX_FMT_YUV420P, &option);
+    if (config->stats)
+    {
+        H264EnCoderEnableStats(&h264_encoder, NULL, 0);
+    }
+
+    result->name = "h264";
+    result->frames = config->frames;
+    result->latency = calloc(config->frames, sizeof(double));
+    double *send_time = calloc(config->frames, sizeof(double));
+    if (!result->latency || !send_time)
+    {
+        return false;
+    }
+
+    H264Governor governor;
+    if (config->cpu_budget > 0)
+    {
+        H264GovernorInit(&governor, &h264_encoder, config->cpu_budget, stdout);
+    }
+
+    double start = now_seconds();
+    for (int i = 0; i < config->frames; i++)
+    {
+        if (i == config->bitrate_at)
+        {
+            H264EnCoderSetBitRate(&h264_encoder, h264_encoder.send_ctx->bit_rate / 2);
+        }
+        if (i == config->resize_at)
+        {
+            double prepare_start = now_seconds();
+            if (!H264EnCoderPrepareResize(&h264_encoder, config->width / 2, config->height / 2, 0))
+            {
+                return false;
+            }
+            double switch_start = now_seconds();
+            H264EnCoderSwitchContext(&h264_encoder);
+            printf("resize at frame %d: prepare %.2fms, switch %.2fms\n", i, (switch_start - prepare_start) * 1000, (now_seconds() - switch_start) * 1000);
+        }
+        if (!H264EnCoderFrameWritable(&h264_encoder))
+        {
+            return false;
+        }
+        synth_yuv(h264_encoder.frame, i);
+        h264_encoder.frame->pts = i;
+        send_time[i] = now_seconds();
+        if (!H264EnCoderFetchFrame(&h264_encoder))
+        {
+            return false;
+        }
+        if (bench_h264_drain(&h264_encoder, result, send_time) != 1)
+        {
+            result->held++;
+        }
+        if (config->cpu_budget > 0)
+        {
+            H264GovernorFrame(&governor, i, now_seconds() - send_time[i]);
+        }
+    }
+    H264EnCoderFlush(&h264_encoder);
+    bench_h264_drain(&h264_encoder, result, send_time);
+    result->elapsed = now_seconds() - start;
+    if (config->cpu_budget > 0)
+    {
+        printf("governor: %d adaptations, final speed %s\n", governor.adaptations, H264GovernorPreset(&governor));
+    }
+    if (low_latency && result->held > 0)
+    {
+        printf("low latency: %d of %d frames did not come out right after send\n", result->held, config->frames);
+    }
+    if (config->stats)
+    {
+        EncoderStats snapshot;
+        H264EnCoderGetStats(&h264_encoder, &snapshot);
+        EncoderStatsWriteJson(&snapshot, stdout);
+    }
+
+    free(send_time);
+    H264EnCoderDestroy(&h264_encoder);
+    return true;
+}
+
+static void bench_aac_drain(AACEnCoder *aac_encoder, BenchResult *result, const double *send_time)
+{
+    int frame_size = aac_encoder->codec_ctx->frame_size;
+    while (AACEnCoderEnCode(aac_encoder) > 0)
+    {
+        // pts count input samples minus the encoder's initial_padding, the priming packet comes out below 0
+        int64_t pts = aac_encoder->pkt->pts;
+        if (pts >= 0 && pts / frame_size < result->frames && result->packets < result->frames)
+        {
+            result->latency[result->packets++] = (now_seconds() - send_time[pts / frame_size]) * 1000;
+        }
+        result->bytes += aac_encoder->pkt->size;
+        result->max_size = FFMAX(result->max_size, aac_encoder->pkt->size);
+    }
+}
+
+static bool bench_aac(const BenchConfig *config, BenchResult *result)
+{
+    AACEnCoder aac_encoder;
+    AACEnCoderInit(&aac_encoder, 128 * 1024, AV_CH_LAYOUT_STEREO, 44100, FF_PROFILE_AAC_LOW, AV_SAMPLE_FMT_FLTP);
+    AACEnCoderSetInputFormat(&aac_encoder, AV_SAMPLE_FMT_S16);
+    if (config->stats)
+    {
+        AACEnCoderEnableStats(&aac_encoder, NULL, 0);
+    }
+    int frame_size = aac_encoder.codec_ctx->frame_size;
+    int channels = aac_encoder.codec_ctx->channels;
+    // as long as the video run at 10 fps
+    int frames = config->frames * 44100 / frame_size / 10;
+
+    result->name = "aac";
+    result->frames = frames;
+    result->latency = calloc(frames, sizeof(double));
+    double *send_time = calloc(frames, sizeof(double));
+    int16_t *pcm = malloc(sizeof(int16_t) * frame_size * channels);
+    if (!result->latency || !send_time || !pcm)
+    {
+        return false;
+    }
+
+    double start = now_seconds();
+    for (int i = 0; i < frames; i++)
+    {
+        synth_pcm(pcm, frame_size, channels, 44100, (int64_t)i * frame_size);
+        send_time[i] = now_seconds();
+        if (!AACEnCoderFetchSamples(&aac_encoder, pcm, frame_size))
+        {
+            return false;
+        }
+        bench_aac_drain(&aac_encoder, result, send_time);
+    }
+    AACEncoderFlush(&aac_encoder);
+    bench_aac_drain(&aac_encoder, result, send_time);
+    result->elapsed = now_seconds() - start;
+    if (config->stats)
+    {
+        EncoderStats snapshot;
+        AACEnCoderGetStats(&aac_encoder, &snapshot);
+        EncoderStatsWriteJson(&snapshot, stdout);
+    }
+
+    free(pcm);
+    free(send_time);
+    AACEncoderDestroy(&aac_encoder);
+    return true;
+}
+
+static long peak_rss_kb(void)
+{
+    struct rusage usage;
+    getrusage(RUSAGE_SELF, &usage);
+    return usage.ru_maxrss;
+}
+
+static double peak_ratio(const BenchResult *result)
+{
+    return result->bytes > 0 ? (double)result->max_size * result->packets / result->bytes : 0;
+}
+
+static void print_text(const BenchResult *result)
+{
+    printf("%s\tframes:%d\t%.1f fps\tbytes:%ld\tlatency ms p50:%.2f p90:%.2f p99:%.2f max:%.2f\theld:%d\tpeak:%.2f\n",
+           result->name, result->frames, result->frames / result->elapsed, result->bytes,
+           result->p50, result->p90, result->p99, result->max, result->held, peak_ratio(result));
+}
+
+static void print_json(FILE *fp, const BenchConfig *config, const BenchResult *results, int result_num)
+{
+    fprintf(fp, "{\"preset\":\"%s\",\"latency\":\"%s\",\"width\":%d,\"height\":%d,\"threads\":%d,\"peak_rss_kb\":%ld,\"results\":[",
+            config->preset ? config->preset : "default", config->latency, config->width, config->height, config->threads, peak_rss_kb());
+    for (int i = 0; i < result_num; i++)
+    {
+        const BenchResult *result = &results[i];
+        fprintf(fp, "%s{\"codec\":\"%s\",\"frames\":%d,\"packets\":%d,\"seconds\":%.4f,\"fps\":%.2f,\"bytes\":%ld,\"held\":%d,\"peak_ratio\":%.3f,"
+                    "\"latency_ms\":{\"p50\":%.3f,\"p90\":%.3f,\"p99\":%.3f,\"max\":%.3f}}",
+                i ? "," : "", result->name, result->frames, result->packets, result->elapsed, result->frames / result->elapsed,
+                result->bytes, result->held, peak_ratio(result), result->p50, result->p90, result->p99, result->max);
+    }
+    fprintf(fp, "]}\n");
+}
+
+int main(int argc, char **argv)
+{
+    BenchConfig config = {.codec = "both", .latency = "normal", .width = 1280, .height = 720, .threads = 0, .frames = 300, .bitrate_at = -1, .resize_at = -1};
+    for (int i = 1; i + 1 < argc; i += 2)
+    {
+        if (strcmp(argv[i], "--codec") == 0)
+            config.codec = argv[i + 1];
+        else if (strcmp(argv[i], "--preset") == 0)
+            config.preset = argv[i + 1];
+        else if (strcmp(argv[i], "--width") == 0)
+            config.width = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--height") == 0)
+            config.height = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--threads") == 0)
+            config.threads = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--frames") == 0)
+            config.frames = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--json") == 0)
+            config.json_path = argv[i + 1];
+        else if (strcmp(argv[i], "--latency") == 0)
+            config.latency = argv[i + 1];
+        else if (strcmp(argv[i], "--intra-refresh") == 0)
+            config.intra_refresh = atoi(argv[i + 1]) != 0;
+        else if (strcmp(argv[i], "--peak-ratio") == 0)
+            config.peak_ratio = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "--bitrate-at") == 0)
+            config.bitrate_at = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--resize-at") == 0)
+            config.resize_at = atoi(argv[i + 1]);
+        else if (strcmp(argv[i], "--governor") == 0)
+            config.cpu_budget = atof(argv[i + 1]);
+        else if (strcmp(argv[i], "--stats") == 0)
+            config.stats = atoi(argv[i + 1]) != 0;
+        else
+        {
+            printf("unknown option %s\n", argv[i]);
+            return -1;
+        }
+    }
+
+    BenchResult results[2];
+    memset(results, 0, sizeof(results));
+    int result_num = 0;
+    if (strcmp(config.codec, "aac") != 0)
+    {
+        if (!bench_h264(&config, &results[result_num]))
+        {
+            printf("h264 bench failed\n");
+            return -1;
+        }
+        bench_result_finish(&results[result_num++]);
+    }
+    if (strcmp(config.codec, "h264") != 0)
+    {
+        if (!bench_aac(&config, &results[result_num]))
+        {
+            printf("aac bench failed\n");
+            return -1;
+        }
+        bench_result_finish(&results[result_num++]);
+    }
+
+    printf("\npreset:%s latency:%s %dx%d threads:%d peak rss:%ldKB\n", config.preset ? config.preset : "default", config.latency, config.width, config.height, config.threads, peak_rss_kb());
+    for (int i = 0; i < result_num; i++)
+    {
+        print_text(&results[i]);
+    }
+    print_json(stdout, &config, results, result_num);
+    if (config.json_path)
+    {
+        FILE *fp = fopen(config.json_path, "w");
+        if (fp)
+        {
+            print_json(fp, &config, results, result_num);
+            fclose(fp);
+        }
+    }
+    int ret = 0;
+    for (int i = 0; i < result_num; i++)
+    {
+        // 低延迟配置下有帧被编码器压住算失败
+        if (strcmp(config.latency, "low") == 0 && results[i].held > 0)
+        {
+            ret = 1;
+        }
+        free(results[i].latency);
+    }
+    return ret;
+}
@@ -0,0 +1,137 @@
+#include "encstats.h"
+#include <string.h>
+
+void EncoderStatsEnable(EncoderStats *stats, const char *name, AVRational time_base, FILE *json_fp, int json_interval_ms)
+{
+    memset(stats, 0, sizeof(EncoderStats));
+    stats->name = name;
+    stats->time_base = time_base;
+    stats->last_type = '-';
+    stats->json_fp = json_fp;
+    stats->json_interval_ns = json_interval_ms * 1000000LL;
+    stats->json_last_ns = EncoderStatsNow();
+    stats->enabled = true;
+}
+
+/* called at the start of an encoder call, returns the timestamp to hand back on exit */
+int64_t EncoderStatsEnter(EncoderStats *stats)
+{
+    int64_t now = EncoderStatsNow();
+    if (stats->last_exit_ns)
+    {
+        stats->outside_ns += now - stats->last_exit_ns;
+    }
+    return now;
+}
+
+static int64_t encoder_stats_exit(EncoderStats *stats, int64_t start_ns)
+{
+    int64_t now = EncoderStatsNow();
+    stats->last_exit_ns = now;
+    return now - start_ns;
+}
+
+void EncoderStatsSend(EncoderStats *stats, int64_t start_ns, int ret)
+{
+    int64_t elapsed = encoder_stats_exit(stats, start_ns);
+    stats->send_ns += elapsed;
+    if (elapsed > stats->send_max_ns)
+    {
+        stats->send_max_ns = elapsed;
+    }
+    if (ret >= 0)
+    {
+        stats->frames_sent++;
+    }
+}
+
+static void encoder_stats_packet(EncoderStats *stats, const AVPacket *pkt)
+{
+    int side_size = 0;
+    uint8_t *quality = av_packet_get_side_data(pkt, AV_PKT_DATA_QUALITY_STATS, &side_size);
+    stats->packets_received++;
+    stats->bytes += pkt->size;
+    stats->last_size = pkt->size;
+    if (pkt->size > stats->max_size)
+    {
+        stats->max_size = pkt->size;
+    }
+    stats->last_pts = pkt->pts;
+    stats->last_keyframe = pkt->flags & AV_PKT_FLAG_KEY;
+    // quality stats side data: le32 quality, u8 pict_type
+    stats->last_type = quality && side_size >= 5 ? av_get_picture_type_char(quality[4]) : '-';
+    if (stats->last_keyframe)
+    {
+        stats->keyframes++;
+    }
+
+    if (stats->window_num == ENC_STATS_WINDOW)
+    {
+        stats->window_bytes -= stats->window_size[stats->window_pos];
+    }
+    else
+    {
+        stats->window_num++;
+    }
+    // dts: packets come out in decode order, with b-frames their pts don't grow monotonically
+    int64_t dts = pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+    stats->window_size[stats->window_pos] = pkt->size;
+    stats->window_dts[stats->window_pos] = dts;
+    stats->window_bytes += pkt->size;
+    int oldest = stats->window_num == ENC_STATS_WINDOW ? (stats->window_pos + 1) % ENC_STATS_WINDOW : 0;
+    stats->window_pos = (stats->window_pos + 1) % ENC_STATS_WINDOW;
+
+    // span of the window, counting the last packet as long as the average one
+    int64_t span = dts - stats->window_dts[oldest];
+    if (stats->window_num > 1 && span > 0)
+    {
+        span += span / (stats->window_num - 1);
+        stats->bitrate = stats->window_bytes * 8 / (span * av_q2d(stats->time_base));
+    }
+}
+
+void EncoderStatsReceive(EncoderStats *stats, int64_t start_ns, int ret, const AVPacket *pkt)
+{
+    int64_t elapsed = encoder_stats_exit(stats, start_ns);
+    stats->receive_ns += elapsed;
+    if (elapsed > stats->receive_max_ns)
+    {
+        stats->receive_max_ns = elapsed;
+    }
+    if (ret < 0)
+    {
+        return;
+    }
+    encoder_stats_packet(stats, pkt);
+
+    if (stats->json_fp && stats->last_exit_ns - stats->json_last_ns >= stats->json_interval_ns)
+    {
+        stats->json_last_ns = stats->last_exit_ns;
+        EncoderStatsWriteJson(stats, stats->json_fp);
+    }
+}
+
+/* frames inside the encoder that have not come out as packets yet */
+int64_t EncoderStatsQueueDepth(const EncoderStats *stats)
+{
+    return stats->frames_sent - stats->packets_received;
+}
+
+/* largest packet over the average packet size */
+double EncoderStatsPeakRatio(const EncoderStats *stats)
+{
+    return stats->bytes > 0 ? (double)stats->max_size * stats->packets_received / stats->bytes : 0;
+}
+
+void EncoderStatsWriteJson(const EncoderStats *stats, FILE *fp)
+{
+    fprintf(fp, "{\"encoder\":\"%s\",\"frames_sent\":%ld,\"packets\":%ld,\"queue_depth\":%ld,"
+                "\"send_us\":{\"total\":%ld,\"max\":%ld},\"receive_us\":{\"total\":%ld,\"max\":%ld},\"outside_us\":%ld,"
+                "\"bytes\":%ld,\"keyframes\":%ld,\"bitrate\":%.0f,\"max_size\":%d,\"peak_ratio\":%.2f,"
+                "\"last\":{\"pts\":%ld,\"type\":\"%c\",\"size\":%d,\"key\":%s}}\n",
+            stats->name, stats->frames_sent, stats->packets_received, EncoderStatsQueueDepth(stats),
+            stats->send_ns / 1000, stats->send_max_ns / 1000, stats->receive_ns / 1000, stats->receive_max_ns / 1000, stats->outside_ns / 1000,
+            stats->bytes, stats->keyframes, stats->bitrate, stats->max_size, EncoderStatsPeakRatio(stats),
+            stats->last_pts, stats->last_type, stats->last_size, stats->last_keyframe ? "true" : "false");
+    fflush(fp);
+}
@@ -0,0 +1,66 @@
+#ifndef _ENCSTATS_H
+#define _ENCSTATS_H
+
+#include <stdio.h>
+#include <stdint.h>
+#include <stdbool.h>
+#include <time.h>
+#include <libavcodec/avcodec.h>
+
+#define ENC_STATS_WINDOW 64
+
+/*
+ * opt-in per call statistics of one encoder. while disabled the encoder only
+ * tests `enabled` and never reads the clock.
+ * times are CLOCK_MONOTONIC nanoseconds, pts/bitrate use time_base.
+ */
+typedef struct
+{
+    bool enabled;
+    const char *name;
+    AVRational time_base;
+
+    int64_t frames_sent;
+    int64_t packets_received;
+    int64_t send_ns;        // total time inside avcodec_send_frame
+    int64_t send_max_ns;
+    int64_t receive_ns;     // total time inside avcodec_receive_packet
+    int64_t receive_max_ns;
+    int64_t outside_ns;     // time between encoder calls, i.e. caller side work and io
+    int64_t last_exit_ns;
+
+    int64_t bytes;
+    int64_t keyframes;
+    char last_type; // I/P/B for video, '-' when the codec doesn't tell
+    int last_size;
+    int max_size;
+    bool last_keyframe;
+    int64_t last_pts;
+
+    int window_pos;
+    int window_num;
+    int window_size[ENC_STATS_WINDOW];
+    int64_t window_dts[ENC_STATS_WINDOW];
+    int64_t window_bytes;
+    double bitrate; // bits per second over the last ENC_STATS_WINDOW packets
+
+    FILE *json_fp;
+    int64_t json_interval_ns;
+    int64_t json_last_ns;
+} EncoderStats;
+
+static inline int64_t EncoderStatsNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+void EncoderStatsEnable(EncoderStats *stats, const char *name, AVRational time_base, FILE *json_fp, int json_interval_ms);
+int64_t EncoderStatsEnter(EncoderStats *stats);
+void EncoderStatsSend(EncoderStats *stats, int64_t start_ns, int ret);
+void EncoderStatsReceive(EncoderStats *stats, int64_t start_ns, int ret, const AVPacket *pkt);
+int64_t EncoderStatsQueueDepth(const EncoderStats *stats);
+double EncoderStatsPeakRatio(const EncoderStats *stats);
+void EncoderStatsWriteJson(const EncoderStats *stats, FILE *fp);
+#endif
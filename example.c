@@ -207,6 +207,7 @@ static int encode(AVCodecContext *ctx, AVFrame *frame, AVPacket *pkt, FILE *outp
         /* 是否需要释放数据? avcodec_receive_packet第一个调用的就是 av_packet_unref
          * 所以我们不用手动去释放，这里有个问题，不能将pkt直接插入到队列，因为编码器会释放数据
          * 可以新分配一个pkt, 然后使用av_packet_move_ref转移pkt对应的buffer
+         * packetpool.h 的 PacketPoolTake 就是这样做的, pkt 从预分配的池里取, 用完 PacketPoolRelease 放回
          */
         // av_packet_unref(pkt);
     }
@@ -0,0 +1,223 @@
+#include "framediff.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include <time.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define FRAME_DIFF_X86 1
+#endif
+
+static inline uint64_t sad_row_c(const uint8_t *a, const uint8_t *b, int x, int width)
+{
+    uint64_t sum = 0;
+    for (; x < width; x++)
+    {
+        sum += a[x] > b[x] ? a[x] - b[x] : b[x] - a[x];
+    }
+    return sum;
+}
+
+uint64_t plane_sad_c(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height)
+{
+    uint64_t sum = 0;
+    for (int y = 0; y < height; y++)
+    {
+        sum += sad_row_c(a + y * a_stride, b + y * b_stride, 0, width);
+    }
+    return sum;
+}
+
+#ifdef FRAME_DIFF_X86
+uint64_t plane_sad_sse2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height)
+{
+    int simd_width = width & ~15;
+    __m128i acc = _mm_setzero_si128();
+    uint64_t sum = 0;
+    for (int y = 0; y < height; y++)
+    {
+        const uint8_t *row_a = a + y * a_stride;
+        const uint8_t *row_b = b + y * b_stride;
+        for (int x = 0; x < simd_width; x += 16)
+        {
+            // psadbw: two 64 bit lanes, each the sum of 8 absolute differences
+            __m128i va = _mm_loadu_si128((const __m128i *)(row_a + x));
+            __m128i vb = _mm_loadu_si128((const __m128i *)(row_b + x));
+            acc = _mm_add_epi64(acc, _mm_sad_epu8(va, vb));
+        }
+        sum += sad_row_c(row_a, row_b, simd_width, width);
+    }
+    return sum + (uint64_t)_mm_cvtsi128_si64(acc) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(acc, acc));
+}
+
+__attribute__((target("avx2"))) uint64_t plane_sad_avx2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height)
+{
+    int simd_width = width & ~31;
+    __m256i acc = _mm256_setzero_si256();
+    uint64_t sum = 0;
+    for (int y = 0; y < height; y++)
+    {
+        const uint8_t *row_a = a + y * a_stride;
+        const uint8_t *row_b = b + y * b_stride;
+        for (int x = 0; x < simd_width; x += 32)
+        {
+            __m256i va = _mm256_loadu_si256((const __m256i *)(row_a + x));
+            __m256i vb = _mm256_loadu_si256((const __m256i *)(row_b + x));
+            acc = _mm256_add_epi64(acc, _mm256_sad_epu8(va, vb));
+        }
+        sum += sad_row_c(row_a, row_b, simd_width, width);
+    }
+    __m128i half = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+    return sum + (uint64_t)_mm_cvtsi128_si64(half) + (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(half, half));
+}
+#else
+uint64_t plane_sad_sse2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height)
+{
+    return plane_sad_c(a, a_stride, b, b_stride, width, height);
+}
+
+uint64_t plane_sad_avx2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height)
+{
+    return plane_sad_c(a, a_stride, b, b_stride, width, height);
+}
+#endif
+
+static pthread_once_t sad_once = PTHREAD_ONCE_INIT;
+static PlaneSADFunc sad_func = plane_sad_c;
+static const char *sad_name = "c";
+
+static void plane_sad_select(void)
+{
+#ifdef FRAME_DIFF_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        sad_func = plane_sad_avx2;
+        sad_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        sad_func = plane_sad_sse2;
+        sad_name = "sse2";
+    }
+#endif
+}
+
+uint64_t plane_sad(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height)
+{
+    pthread_once(&sad_once, plane_sad_select);
+    return sad_func(a, a_stride, b, b_stride, width, height);
+}
+
+const char *plane_sad_name(void)
+{
+    pthread_once(&sad_once, plane_sad_select);
+    return sad_name;
+}
+
+bool StaticDetectorInit(StaticDetector *detector, int width, int height, double threshold, int max_skip)
+{
+    memset(detector, 0, sizeof(StaticDetector));
+    detector->ref = malloc((size_t)width * height * 3 / 2);
+    if (!detector->ref)
+    {
+        perror("static detector alloc failed");
+        return false;
+    }
+    detector->width = width;
+    detector->height = height;
+    detector->threshold = threshold;
+    detector->max_skip = max_skip;
+    pthread_once(&sad_once, plane_sad_select);
+    return true;
+}
+
+/* worst tile mean absolute difference, stops early once a tile is over limit */
+static double plane_worst_tile(const uint8_t *plane, int stride, const uint8_t *ref, int ref_stride, int width, int height, int tile, double limit)
+{
+    double worst = 0;
+    for (int y = 0; y < height; y += tile)
+    {
+        int tile_h = height - y < tile ? height - y : tile;
+        for (int x = 0; x < width; x += tile)
+        {
+            int tile_w = width - x < tile ? width - x : tile;
+            double mad = (double)sad_func(plane + y * stride + x, stride, ref + y * ref_stride + x, ref_stride, tile_w, tile_h) / (tile_w * tile_h);
+            if (mad > worst)
+            {
+                worst = mad;
+                if (worst >= limit)
+                {
+                    return worst;
+                }
+            }
+        }
+    }
+    return worst;
+}
+
+/*
+ * true when the frame can be left out. a frame that is kept becomes the new
+ * reference. the caller gives a skipped frame no pts of its own: the next
+ * encoded frame carries its capture pts, so the last one simply lasts longer.
+ */
+bool StaticDetectorSkip(StaticDetector *detector, uint8_t *const data[3], const int linesize[3])
+{
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    int width = detector->width;
+    int height = detector->height;
+    uint8_t *ref[3] = {detector->ref, detector->ref + width * height, detector->ref + width * height * 5 / 4};
+    int ref_stride[3] = {width, width / 2, width / 2};
+
+    bool skip = false;
+    detector->frames++;
+    if (detector->has_ref && detector->run < detector->max_skip)
+    {
+        double score = 0;
+        for (int i = 0; i < 3 && score < detector->threshold; i++)
+        {
+            int tile = i ? STATIC_TILE / 2 : STATIC_TILE;
+            double plane_score = plane_worst_tile(data[i], linesize[i], ref[i], ref_stride[i], i ? width / 2 : width, i ? height / 2 : height, tile, detector->threshold);
+            score = plane_score > score ? plane_score : score;
+        }
+        detector->last_score = score;
+        skip = score < detector->threshold;
+    }
+    if (skip)
+    {
+        detector->skipped++;
+        detector->run++;
+    }
+    else
+    {
+        for (int i = 0; i < 3; i++)
+        {
+            int plane_w = i ? width / 2 : width;
+            for (int y = 0; y < (i ? height / 2 : height); y++)
+            {
+                memcpy(ref[i] + y * ref_stride[i], data[i] + y * linesize[i], plane_w);
+            }
+        }
+        detector->has_ref = true;
+        detector->run = 0;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    detector->analyse_seconds += end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+    return skip;
+}
+
+void StaticDetectorReport(StaticDetector *detector, const char *name)
+{
+    printf("%s static frames skipped:%ld/%ld (%.1f%%) analysis:%.2fms/frame sad:%s\n", name, detector->skipped, detector->frames,
+           detector->frames ? detector->skipped * 100.0 / detector->frames : 0,
+           detector->frames ? detector->analyse_seconds * 1000 / detector->frames : 0, plane_sad_name());
+}
+
+void StaticDetectorDestroy(StaticDetector *detector)
+{
+    free(detector->ref);
+    detector->ref = NULL;
+}
@@ -0,0 +1,47 @@
+#ifndef _FRAMEDIFF_H
+#define _FRAMEDIFF_H
+
+#include <stdint.h>
+#include <stdbool.h>
+
+/* sum of absolute differences of two 8 bit planes */
+typedef uint64_t (*PlaneSADFunc)(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+
+uint64_t plane_sad_c(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+uint64_t plane_sad_sse2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+uint64_t plane_sad_avx2(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+
+/* picks the widest kernel the running cpu supports */
+uint64_t plane_sad(const uint8_t *a, int a_stride, const uint8_t *b, int b_stride, int width, int height);
+const char *plane_sad_name(void);
+
+#define STATIC_TILE 64 // luma tile, chroma tiles are half of it
+
+/*
+ * decides whether a yuv420p frame can be skipped because it looks like the
+ * last frame that was encoded. the picture is split in tiles and the frame
+ * only counts as static when every tile's mean absolute difference stays
+ * under threshold, so a small moving object isn't averaged away by a still
+ * background. comparing against the last encoded frame rather than the
+ * previous input keeps slow changes from creeping through unnoticed.
+ */
+typedef struct
+{
+    int width;
+    int height;
+    double threshold; // per pixel mean absolute difference of the worst tile
+    int max_skip;     // encode at least every max_skip + 1 frames anyway
+    uint8_t *ref;     // last encoded frame, packed yuv420p
+    bool has_ref;
+    int run; // frames skipped since the last encoded one
+    double last_score;
+    int64_t frames;
+    int64_t skipped;
+    double analyse_seconds;
+} StaticDetector;
+
+bool StaticDetectorInit(StaticDetector *detector, int width, int height, double threshold, int max_skip);
+bool StaticDetectorSkip(StaticDetector *detector, uint8_t *const data[3], const int linesize[3]);
+void StaticDetectorReport(StaticDetector *detector, const char *name);
+void StaticDetectorDestroy(StaticDetector *detector);
+#endif
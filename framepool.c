@@ -0,0 +1,194 @@
+#include "framepool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define FRAME_POOL_HUGE_PAGE (2 * 1024 * 1024)
+
+static void frame_pool_buffer_free(void *opaque, uint8_t *data)
+{
+    // the memory belongs to a slab, released with the pool
+    (void)opaque;
+    (void)data;
+}
+
+static bool frame_pool_new_slab(FramePool *pool)
+{
+    if (pool->slab_num == FRAME_POOL_MAX_SLABS)
+    {
+        printf("frame pool out of slabs\n");
+        return false;
+    }
+    size_t size = pool->buf_stride * pool->slab_buffers;
+    void *slab = MAP_FAILED;
+    bool huge = false;
+    if (pool->hugepages)
+    {
+        size_t huge_size = (size + FRAME_POOL_HUGE_PAGE - 1) / FRAME_POOL_HUGE_PAGE * FRAME_POOL_HUGE_PAGE;
+        slab = mmap(NULL, huge_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+        if (slab != MAP_FAILED)
+        {
+            size = huge_size;
+            huge = true;
+        }
+    }
+    if (slab == MAP_FAILED)
+    {
+        slab = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (slab == MAP_FAILED)
+        {
+            perror("frame pool mmap failed");
+            return false;
+        }
+        if (pool->hugepages)
+        {
+            // no reserved huge pages, ask for transparent ones instead
+            madvise(slab, size, MADV_HUGEPAGE);
+        }
+    }
+    pool->slabs[pool->slab_num] = slab;
+    pool->slab_size[pool->slab_num] = size;
+    pool->slab_huge[pool->slab_num] = huge;
+    pool->slab_num++;
+    pool->slab_used = 0;
+    return true;
+}
+
+/* only called when the pool has no free buffer left */
+static AVBufferRef *frame_pool_alloc(void *opaque, int size)
+{
+    FramePool *pool = opaque;
+    AVBufferRef *buf = NULL;
+    pthread_mutex_lock(&pool->lock);
+    if ((pool->slab_num == 0 || pool->slab_used == pool->slab_buffers) && !frame_pool_new_slab(pool))
+    {
+        pthread_mutex_unlock(&pool->lock);
+        return NULL;
+    }
+    uint8_t *data = pool->slabs[pool->slab_num - 1] + pool->buf_stride * pool->slab_used;
+    buf = av_buffer_create(data, size, frame_pool_buffer_free, pool, 0);
+    if (buf)
+    {
+        pool->slab_used++;
+        atomic_fetch_add(&pool->allocs, 1);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return buf;
+}
+
+/* the pool was uninit'd and its last buffer came back */
+static void frame_pool_free(void *opaque)
+{
+    FramePool *pool = opaque;
+    for (int i = 0; i < pool->slab_num; i++)
+    {
+        munmap(pool->slabs[i], pool->slab_size[i]);
+    }
+    pool->slab_num = 0;
+    pthread_mutex_destroy(&pool->lock);
+    if (pool->owned)
+    {
+        free(pool);
+    }
+}
+
+/* slab_buffers buffers of buf_size bytes are mapped at a time */
+bool FramePoolInit(FramePool *pool, size_t buf_size, int slab_buffers, bool hugepages)
+{
+    memset(pool, 0, sizeof(FramePool));
+    pool->buf_size = buf_size;
+    pool->buf_stride = (buf_size + FRAME_POOL_ALIGN - 1) / FRAME_POOL_ALIGN * FRAME_POOL_ALIGN;
+    pool->slab_buffers = slab_buffers > 0 ? slab_buffers : 1;
+    pool->hugepages = hugepages;
+    atomic_init(&pool->gets, 0);
+    atomic_init(&pool->allocs, 0);
+    pthread_mutex_init(&pool->lock, NULL);
+    pool->pool = av_buffer_pool_init2(buf_size, pool, frame_pool_alloc, frame_pool_free);
+    if (!pool->pool)
+    {
+        perror("frame pool init failed");
+        pthread_mutex_destroy(&pool->lock);
+        return false;
+    }
+    return true;
+}
+
+/* bytes of one picture laid out by FramePoolGetFrame */
+size_t FramePoolImageSize(enum AVPixelFormat pix_fmt, int width, int height)
+{
+    return av_image_get_buffer_size(pix_fmt, width, height, FRAME_POOL_ALIGN);
+}
+
+AVBufferRef *FramePoolGet(FramePool *pool)
+{
+    atomic_fetch_add(&pool->gets, 1);
+    return av_buffer_pool_get(pool->pool);
+}
+
+/*
+ * a refcounted frame backed by one pool buffer. rows are padded so every
+ * plane and every line starts FRAME_POOL_ALIGN aligned. the pool's buf_size
+ * has to be at least FramePoolImageSize.
+ */
+bool FramePoolGetFrame(FramePool *pool, AVFrame *frame, enum AVPixelFormat pix_fmt, int width, int height)
+{
+    if (FramePoolImageSize(pix_fmt, width, height) > pool->buf_size)
+    {
+        printf("frame pool buffers too small for %dx%d\n", width, height);
+        return false;
+    }
+    frame->buf[0] = FramePoolGet(pool);
+    if (!frame->buf[0])
+    {
+        return false;
+    }
+    frame->format = pix_fmt;
+    frame->width = width;
+    frame->height = height;
+    av_image_fill_arrays(frame->data, frame->linesize, frame->buf[0]->data, pix_fmt, width, height, FRAME_POOL_ALIGN);
+    return true;
+}
+
+void FramePoolReport(FramePool *pool, const char *name)
+{
+    int huge = 0;
+    pthread_mutex_lock(&pool->lock);
+    for (int i = 0; i < pool->slab_num; i++)
+    {
+        huge += pool->slab_huge[i];
+    }
+    int slab_num = pool->slab_num;
+    pthread_mutex_unlock(&pool->lock);
+    int64_t gets = atomic_load(&pool->gets), allocs = atomic_load(&pool->allocs);
+    printf("%s pool gets:%ld buffer allocs:%ld recycled:%ld slabs:%d (hugetlb:%d) buffer:%zuB\n", name, gets, allocs, gets - allocs, slab_num, huge, pool->buf_stride);
+}
+
+/* buffers still in use stay valid, the slabs go away with the last of them */
+void FramePoolUninit(FramePool *pool)
+{
+    av_buffer_pool_uninit(&pool->pool);
+}
+
+/* for owners that come and go, e.g. one pool per encoder context size */
+FramePool *FramePoolAlloc(size_t buf_size, int slab_buffers, bool hugepages)
+{
+    FramePool *pool = malloc(sizeof(FramePool));
+    if (!pool || !FramePoolInit(pool, buf_size, slab_buffers, hugepages))
+    {
+        free(pool);
+        return NULL;
+    }
+    pool->owned = true;
+    return pool;
+}
+
+/* like FramePoolUninit, the struct itself is freed once the last buffer is back */
+void FramePoolFree(FramePool **pool)
+{
+    if (*pool)
+    {
+        FramePoolUninit(*pool);
+        *pool = NULL;
+    }
+}
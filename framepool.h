@@ -0,0 +1,50 @@
+#ifndef _FRAMEPOOL_H
+#define _FRAMEPOOL_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <pthread.h>
+#include <libavutil/buffer.h>
+#include <libavutil/frame.h>
+#include <libavutil/imgutils.h>
+
+#define FRAME_POOL_ALIGN 64 // a cache line, and wide enough for avx-512 loads
+#define FRAME_POOL_MAX_SLABS 64
+
+/*
+ * AVBufferPool whose buffers are carved out of large mmap'd slabs instead of
+ * one malloc each. every buffer starts on a FRAME_POOL_ALIGN boundary, and
+ * with hugepages the slabs come from MAP_HUGETLB (falling back to
+ * transparent huge pages), so a frame spans a couple of tlb entries rather
+ * than hundreds. once the pool is warm, getting a buffer is a list pop.
+ * the struct has to stay alive until every buffer taken from it is unref'd.
+ */
+typedef struct
+{
+    AVBufferPool *pool;
+    size_t buf_size;
+    size_t buf_stride; // buf_size rounded up to FRAME_POOL_ALIGN
+    int slab_buffers;  // buffers per slab
+    bool hugepages;
+    pthread_mutex_t lock;
+    uint8_t *slabs[FRAME_POOL_MAX_SLABS];
+    size_t slab_size[FRAME_POOL_MAX_SLABS];
+    bool slab_huge[FRAME_POOL_MAX_SLABS];
+    int slab_num;
+    int slab_used; // buffers handed out of the last slab
+    _Atomic int64_t gets;
+    _Atomic int64_t allocs; // buffers created, stays flat in steady state
+    bool owned; // from FramePoolAlloc, the struct is freed with the slabs
+} FramePool;
+
+bool FramePoolInit(FramePool *pool, size_t buf_size, int slab_buffers, bool hugepages);
+size_t FramePoolImageSize(enum AVPixelFormat pix_fmt, int width, int height);
+AVBufferRef *FramePoolGet(FramePool *pool);
+bool FramePoolGetFrame(FramePool *pool, AVFrame *frame, enum AVPixelFormat pix_fmt, int width, int height);
+void FramePoolReport(FramePool *pool, const char *name);
+void FramePoolUninit(FramePool *pool);
+FramePool *FramePoolAlloc(size_t buf_size, int slab_buffers, bool hugepages);
+void FramePoolFree(FramePool **pool);
+#endif
@@ -0,0 +1,166 @@
+#include "framequeue.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <errno.h>
+
+bool FrameQueueInit(FrameQueue *queue, size_t capacity)
+{
+    size_t size = 1;
+    while (size < capacity)
+    {
+        size <<= 1;
+    }
+    queue->slots = calloc(size, sizeof(*queue->slots));
+    if (!queue->slots)
+    {
+        perror("frame queue alloc failed");
+        return false;
+    }
+    queue->mask = size - 1;
+    atomic_init(&queue->head, 0);
+    atomic_init(&queue->tail, 0);
+    atomic_init(&queue->max_depth, 0);
+    atomic_init(&queue->closed, false);
+    sem_init(&queue->items, 0, 0);
+    sem_init(&queue->spaces, 0, size);
+    return true;
+}
+
+static void frame_queue_put(FrameQueue *queue, void *item)
+{
+    size_t head = atomic_load_explicit(&queue->head, memory_order_relaxed);
+    atomic_store_explicit(&queue->slots[head & queue->mask], item, memory_order_relaxed);
+    atomic_store_explicit(&queue->head, head + 1, memory_order_release);
+
+    size_t depth = head + 1 - atomic_load_explicit(&queue->tail, memory_order_acquire);
+    if (depth > atomic_load_explicit(&queue->max_depth, memory_order_relaxed))
+    {
+        atomic_store_explicit(&queue->max_depth, depth, memory_order_relaxed);
+    }
+    sem_post(&queue->items);
+}
+
+/* the caller holds an items token, so there is an item even if the producer takes one back concurrently */
+static void *frame_queue_get(FrameQueue *queue)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    void *item;
+    do
+    {
+        // a stale read is harmless, the cas below fails and it is read again
+        item = atomic_load_explicit(&queue->slots[tail & queue->mask], memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&queue->tail, &tail, tail + 1, memory_order_acq_rel, memory_order_acquire));
+    sem_post(&queue->spaces);
+    return item;
+}
+
+static int frame_queue_wait(sem_t *sem)
+{
+    int ret;
+    while ((ret = sem_wait(sem)) < 0 && errno == EINTR)
+        ;
+    return ret;
+}
+
+/* blocks while the queue is full, false once it has been closed */
+bool FrameQueuePush(FrameQueue *queue, void *item)
+{
+    if (atomic_load_explicit(&queue->closed, memory_order_acquire) || frame_queue_wait(&queue->spaces) < 0)
+    {
+        return false;
+    }
+    if (atomic_load_explicit(&queue->closed, memory_order_acquire))
+    {
+        // woken by FrameQueueClose from the consumer side
+        sem_post(&queue->spaces);
+        return false;
+    }
+    frame_queue_put(queue, item);
+    return true;
+}
+
+bool FrameQueueTryPush(FrameQueue *queue, void *item)
+{
+    if (atomic_load_explicit(&queue->closed, memory_order_acquire) || sem_trywait(&queue->spaces) < 0)
+    {
+        return false;
+    }
+    frame_queue_put(queue, item);
+    return true;
+}
+
+/* blocks while the queue is empty, NULL once it is closed and drained */
+void *FrameQueuePop(FrameQueue *queue)
+{
+    if (frame_queue_wait(&queue->items) < 0)
+    {
+        return NULL;
+    }
+    if (atomic_load_explicit(&queue->tail, memory_order_relaxed) == atomic_load_explicit(&queue->head, memory_order_acquire))
+    {
+        // woken by FrameQueueClose, repost so later pops see it too
+        sem_post(&queue->items);
+        return NULL;
+    }
+    return frame_queue_get(queue);
+}
+
+/*
+ * besides the consumer, the producer may call this to take back the oldest
+ * queued item when it wants to drop instead of waiting (drop-oldest).
+ */
+void *FrameQueueTryPop(FrameQueue *queue)
+{
+    if (sem_trywait(&queue->items) < 0)
+    {
+        return NULL;
+    }
+    if (atomic_load_explicit(&queue->tail, memory_order_relaxed) == atomic_load_explicit(&queue->head, memory_order_acquire))
+    {
+        sem_post(&queue->items);
+        return NULL;
+    }
+    return frame_queue_get(queue);
+}
+
+/*
+ * normally called by the producer after its last push. the consumer may
+ * call it too when it stops early, pushes then fail instead of blocking.
+ */
+void FrameQueueClose(FrameQueue *queue)
+{
+    atomic_store_explicit(&queue->closed, true, memory_order_release);
+    sem_post(&queue->items);
+    sem_post(&queue->spaces);
+}
+
+/* once true, every item pushed before the close is visible to FrameQueueTryPop */
+bool FrameQueueClosed(FrameQueue *queue)
+{
+    return atomic_load_explicit(&queue->closed, memory_order_acquire);
+}
+
+/* tail first: head only grows, so a later head is never behind it, while the producer may pop past an earlier head */
+size_t FrameQueueDepth(FrameQueue *queue)
+{
+    size_t tail = atomic_load_explicit(&queue->tail, memory_order_acquire);
+    return atomic_load_explicit(&queue->head, memory_order_acquire) - tail;
+}
+
+size_t FrameQueueMaxDepth(FrameQueue *queue)
+{
+    return atomic_load_explicit(&queue->max_depth, memory_order_relaxed);
+}
+
+size_t FrameQueueCapacity(FrameQueue *queue)
+{
+    return queue->mask + 1;
+}
+
+void FrameQueueDestroy(FrameQueue *queue)
+{
+    sem_destroy(&queue->items);
+    sem_destroy(&queue->spaces);
+    free(queue->slots);
+    queue->slots = NULL;
+}
@@ -0,0 +1,40 @@
+#ifndef _FRAMEQUEUE_H
+#define _FRAMEQUEUE_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <stdatomic.h>
+#include <semaphore.h>
+
+/*
+ * bounded single producer / single consumer ring of pointers.
+ * head is only written by the producer, so the fast path is two atomics and
+ * no lock. tail moves by compare and swap because the producer may also pop
+ * the oldest item with FrameQueueTryPop to drop it. the semaphores are only
+ * there to park a thread when the ring is empty or full.
+ */
+typedef struct
+{
+    _Atomic(void *) *slots; // atomic: the producer may pop, so two threads read a slot the producer can be refilling
+    size_t mask;
+    _Atomic size_t head;
+    _Atomic size_t tail;
+    _Atomic size_t max_depth;
+    _Atomic bool closed;
+    sem_t items;
+    sem_t spaces;
+} FrameQueue;
+
+bool FrameQueueInit(FrameQueue *queue, size_t capacity);
+bool FrameQueuePush(FrameQueue *queue, void *item);
+bool FrameQueueTryPush(FrameQueue *queue, void *item);
+void *FrameQueuePop(FrameQueue *queue);
+void *FrameQueueTryPop(FrameQueue *queue);
+void FrameQueueClose(FrameQueue *queue);
+bool FrameQueueClosed(FrameQueue *queue);
+size_t FrameQueueDepth(FrameQueue *queue);
+size_t FrameQueueMaxDepth(FrameQueue *queue);
+size_t FrameQueueCapacity(FrameQueue *queue);
+void FrameQueueDestroy(FrameQueue *queue);
+#endif
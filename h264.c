@@ -7,6 +7,17 @@
 #include <libavutil/opt.h>
 #include <libavutil/imgutils.h>
 
+#include "yuvreader.h"
+
+/*
+ * gcc h264.c yuvreader.c framequeue.c -o h264 -lavcodec -lavutil -lpthread
+ */
+
+static void yuv_view_release(void *opaque, uint8_t *data)
+{
+    YUVReaderRelease(opaque, data);
+}
+
 // 对每一帧进行编码
 static void encode(AVCodecContext *enc_ctx, AVFrame *frame, AVPacket *pkt,
                    FILE *outfile)
@@ -45,7 +56,7 @@ int main(void)
     // 编码器上下文
     AVCodecContext *c = NULL;
     // got_output 用于标记一帧是否压缩成功
-    int i, ret, x, y, got_output;
+    int i, x, y, got_output;
     FILE *f;
     // 存放解码后的原始帧（未压缩的数据）
     AVFrame *frame;
@@ -116,25 +127,21 @@ int main(void)
         fprintf(stderr, "Could not open output.h264\n");
         exit(1);
     }
-    FILE *in_fp = fopen("yu.yuv", "rb");
-    // 初始化帧并设置帧的YUV格式和分辨率
-    frame = av_frame_alloc();
-    if (!frame)
+    // 原始帧直接从文件映射中取, 不再逐平面 fread
+    YUVReader reader;
+    if (!YUVReaderOpen(&reader, "yu.yuv", c->width, c->height, YUV_READER_MMAP))
     {
-        fprintf(stderr, "Could not allocate video frame\n");
+        fprintf(stderr, "Could not open yu.yuv\n");
         exit(1);
     }
-    frame->format = c->pix_fmt;
-    frame->width = c->width;
-    frame->height = c->height;
-
-    // 为音频或视频数据分配新的缓冲区
-    ret = av_frame_get_buffer(frame, 32);
-    if (ret < 0)
+    // 初始化帧, 数据缓冲区每一帧引用读取器给出的视图
+    frame = av_frame_alloc();
+    if (!frame)
     {
-        fprintf(stderr, "Could not allocate the video frame data\n");
+        fprintf(stderr, "Could not allocate video frame\n");
         exit(1);
     }
+    int frame_size = av_image_get_buffer_size(c->pix_fmt, c->width, c->height, 1);
 
     /* encode 1 second of video */
     // 这里是人工添加数据模拟生成1秒钟(25帧)的视频(真实应用中是从摄像头获取的原始数据，摄像头拿到数据后会传给编码器，然后编码器进行编码形成一帧帧数据。)
@@ -145,16 +152,24 @@ int main(void)
         pkt.data = NULL; // packet data will be allocated by the encoder
         pkt.size = 0;
 
-        /* make sure the frame data is writable */
-        // 确保帧被写入
-        ret = av_frame_make_writable(frame);
-        if (ret < 0)
+        YUVFrameView view;
+        if (!YUVReaderNext(&reader, &view))
+            break;
+        // 编码器引用这块只读数据, 用完后通过 yuv_view_release 归还读取器
+        frame->buf[0] = av_buffer_create(view.data[0], frame_size, yuv_view_release, &reader, AV_BUFFER_FLAG_READONLY);
+        if (!frame->buf[0])
+        {
+            fprintf(stderr, "Could not wrap the video frame data\n");
             exit(1);
-
-        fread(frame->data[0], frame->width * frame->height, 1, in_fp);
-        fread(frame->data[1], frame->width * frame->height / 4, 1, in_fp);
-        fread(frame->data[2], frame->width * frame->height / 4, 1, in_fp);
-
+        }
+        for (int plane = 0; plane < 3; plane++)
+        {
+            frame->data[plane] = view.data[plane];
+            frame->linesize[plane] = view.linesize[plane];
+        }
+        frame->format = c->pix_fmt;
+        frame->width = c->width;
+        frame->height = c->height;
         frame->pts = i;
 
         /* encode the image */
@@ -166,6 +181,7 @@ int main(void)
         /* send the frame to the encoder */
         // 进行编码压缩
         encode(c, frame, &pkt, f);
+        av_frame_unref(frame);
     }
     // 进行编码压缩
     encode(c, NULL, &pkt, f);
@@ -175,6 +191,7 @@ int main(void)
 
     avcodec_free_context(&c);
     av_frame_free(&frame);
+    YUVReaderClose(&reader);
 
     return 0;
 }
\ No newline at end of file
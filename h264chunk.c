@@ -0,0 +1,279 @@
+/*
+ * 离线 yuv 文件并行编码
+ * 输入按 gop 边界切成若干 chunk, 每个 chunk 由工作线程用自己的 H264EnCoder 编码,
+ * x264 默认是 closed gop, 新建的编码器从 IDR 开始, 所以各 chunk 的 Annex-B 输出按顺序拼接即可
+ *
+ * gcc h264chunk.c codeh264.c framepool.c framequeue.c encstats.c -DLIO_NO_MAIN -o h264chunk -lavcodec -lavformat -lavutil -lswscale -lpthread
+ * ./h264chunk video.yuv video.h264 1280 720 [threads]
+ * ./h264chunk video.yuv --bench 1280 720     编码整个文件, 输出 1,2,4...核 的速度和加速比
+ */
+#include "codeh264.h"
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#define GOP_SIZE 10
+#define CHUNK_GOPS 10
+
+typedef struct
+{
+    uint8_t *data;
+    size_t size;
+    size_t capacity;
+    bool done;
+} ChunkOutput;
+
+typedef struct
+{
+    int fd;
+    int width;
+    int height;
+    size_t frame_bytes;
+    int64_t frame_num;
+    int chunk_frames;
+    int chunk_num;
+    int window; // chunks allowed to finish ahead of the writer
+    atomic_int next_chunk;
+    int next_write;
+    ChunkOutput *outputs;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+} ChunkJob;
+
+static bool chunk_output_append(ChunkOutput *output, const uint8_t *data, int size)
+{
+    if (output->size + size > output->capacity)
+    {
+        size_t capacity = output->capacity ? output->capacity * 2 : 1 << 20;
+        while (capacity < output->size + size)
+        {
+            capacity *= 2;
+        }
+        uint8_t *p = realloc(output->data, capacity);
+        if (!p)
+        {
+            return false;
+        }
+        output->data = p;
+        output->capacity = capacity;
+    }
+    memcpy(output->data + output->size, data, size);
+    output->size += size;
+    return true;
+}
+
+/* the frame buffer is reused, x264 has copied it by the time send returns */
+static void chunk_frame_release(void *opaque, uint8_t *data)
+{
+    (void)opaque;
+    (void)data;
+}
+
+static bool encode_chunk(ChunkJob *job, int chunk, uint8_t *yuv_buf)
+{
+    ChunkOutput *output = &job->outputs[chunk];
+    int64_t first = (int64_t)chunk * job->chunk_frames;
+    int64_t last = first + job->chunk_frames < job->frame_num ? first + job->chunk_frames : job->frame_num;
+
+    H264EnCoder h264_encoder;
+    H264EnCoderOption option;
+    H264EnCoderOptionDefault(&option);
+    option.gop_size = GOP_SIZE;
+    // parallelism comes from the chunks, one x264 thread per chunk
+    option.thread_count = 1;
+    H264EnCoderInitWithOption(&h264_encoder, 400 * 1024, job->width, job->height, (AVRational){10, 1}, FF_PROFILE_H264_HIGH, AV_PIX_FMT_YUV420P, &option);
+    h264_encoder.frame->pts = first;
+
+    uint8_t *data[4];
+    int linesize[4];
+    av_image_fill_arrays(data, linesize, yuv_buf, AV_PIX_FMT_YUV420P, job->width, job->height, 1);
+    bool ok = true;
+    for (int64_t i = first; i < last; i++)
+    {
+        if (pread(job->fd, yuv_buf, job->frame_bytes, i * job->frame_bytes) != (ssize_t)job->frame_bytes)
+        {
+            perror("read yuv failed");
+            ok = false;
+            break;
+        }
+        if (!H264EnCoderFetchExternalFrame(&h264_encoder, data, linesize, chunk_frame_release, NULL))
+        {
+            ok = false;
+            break;
+        }
+        while (H264EnCoderEncode(&h264_encoder) > 0)
+        {
+            ok = ok && chunk_output_append(output, h264_encoder.pkt->data, h264_encoder.pkt->size);
+        }
+    }
+    H264EnCoderFlush(&h264_encoder);
+    while (H264EnCoderEncode(&h264_encoder) > 0)
+    {
+        ok = ok && chunk_output_append(output, h264_encoder.pkt->data, h264_encoder.pkt->size);
+    }
+    H264EnCoderDestroy(&h264_encoder);
+    return ok;
+}
+
+static void *chunk_worker(void *args)
+{
+    ChunkJob *job = args;
+    uint8_t *yuv_buf = malloc(job->frame_bytes);
+    if (!yuv_buf)
+    {
+        perror("malloc failed");
+        return NULL;
+    }
+    while (true)
+    {
+        int chunk = atomic_fetch_add(&job->next_chunk, 1);
+        if (chunk >= job->chunk_num)
+        {
+            break;
+        }
+        pthread_mutex_lock(&job->mutex);
+        while (chunk >= job->next_write + job->window)
+        {
+            pthread_cond_wait(&job->cond, &job->mutex);
+        }
+        pthread_mutex_unlock(&job->mutex);
+
+        if (!encode_chunk(job, chunk, yuv_buf))
+        {
+            printf("chunk %d encode failed\n", chunk);
+        }
+
+        pthread_mutex_lock(&job->mutex);
+        job->outputs[chunk].done = true;
+        pthread_cond_broadcast(&job->cond);
+        pthread_mutex_unlock(&job->mutex);
+    }
+    free(yuv_buf);
+    return NULL;
+}
+
+/* encodes the whole file with thread_num workers, returns the seconds it took or -1 */
+static double encode_file(int fd, FILE *out_fp, int width, int height, int thread_num)
+{
+    struct stat st;
+    if (fstat(fd, &st) < 0)
+    {
+        perror("stat failed");
+        return -1;
+    }
+    ChunkJob job = {.fd = fd, .width = width, .height = height};
+    job.frame_bytes = (size_t)width * height * 3 / 2;
+    job.frame_num = st.st_size / job.frame_bytes;
+    job.chunk_frames = GOP_SIZE * CHUNK_GOPS;
+    job.chunk_num = (job.frame_num + job.chunk_frames - 1) / job.chunk_frames;
+    job.window = thread_num * 2;
+    atomic_init(&job.next_chunk, 0);
+    job.outputs = calloc(job.chunk_num, sizeof(ChunkOutput));
+    if (job.chunk_num == 0 || !job.outputs)
+    {
+        printf("no frames to encode\n");
+        free(job.outputs);
+        return -1;
+    }
+    pthread_mutex_init(&job.mutex, NULL);
+    pthread_cond_init(&job.cond, NULL);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    pthread_t *threads = calloc(thread_num, sizeof(pthread_t));
+    for (int i = 0; i < thread_num; i++)
+    {
+        pthread_create(&threads[i], NULL, chunk_worker, &job);
+    }
+
+    // 按顺序写出已完成的 chunk
+    for (int chunk = 0; chunk < job.chunk_num; chunk++)
+    {
+        pthread_mutex_lock(&job.mutex);
+        while (!job.outputs[chunk].done)
+        {
+            pthread_cond_wait(&job.cond, &job.mutex);
+        }
+        pthread_mutex_unlock(&job.mutex);
+
+        if (out_fp)
+        {
+            fwrite(job.outputs[chunk].data, 1, job.outputs[chunk].size, out_fp);
+        }
+        free(job.outputs[chunk].data);
+        job.outputs[chunk].data = NULL;
+
+        pthread_mutex_lock(&job.mutex);
+        job.next_write = chunk + 1;
+        pthread_cond_broadcast(&job.cond);
+        pthread_mutex_unlock(&job.mutex);
+    }
+
+    for (int i = 0; i < thread_num; i++)
+    {
+        pthread_join(threads[i], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("threads:%d frames:%ld chunks:%d %.2fs %.1f fps\n", thread_num, job.frame_num, job.chunk_num, elapsed, job.frame_num / elapsed);
+
+    free(threads);
+    free(job.outputs);
+    pthread_mutex_destroy(&job.mutex);
+    pthread_cond_destroy(&job.cond);
+    return elapsed;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 5)
+    {
+        printf("usage: %s input.yuv output.h264|--bench width height [threads]\n", argv[0]);
+        return -1;
+    }
+    int width = atoi(argv[3]);
+    int height = atoi(argv[4]);
+    int cpu_num = sysconf(_SC_NPROCESSORS_ONLN);
+    int fd = open(argv[1], O_RDONLY);
+    if (fd < 0)
+    {
+        printf("无法打开输入文件\n");
+        return -1;
+    }
+
+    if (strcmp(argv[2], "--bench") == 0)
+    {
+        double base = 0;
+        for (int thread_num = 1; thread_num <= cpu_num; thread_num *= 2)
+        {
+            double elapsed = encode_file(fd, NULL, width, height, thread_num);
+            if (elapsed <= 0)
+            {
+                break;
+            }
+            if (thread_num == 1)
+            {
+                base = elapsed;
+            }
+            printf("speedup with %d chunks in flight: %.2fx\n", thread_num, base / elapsed);
+        }
+        close(fd);
+        return 0;
+    }
+
+    FILE *out_fp = fopen(argv[2], "wb");
+    if (!out_fp)
+    {
+        printf("无法打开输出文件\n");
+        return -1;
+    }
+    int thread_num = argc > 5 ? atoi(argv[5]) : cpu_num;
+    double elapsed = encode_file(fd, out_fp, width, height, thread_num > 0 ? thread_num : 1);
+    fclose(out_fp);
+    close(fd);
+    return elapsed < 0 ? -1 : 0;
+}
@@ -0,0 +1,146 @@
+#include "h264governor.h"
+#include <string.h>
+#include <time.h>
+
+/*
+ * the speed settings of x264's presets, fastest first. every step roughly
+ * halves or doubles the encode time. none of them shows up in the sps/pps.
+ */
+typedef struct
+{
+    const char *name;
+    const char *params;           // with the preset's lookahead
+    const char *params_zerolatency; // H264_LATENCY_LOW keeps its lookahead at 0
+} GovernorLevel;
+
+static const GovernorLevel governor_levels[H264_GOVERNOR_LEVELS] = {
+    {"ultrafast", "subme=0:me=dia:trellis=0:rc-lookahead=0", "subme=0:me=dia:trellis=0"},
+    {"superfast", "subme=1:me=dia:trellis=0:rc-lookahead=0", "subme=1:me=dia:trellis=0"},
+    {"veryfast", "subme=2:me=hex:trellis=0:rc-lookahead=10", "subme=2:me=hex:trellis=0"},
+    {"faster", "subme=4:me=hex:trellis=1:rc-lookahead=20", "subme=4:me=hex:trellis=1"},
+    {"fast", "subme=6:me=hex:trellis=1:rc-lookahead=30", "subme=6:me=hex:trellis=1"},
+    {"medium", "subme=7:me=hex:trellis=1:rc-lookahead=40", "subme=7:me=hex:trellis=1"},
+    {"slow", "subme=8:me=umh:trellis=2:rc-lookahead=50", "subme=8:me=umh:trellis=2"},
+    {"slower", "subme=9:me=umh:trellis=2:rc-lookahead=60", "subme=9:me=umh:trellis=2"}};
+
+#define GOVERNOR_HEADROOM 0.5 // step up only below half the budget
+#define GOVERNOR_CALM_GOPS 3
+
+/*
+ * cpu_budget is the share of the frame interval the encoder may use, 0.8
+ * keeps a 20% margin at 10 fps (80ms of encoding per 100ms frame).
+ */
+void H264GovernorInit(H264Governor *governor, H264EnCoder *h264_encoder, double cpu_budget, FILE *log_fp)
+{
+    memset(governor, 0, sizeof(H264Governor));
+    AVRational framerate = h264_encoder->send_ctx->framerate;
+    governor->h264_encoder = h264_encoder;
+    governor->frame_budget = cpu_budget * framerate.den / framerate.num;
+    governor->gop_size = h264_encoder->send_ctx->gop_size > 0 ? h264_encoder->send_ctx->gop_size : 1;
+    governor->log_fp = log_fp;
+    governor->max_level = H264_GOVERNOR_LEVELS - 1;
+    for (int i = 0; i < H264_GOVERNOR_LEVELS; i++)
+    {
+        if (strcmp(governor_levels[i].name, h264_encoder->option.preset) == 0)
+        {
+            governor->max_level = i;
+        }
+    }
+    governor->level = governor->max_level;
+    governor->pending_level = -1;
+}
+
+double H264GovernorNow(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+const char *H264GovernorPreset(H264Governor *governor)
+{
+    return governor_levels[governor->level].name;
+}
+
+/* opens the context for level on the helper thread, switched to at the next gop start */
+static void governor_prepare(H264Governor *governor, int level)
+{
+    H264EnCoder *h264_encoder = governor->h264_encoder;
+    // the configured preset and option stay, only the speed settings change
+    H264EnCoderOption option = h264_encoder->option;
+    option.x264_params = option.latency == H264_LATENCY_LOW ? governor_levels[level].params_zerolatency : governor_levels[level].params;
+    if (H264EnCoderPrepareContextAsync(h264_encoder, h264_encoder->send_ctx->width, h264_encoder->send_ctx->height, 0, &option))
+    {
+        governor->pending_level = level;
+    }
+}
+
+/* at a gop start: the prepared context takes over if it is ready */
+static bool governor_switch(H264Governor *governor, int64_t pts)
+{
+    H264EnCoder *h264_encoder = governor->h264_encoder;
+    int prepared = H264EnCoderPrepared(h264_encoder);
+    if (prepared < 0)
+    {
+        return false;
+    }
+    int level = governor->pending_level;
+    governor->pending_level = -1;
+    double start = H264GovernorNow();
+    if (!prepared || !H264EnCoderSwitchContext(h264_encoder))
+    {
+        return false;
+    }
+    if (governor->log_fp)
+    {
+        fprintf(governor->log_fp, "governor: pts %ld budget %.1fms speed %s -> %s (switch %.1fms)\n", pts, governor->frame_budget * 1000,
+                governor_levels[governor->level].name, governor_levels[level].name, (H264GovernorNow() - start) * 1000);
+        fflush(governor->log_fp);
+    }
+    governor->level = level;
+    governor->adaptations++;
+    return true;
+}
+
+/*
+ * call once per frame with the time spent sending it and draining packets,
+ * before sending the frame with the next pts. true when the speed level
+ * changed, the next frame then goes to the new context.
+ */
+bool H264GovernorFrame(H264Governor *governor, int64_t pts, double encode_seconds)
+{
+    governor->gop_busy += encode_seconds;
+    if (++governor->gop_frames < governor->gop_size)
+    {
+        return false;
+    }
+    double average = governor->gop_busy / governor->gop_frames;
+    governor->gop_frames = 0;
+    governor->gop_busy = 0;
+
+    // a level decided during the last gop, its switch replaces this gop's decision
+    if (governor->pending_level >= 0)
+    {
+        return governor_switch(governor, pts);
+    }
+    if (average > governor->frame_budget)
+    {
+        governor->calm_gops = 0;
+        if (governor->level > 0)
+        {
+            governor_prepare(governor, governor->level - 1);
+        }
+        return false;
+    }
+    if (average < governor->frame_budget * GOVERNOR_HEADROOM && governor->level < governor->max_level)
+    {
+        if (++governor->calm_gops >= GOVERNOR_CALM_GOPS)
+        {
+            governor->calm_gops = 0;
+            governor_prepare(governor, governor->level + 1);
+        }
+        return false;
+    }
+    governor->calm_gops = 0;
+    return false;
+}
@@ -0,0 +1,39 @@
+#ifndef _H264GOVERNOR_H
+#define _H264GOVERNOR_H
+
+#include "codeh264.h"
+
+#define H264_GOVERNOR_LEVELS 8
+
+/*
+ * watches the wall time each frame spends in the encoder and, at gop
+ * boundaries, moves the encoder one speed level faster when the average goes
+ * over the budget, or one step back towards the configured preset when there
+ * has been plenty of headroom for a while.
+ * a level only changes subme, me, trellis and the lookahead on top of the
+ * configured preset. cabac, 8x8dct, weightp, ref and b-frames stay as they
+ * are, so every context writes the same sps/pps and the avcC the muxer took
+ * from the first packet stays valid.
+ * the new context is opened on a helper thread during one gop and switched to
+ * at the start of the next, the old one drains on a thread of its own.
+ */
+typedef struct
+{
+    H264EnCoder *h264_encoder;
+    double frame_budget; // seconds of encoding allowed per frame
+    int level;           // index into the speed ladder, higher is slower and better
+    int max_level;       // the preset the encoder was configured with
+    int pending_level;   // being prepared, -1: none
+    int gop_size;
+    int gop_frames;
+    double gop_busy;
+    int calm_gops; // gops in a row with enough headroom to step up
+    int adaptations;
+    FILE *log_fp;
+} H264Governor;
+
+void H264GovernorInit(H264Governor *governor, H264EnCoder *h264_encoder, double cpu_budget, FILE *log_fp);
+double H264GovernorNow(void);
+bool H264GovernorFrame(H264Governor *governor, int64_t pts, double encode_seconds);
+const char *H264GovernorPreset(H264Governor *governor);
+#endif
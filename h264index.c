@@ -0,0 +1,486 @@
+#define _GNU_SOURCE
+#include "h264index.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <time.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define H264_INDEX_X86 1
+#endif
+
+static inline size_t start_code_find_tail(const uint8_t *p, size_t i, size_t size)
+{
+    for (; i + 2 < size; i++)
+    {
+        if (p[i + 2] > 1)
+        {
+            i += 2; // none of the three bytes can be the 01 nor the zeros in front of it
+        }
+        else if (p[i] == 0 && p[i + 1] == 0 && p[i + 2] == 1)
+        {
+            return i;
+        }
+    }
+    return size;
+}
+
+size_t start_code_find_c(const uint8_t *p, size_t size)
+{
+    return start_code_find_tail(p, 0, size);
+}
+
+#ifdef H264_INDEX_X86
+size_t start_code_find_sse2(const uint8_t *p, size_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i one = _mm_set1_epi8(1);
+    size_t i = 0;
+    // three overlapping loads, bit n set when p[i + n .. i + n + 2] is 00 00 01
+    for (; i + 18 <= size; i += 16)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)(p + i));
+        __m128i b = _mm_loadu_si128((const __m128i *)(p + i + 1));
+        __m128i c = _mm_loadu_si128((const __m128i *)(p + i + 2));
+        __m128i hit = _mm_and_si128(_mm_and_si128(_mm_cmpeq_epi8(a, zero), _mm_cmpeq_epi8(b, zero)), _mm_cmpeq_epi8(c, one));
+        int mask = _mm_movemask_epi8(hit);
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return start_code_find_tail(p, i, size);
+}
+
+__attribute__((target("avx2"))) size_t start_code_find_avx2(const uint8_t *p, size_t size)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i one = _mm256_set1_epi8(1);
+    size_t i = 0;
+    for (; i + 34 <= size; i += 32)
+    {
+        __m256i a = _mm256_loadu_si256((const __m256i *)(p + i));
+        __m256i b = _mm256_loadu_si256((const __m256i *)(p + i + 1));
+        __m256i c = _mm256_loadu_si256((const __m256i *)(p + i + 2));
+        __m256i hit = _mm256_and_si256(_mm256_and_si256(_mm256_cmpeq_epi8(a, zero), _mm256_cmpeq_epi8(b, zero)), _mm256_cmpeq_epi8(c, one));
+        unsigned mask = (unsigned)_mm256_movemask_epi8(hit);
+        if (mask)
+        {
+            return i + __builtin_ctz(mask);
+        }
+    }
+    return start_code_find_tail(p, i, size);
+}
+#else
+size_t start_code_find_sse2(const uint8_t *p, size_t size)
+{
+    return start_code_find_c(p, size);
+}
+
+size_t start_code_find_avx2(const uint8_t *p, size_t size)
+{
+    return start_code_find_c(p, size);
+}
+#endif
+
+static pthread_once_t start_code_once = PTHREAD_ONCE_INIT;
+static StartCodeFindFunc start_code_func = start_code_find_c;
+static const char *start_code_name = "c";
+
+static void start_code_find_select(void)
+{
+#ifdef H264_INDEX_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        start_code_func = start_code_find_avx2;
+        start_code_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        start_code_func = start_code_find_sse2;
+        start_code_name = "sse2";
+    }
+#endif
+}
+
+size_t start_code_find(const uint8_t *p, size_t size)
+{
+    pthread_once(&start_code_once, start_code_find_select);
+    return start_code_func(p, size);
+}
+
+const char *start_code_find_name(void)
+{
+    pthread_once(&start_code_once, start_code_find_select);
+    return start_code_name;
+}
+
+static bool h264_index_push(H264Index *index, int64_t *capacity, uint64_t offset, uint32_t gop, uint32_t flags)
+{
+    if (index->frame_num + 1 >= *capacity)
+    {
+        int64_t new_capacity = *capacity ? *capacity * 2 : 4096;
+        H264IndexEntry *entries = realloc(index->entries, sizeof(H264IndexEntry) * new_capacity);
+        if (!entries)
+        {
+            perror("h264 index alloc failed");
+            return false;
+        }
+        index->entries = entries;
+        *capacity = new_capacity;
+    }
+    index->entries[index->frame_num++] = (H264IndexEntry){.offset = offset, .gop = gop, .flags = flags};
+    return true;
+}
+
+/*
+ * an access unit starts at the first aud/sei/sps/pps after a slice, or at a
+ * slice whose first_mb_in_slice is 0 (ue(v) 0 is a single 1 bit) when
+ * nothing precedes it. slices of the same picture don't start a new entry.
+ */
+static bool h264_index_build(H264Index *index)
+{
+    const uint8_t *map = index->map;
+    int64_t capacity = 0;
+    int64_t au_start = -1;
+    bool au_params = false;
+    bool params_done = false;
+    uint64_t params_end = 0;
+    uint32_t gop = 0;
+    index->frame_num = 0;
+    index->key_num = 0;
+    index->nal_num = 0;
+    index->params_size = 0;
+
+    size_t pos = start_code_find(map, index->size);
+    while (pos < index->size)
+    {
+        size_t nal = pos + 3;
+        size_t next = nal < index->size ? nal + start_code_find(map + nal, index->size - nal) : index->size;
+        size_t start = pos > 0 && map[pos - 1] == 0 ? pos - 1 : pos;
+        index->nal_num++;
+        int type = nal < index->size ? map[nal] & 0x1F : 0;
+        if (type == H264_NAL_SLICE || type == H264_NAL_IDR)
+        {
+            params_done = params_done || index->params_size > 0;
+            if (nal + 1 < index->size && (map[nal + 1] & 0x80))
+            {
+                uint32_t flags = au_params ? H264_FRAME_PARAMS : 0;
+                if (type == H264_NAL_IDR)
+                {
+                    flags |= H264_FRAME_KEY;
+                    gop = index->frame_num;
+                    index->key_num++;
+                }
+                if (!h264_index_push(index, &capacity, au_start >= 0 ? (uint64_t)au_start : start, gop, flags))
+                {
+                    return false;
+                }
+            }
+            au_start = -1;
+            au_params = false;
+        }
+        else if ((type >= H264_NAL_SEI && type <= H264_NAL_AUD) || (type >= 13 && type <= 18))
+        {
+            if (au_start < 0)
+            {
+                au_start = start;
+            }
+            if (type == H264_NAL_SPS)
+            {
+                au_params = true;
+            }
+            if ((type == H264_NAL_SPS || type == H264_NAL_PPS) && !params_done)
+            {
+                if (index->params_size == 0)
+                {
+                    index->params_offset = start;
+                }
+                params_end = next;
+                index->params_size = params_end - index->params_offset;
+            }
+        }
+        pos = next;
+    }
+    if (!index->entries && !(index->entries = malloc(sizeof(H264IndexEntry))))
+    {
+        return false;
+    }
+    // sentinel, push keeps a spare slot for it. the last access unit runs to the end of the file
+    index->entries[index->frame_num] = (H264IndexEntry){.offset = index->size, .gop = gop};
+    return true;
+}
+
+typedef struct
+{
+    char magic[8];
+    uint64_t file_size;
+    int64_t mtime_sec;
+    int64_t mtime_nsec;
+    int64_t frame_num;
+    int64_t key_num;
+    int64_t nal_num;
+    uint64_t params_offset;
+    uint32_t params_size;
+    uint32_t reserved;
+} H264IndexHeader;
+
+static bool h264_index_load(H264Index *index, const char *idx_path, const struct stat *st)
+{
+    FILE *fp = fopen(idx_path, "rb");
+    if (!fp)
+    {
+        return false;
+    }
+    H264IndexHeader header;
+    bool ok = fread(&header, sizeof(header), 1, fp) == 1 && memcmp(header.magic, H264_INDEX_MAGIC, sizeof(header.magic)) == 0 &&
+              header.file_size == (uint64_t)st->st_size && header.mtime_sec == st->st_mtim.tv_sec && header.mtime_nsec == st->st_mtim.tv_nsec &&
+              header.frame_num >= 0 && (uint64_t)header.frame_num <= (uint64_t)st->st_size / 4 &&
+              header.params_offset + header.params_size <= (uint64_t)st->st_size;
+    if (ok)
+    {
+        index->entries = malloc(sizeof(H264IndexEntry) * (header.frame_num + 1));
+        ok = index->entries && fread(index->entries, sizeof(H264IndexEntry), header.frame_num + 1, fp) == (size_t)header.frame_num + 1;
+        for (int64_t i = 0; ok && i <= header.frame_num; i++)
+        {
+            ok = index->entries[i].offset <= (uint64_t)st->st_size && index->entries[i].gop <= i;
+        }
+    }
+    fclose(fp);
+    if (!ok)
+    {
+        free(index->entries);
+        index->entries = NULL;
+        return false;
+    }
+    index->frame_num = header.frame_num;
+    index->key_num = header.key_num;
+    index->nal_num = header.nal_num;
+    index->params_offset = header.params_offset;
+    index->params_size = header.params_size;
+    return true;
+}
+
+static void h264_index_save(H264Index *index, const char *idx_path, const struct stat *st)
+{
+    H264IndexHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, H264_INDEX_MAGIC, sizeof(header.magic));
+    header.file_size = st->st_size;
+    header.mtime_sec = st->st_mtim.tv_sec;
+    header.mtime_nsec = st->st_mtim.tv_nsec;
+    header.frame_num = index->frame_num;
+    header.key_num = index->key_num;
+    header.nal_num = index->nal_num;
+    header.params_offset = index->params_offset;
+    header.params_size = index->params_size;
+
+    char tmp_path[4096 + 8];
+    snprintf(tmp_path, sizeof(tmp_path), "%s.tmp", idx_path);
+    FILE *fp = fopen(tmp_path, "wb");
+    if (!fp)
+    {
+        perror("can't write h264 index");
+        return;
+    }
+    bool ok = fwrite(&header, sizeof(header), 1, fp) == 1 &&
+              fwrite(index->entries, sizeof(H264IndexEntry), index->frame_num + 1, fp) == (size_t)index->frame_num + 1;
+    ok = fclose(fp) == 0 && ok;
+    if (!ok || rename(tmp_path, idx_path) < 0)
+    {
+        perror("can't write h264 index");
+        unlink(tmp_path);
+    }
+}
+
+bool H264IndexOpen(H264Index *index, const char *path, bool use_sidecar)
+{
+    memset(index, 0, sizeof(H264Index));
+    index->fd = open(path, O_RDONLY);
+    struct stat st;
+    if (index->fd < 0 || fstat(index->fd, &st) < 0)
+    {
+        perror("open h264 file failed");
+        if (index->fd >= 0)
+        {
+            close(index->fd);
+        }
+        return false;
+    }
+    index->size = st.st_size;
+    if (index->size > 0)
+    {
+        void *map = mmap(NULL, index->size, PROT_READ, MAP_PRIVATE, index->fd, 0);
+        if (map == MAP_FAILED)
+        {
+            perror("mmap h264 file failed");
+            close(index->fd);
+            return false;
+        }
+        // one sequential pass, let the kernel read ahead aggressively
+        madvise(map, index->size, MADV_SEQUENTIAL);
+        index->map = map;
+    }
+
+    char idx_path[4096];
+    snprintf(idx_path, sizeof(idx_path), "%s.idx", path);
+    if (use_sidecar && h264_index_load(index, idx_path, &st))
+    {
+        index->from_sidecar = true;
+        return true;
+    }
+    if (!h264_index_build(index))
+    {
+        H264IndexClose(index);
+        return false;
+    }
+    if (use_sidecar)
+    {
+        h264_index_save(index, idx_path, &st);
+    }
+    return true;
+}
+
+/* copies [offset, offset + size) of the input to out_fd without going through user space when possible */
+static bool h264_index_copy(H264Index *index, uint64_t offset, uint64_t size, int out_fd)
+{
+    loff_t in_off = offset;
+    while (size > 0)
+    {
+        ssize_t n = copy_file_range(index->fd, &in_off, out_fd, NULL, size, 0);
+        if (n <= 0)
+        {
+            break;
+        }
+        size -= n;
+    }
+    // copy_file_range refuses pipes and some filesystem pairs, sendfile takes any output
+    off_t send_off = in_off;
+    while (size > 0)
+    {
+        ssize_t n = sendfile(out_fd, index->fd, &send_off, size);
+        if (n <= 0)
+        {
+            break;
+        }
+        size -= n;
+    }
+    while (size > 0)
+    {
+        ssize_t n = write(out_fd, index->map + send_off, size);
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            perror("write h264 cut failed");
+            return false;
+        }
+        send_off += n;
+        size -= n;
+    }
+    return true;
+}
+
+/*
+ * writes frames [first, first + count) in decode order to out_fd. the cut
+ * starts at the key frame first depends on, so the output decodes on its
+ * own; the stream's sps/pps go in front when that key frame lacks them.
+ */
+bool H264IndexCut(H264Index *index, int64_t first, int64_t count, int out_fd)
+{
+    if (first < 0 || first >= index->frame_num || count <= 0)
+    {
+        return false;
+    }
+    int64_t last = first + count < index->frame_num ? first + count : index->frame_num;
+    H264IndexEntry *key = &index->entries[index->entries[first].gop];
+    if (!(key->flags & H264_FRAME_PARAMS) && index->params_size > 0)
+    {
+        if (write(out_fd, index->map + index->params_offset, index->params_size) != (ssize_t)index->params_size)
+        {
+            perror("write h264 cut failed");
+            return false;
+        }
+    }
+    return h264_index_copy(index, key->offset, index->entries[last].offset - key->offset, out_fd);
+}
+
+void H264IndexClose(H264Index *index)
+{
+    if (index->map)
+    {
+        munmap((void *)index->map, index->size);
+        index->map = NULL;
+    }
+    if (index->fd >= 0)
+    {
+        close(index->fd);
+        index->fd = -1;
+    }
+    free(index->entries);
+    index->entries = NULL;
+}
+
+#ifndef LIO_NO_MAIN
+/*
+ * gcc -O2 h264index.c -o h264index -lpthread
+ * ./h264index video.h264                         建索引 (video.h264.idx) 并输出帧数, gop 数
+ * ./h264index video.h264 100 50 clip.h264        截取解码顺序第 100 帧起的 50 帧, 从前面的关键帧开始拷贝
+ */
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        printf("usage: %s input.h264 [first_frame frame_count output.h264]\n", argv[0]);
+        return -1;
+    }
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    H264Index index;
+    if (!H264IndexOpen(&index, argv[1], true))
+    {
+        return -1;
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    double elapsed = end.tv_sec - start.tv_sec + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%s: %ld frames, %ld key frames, %ld nal units, index %s in %.3fs (%s, %.0f MB/s)\n", argv[1], index.frame_num, index.key_num,
+           index.nal_num, index.from_sidecar ? "loaded" : "built", elapsed, start_code_find_name(), index.size / 1e6 / (elapsed > 0 ? elapsed : 1e-9));
+
+    int ret = 0;
+    if (argc >= 5)
+    {
+        int out_fd = open(argv[4], O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (out_fd < 0)
+        {
+            printf("无法打开输出文件\n");
+            H264IndexClose(&index);
+            return -1;
+        }
+        int64_t first = atoll(argv[2]);
+        int64_t count = atoll(argv[3]);
+        if (H264IndexCut(&index, first, count, out_fd))
+        {
+            printf("wrote frames %ld-%ld from key frame %u to %s\n", first, first + count - 1, index.entries[first].gop, argv[4]);
+        }
+        else
+        {
+            printf("cut failed\n");
+            ret = -1;
+        }
+        close(out_fd);
+    }
+    H264IndexClose(&index);
+    return ret;
+}
+#endif
@@ -0,0 +1,69 @@
+#ifndef _H264INDEX_H
+#define _H264INDEX_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+#define H264_INDEX_MAGIC "H264IDX1"
+
+/* offset of the first 00 00 01 in p, size when there is none */
+typedef size_t (*StartCodeFindFunc)(const uint8_t *p, size_t size);
+
+size_t start_code_find_c(const uint8_t *p, size_t size);
+size_t start_code_find_sse2(const uint8_t *p, size_t size);
+size_t start_code_find_avx2(const uint8_t *p, size_t size);
+
+/* picks the widest kernel the running cpu supports */
+size_t start_code_find(const uint8_t *p, size_t size);
+const char *start_code_find_name(void);
+
+enum
+{
+    H264_NAL_SLICE = 1,
+    H264_NAL_IDR = 5,
+    H264_NAL_SEI = 6,
+    H264_NAL_SPS = 7,
+    H264_NAL_PPS = 8,
+    H264_NAL_AUD = 9,
+};
+
+#define H264_FRAME_KEY 0x01    // idr access unit
+#define H264_FRAME_PARAMS 0x02 // sps and pps in front of it
+
+/*
+ * one access unit in decode order. offset is where it starts, including any
+ * aud/sps/pps/sei that precede its first slice, so a range of entries is
+ * always a contiguous, self contained run of bytes.
+ */
+typedef struct
+{
+    uint64_t offset;
+    uint32_t gop;   // entry of the key frame this frame depends on
+    uint32_t flags;
+} H264IndexEntry;
+
+/*
+ * random access into an annex-b .h264 file. the file is mmap'd read only,
+ * start codes are found with simd and every access unit gets an entry, so
+ * frame n and its key frame are both one array lookup away. the index is
+ * kept in "<file>.idx" and only rebuilt when size or mtime change.
+ */
+typedef struct
+{
+    int fd;
+    const uint8_t *map;
+    size_t size;
+    int64_t frame_num; // entries[frame_num].offset is the end of the stream
+    int64_t key_num;
+    H264IndexEntry *entries;
+    uint64_t params_offset; // first sps/pps, for cuts whose key frame lacks them
+    uint32_t params_size;
+    int64_t nal_num;
+    bool from_sidecar;
+} H264Index;
+
+bool H264IndexOpen(H264Index *index, const char *path, bool use_sidecar);
+bool H264IndexCut(H264Index *index, int64_t first, int64_t count, int out_fd);
+void H264IndexClose(H264Index *index);
+#endif
@@ -0,0 +1,11 @@
+#include "liodevice.h"
+
+int LioCameraGetFd(LioCamera *lio_camera)
+{
+    return lio_camera->fd;
+}
+
+snd_pcm_t *LioSoundCardGetPcm(LioSoundCard *lio_soundcard)
+{
+    return lio_soundcard->pcm_handle;
+}
@@ -0,0 +1,15 @@
+#ifndef _LIODEVICE_H
+#define _LIODEVICE_H
+
+#include "../audio/lio_soundcard.h"
+#include "../video/lio_camera.h"
+
+/*
+ * what the epoll capture loop needs from the lio devices. the lio sources
+ * live next to this repo, liodevice.c is the only place here that looks
+ * inside their structs.
+ */
+int LioCameraGetFd(LioCamera *lio_camera);                    // the v4l2 device fd, readable once a frame is dequeueable
+snd_pcm_t *LioSoundCardGetPcm(LioSoundCard *lio_soundcard); // for the alsa poll descriptors and avail/recover
+
+#endif
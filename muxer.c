@@ -0,0 +1,348 @@
+#include "muxer.h"
+#include <string.h>
+#include <errno.h>
+
+static AVStream *mp4_muxer_add_stream(Mp4Muxer *muxer, int stream_index, AVCodecContext *codec_ctx)
+{
+    AVStream *stream = avformat_new_stream(muxer->fmt_ctx, NULL);
+    if (!stream)
+    {
+        return NULL;
+    }
+    if (avcodec_parameters_from_context(stream->codecpar, codec_ctx) < 0)
+    {
+        return NULL;
+    }
+    if (codec_ctx->codec_type == AVMEDIA_TYPE_AUDIO)
+    {
+        // AACEnCoder counts pts in samples
+        muxer->time_base[stream_index] = (AVRational){1, codec_ctx->sample_rate};
+        muxer->duration[stream_index] = codec_ctx->frame_size;
+    }
+    else
+    {
+        muxer->time_base[stream_index] = codec_ctx->time_base;
+        muxer->duration[stream_index] = 1;
+    }
+    stream->time_base = muxer->time_base[stream_index];
+    return stream;
+}
+
+#define MP4_MUXER_IO_SIZE (64 * 1024)
+
+static int mp4_muxer_sink_write(void *opaque, uint8_t *buf, int buf_size)
+{
+    Mp4Muxer *muxer = opaque;
+    return OutputSinkWrite(&muxer->sink, buf, buf_size) ? buf_size : AVERROR(EIO);
+}
+
+static int64_t mp4_muxer_sink_seek(void *opaque, int64_t offset, int whence)
+{
+    Mp4Muxer *muxer = opaque;
+    switch (whence)
+    {
+    case SEEK_SET:
+        return OutputSinkSeek(&muxer->sink, offset);
+    case SEEK_CUR:
+        return OutputSinkSeek(&muxer->sink, OutputSinkTell(&muxer->sink) + offset);
+    default:
+        return -1; // AVSEEK_SIZE and SEEK_END aren't needed by the mp4 muxer
+    }
+}
+
+/* fmt_ctx->pb on top of an OutputSink. with O_DIRECT the muxer is told the output can't seek */
+static bool mp4_muxer_open_sink(Mp4Muxer *muxer, const char *filename, const OutputSinkOption *sink_option)
+{
+    if (!OutputSinkOpen(&muxer->sink, filename, sink_option))
+    {
+        return false;
+    }
+    muxer->use_sink = true;
+    uint8_t *io_buf = av_malloc(MP4_MUXER_IO_SIZE);
+    if (!io_buf)
+    {
+        return false;
+    }
+    muxer->fmt_ctx->pb = avio_alloc_context(io_buf, MP4_MUXER_IO_SIZE, 1, muxer, NULL, mp4_muxer_sink_write, muxer->sink.direct ? NULL : mp4_muxer_sink_seek);
+    if (!muxer->fmt_ctx->pb)
+    {
+        av_free(io_buf);
+        return false;
+    }
+    return true;
+}
+
+bool Mp4MuxerInit(Mp4Muxer *muxer, const char *filename, AVCodecContext *video_ctx, AVCodecContext *audio_ctx)
+{
+    return Mp4MuxerInitWithSink(muxer, filename, video_ctx, audio_ctx, 0, NULL);
+}
+
+/* audio packets encoded while video_delay frames are inside the video encoder, on top of the usual queue */
+static int mp4_muxer_audio_queue_size(AVCodecContext *video_ctx, AVCodecContext *audio_ctx, int video_delay)
+{
+    AVRational framerate = video_ctx->framerate.num > 0 ? video_ctx->framerate : (AVRational){video_ctx->time_base.den, video_ctx->time_base.num};
+    int frame_size = audio_ctx->frame_size > 0 ? audio_ctx->frame_size : 1024;
+    int64_t delay_packets = av_rescale(video_delay, (int64_t)framerate.den * audio_ctx->sample_rate, (int64_t)framerate.num * frame_size);
+    return MP4_MUXER_QUEUE_SIZE + delay_packets + 1;
+}
+
+/*
+ * sink_option NULL: avio opens the file itself. video_delay is how many
+ * frames the video encoder holds back (H264EnCoderDelay); audio keeps coming
+ * meanwhile and the muxer can't write it before video catches up, so the
+ * audio queue gets room for it and the audio encoder, and capture behind
+ * it, never wait on the muxer.
+ */
+bool Mp4MuxerInitWithSink(Mp4Muxer *muxer, const char *filename, AVCodecContext *video_ctx, AVCodecContext *audio_ctx, int video_delay,
+                          const OutputSinkOption *sink_option)
+{
+    memset(muxer, 0, sizeof(Mp4Muxer));
+    if (avformat_alloc_output_context2(&muxer->fmt_ctx, NULL, "mp4", filename) < 0)
+    {
+        printf("can't alloc mp4 output context\n");
+        return false;
+    }
+    muxer->streams[MP4_MUXER_VIDEO] = mp4_muxer_add_stream(muxer, MP4_MUXER_VIDEO, video_ctx);
+    muxer->streams[MP4_MUXER_AUDIO] = mp4_muxer_add_stream(muxer, MP4_MUXER_AUDIO, audio_ctx);
+    if (!muxer->streams[MP4_MUXER_VIDEO] || !muxer->streams[MP4_MUXER_AUDIO])
+    {
+        printf("can't add mp4 streams\n");
+        return false;
+    }
+    if (sink_option ? !mp4_muxer_open_sink(muxer, filename, sink_option) : avio_open(&muxer->fmt_ctx->pb, filename, AVIO_FLAG_WRITE) < 0)
+    {
+        printf("can't open %s\n", filename);
+        return false;
+    }
+    int queue_size[2] = {MP4_MUXER_QUEUE_SIZE, mp4_muxer_audio_queue_size(video_ctx, audio_ctx, video_delay)};
+    for (int i = 0; i < 2; i++)
+    {
+        // queue slots, the one Mp4MuxerRun holds and the one being pushed
+        if (!FrameQueueInit(&muxer->queue[i], queue_size[i]) || !PacketPoolInit(&muxer->pool[i], queue_size[i] + 2, true))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+/* takes the packet data over (av_packet_move_ref), pkt is left blank */
+bool Mp4MuxerSendPacket(Mp4Muxer *muxer, int stream_index, AVPacket *pkt)
+{
+    AVPacket *queued = PacketPoolTake(&muxer->pool[stream_index], pkt);
+    if (!queued)
+    {
+        return false;
+    }
+    if (!FrameQueuePush(&muxer->queue[stream_index], queued))
+    {
+        PacketPoolRelease(&muxer->pool[stream_index], queued);
+        return false;
+    }
+    return true;
+}
+
+/* the encoder thread of stream_index has sent its last packet */
+void Mp4MuxerClose(Mp4Muxer *muxer, int stream_index)
+{
+    FrameQueueClose(&muxer->queue[stream_index]);
+}
+
+/*
+ * x264 only puts sps/pps in band, mp4 wants them in avcC before the moov
+ * is written, so take everything in front of the first slice of the first
+ * video packet.
+ */
+static bool mp4_muxer_set_h264_extradata(AVCodecParameters *codecpar, const AVPacket *pkt)
+{
+    const uint8_t *p = pkt->data;
+    const uint8_t *end = pkt->data + pkt->size;
+    while (p + 3 < end)
+    {
+        if (p[0] == 0 && p[1] == 0 && p[2] == 1)
+        {
+            int nal_type = p[3] & 0x1F;
+            if (nal_type >= 1 && nal_type <= 5)
+            {
+                // back up over the zero byte of a 4 byte start code
+                if (p > pkt->data && p[-1] == 0)
+                {
+                    p--;
+                }
+                break;
+            }
+            p += 3;
+        }
+        else
+        {
+            p++;
+        }
+    }
+    int size = p - pkt->data;
+    if (size <= 0 || p + 3 >= end)
+    {
+        return false;
+    }
+    codecpar->extradata = av_mallocz(size + AV_INPUT_BUFFER_PADDING_SIZE);
+    if (!codecpar->extradata)
+    {
+        return false;
+    }
+    memcpy(codecpar->extradata, pkt->data, size);
+    codecpar->extradata_size = size;
+    return true;
+}
+
+static bool mp4_muxer_write_header(Mp4Muxer *muxer, const AVPacket *first_video)
+{
+    AVCodecParameters *codecpar = muxer->streams[MP4_MUXER_VIDEO]->codecpar;
+    if (codecpar->extradata_size == 0 && (!first_video || !mp4_muxer_set_h264_extradata(codecpar, first_video)))
+    {
+        printf("no sps/pps in the first video packet\n");
+        return false;
+    }
+
+    AVDictionary *options = NULL;
+    av_dict_set(&options, "movflags", "frag_keyframe+empty_moov+default_base_moof", 0);
+    av_dict_set(&options, "flush_packets", "1", 0);
+    int ret = avformat_write_header(muxer->fmt_ctx, &options);
+    av_dict_free(&options);
+    if (ret < 0)
+    {
+        printf("mp4 write header failed: %s\n", av_err2str(ret));
+        return false;
+    }
+    muxer->header_written = true;
+    return true;
+}
+
+static bool mp4_muxer_write_packet(Mp4Muxer *muxer, int stream_index, AVPacket *pkt)
+{
+    AVStream *stream = muxer->streams[stream_index];
+    pkt->stream_index = stream->index;
+    if (pkt->duration == 0)
+    {
+        pkt->duration = muxer->duration[stream_index];
+    }
+    av_packet_rescale_ts(pkt, muxer->time_base[stream_index], stream->time_base);
+    int ret = av_write_frame(muxer->fmt_ctx, pkt);
+    if (ret < 0)
+    {
+        printf("mp4 write packet failed: %s\n", av_err2str(ret));
+        return false;
+    }
+    muxer->packets[stream_index]++;
+    return true;
+}
+
+static int64_t mp4_muxer_packet_ts(const AVPacket *pkt)
+{
+    return pkt->dts != AV_NOPTS_VALUE ? pkt->dts : pkt->pts;
+}
+
+/*
+ * merges both queues by dts until both encoders have closed theirs.
+ * holding one packet per stream is enough since each encoder emits in dts order.
+ */
+bool Mp4MuxerRun(Mp4Muxer *muxer)
+{
+    AVPacket *next[2] = {NULL, NULL};
+    bool done[2] = {false, false};
+    bool ok = true;
+    while (ok)
+    {
+        for (int i = 0; i < 2; i++)
+        {
+            if (!next[i] && !done[i])
+            {
+                next[i] = FrameQueuePop(&muxer->queue[i]);
+                done[i] = next[i] == NULL;
+            }
+        }
+        if (!next[MP4_MUXER_VIDEO] && !next[MP4_MUXER_AUDIO])
+        {
+            break;
+        }
+
+        int pick;
+        if (!next[MP4_MUXER_VIDEO])
+        {
+            pick = MP4_MUXER_AUDIO;
+        }
+        else if (!next[MP4_MUXER_AUDIO])
+        {
+            pick = MP4_MUXER_VIDEO;
+        }
+        else
+        {
+            pick = av_compare_ts(mp4_muxer_packet_ts(next[MP4_MUXER_AUDIO]), muxer->time_base[MP4_MUXER_AUDIO],
+                                 mp4_muxer_packet_ts(next[MP4_MUXER_VIDEO]), muxer->time_base[MP4_MUXER_VIDEO]) < 0
+                       ? MP4_MUXER_AUDIO
+                       : MP4_MUXER_VIDEO;
+        }
+
+        if (!muxer->header_written && !mp4_muxer_write_header(muxer, next[MP4_MUXER_VIDEO]))
+        {
+            ok = false;
+        }
+        else
+        {
+            ok = mp4_muxer_write_packet(muxer, pick, next[pick]);
+        }
+        PacketPoolRelease(&muxer->pool[pick], next[pick]);
+        next[pick] = NULL;
+    }
+
+    // on error keep draining so the encoder threads never block on a full queue
+    for (int i = 0; i < 2; i++)
+    {
+        PacketPoolRelease(&muxer->pool[i], next[i]);
+        while (!done[i] && (next[i] = FrameQueuePop(&muxer->queue[i])) != NULL)
+        {
+            PacketPoolRelease(&muxer->pool[i], next[i]);
+        }
+    }
+    if (muxer->header_written)
+    {
+        av_write_trailer(muxer->fmt_ctx);
+    }
+    printf("mp4 muxer wrote video:%ld audio:%ld packets\n", muxer->packets[MP4_MUXER_VIDEO], muxer->packets[MP4_MUXER_AUDIO]);
+    PacketPoolReport(&muxer->pool[MP4_MUXER_VIDEO], "video");
+    PacketPoolReport(&muxer->pool[MP4_MUXER_AUDIO], "audio");
+    return ok;
+}
+
+void *Mp4MuxerThread(void *args)
+{
+    Mp4MuxerRun(args);
+    return NULL;
+}
+
+void Mp4MuxerDestroy(Mp4Muxer *muxer)
+{
+    if (muxer->fmt_ctx)
+    {
+        if (muxer->use_sink)
+        {
+            if (muxer->fmt_ctx->pb)
+            {
+                avio_flush(muxer->fmt_ctx->pb);
+                av_freep(&muxer->fmt_ctx->pb->buffer);
+                avio_context_free(&muxer->fmt_ctx->pb);
+            }
+            OutputSinkClose(&muxer->sink);
+            OutputSinkReport(&muxer->sink, "mp4");
+            muxer->use_sink = false;
+        }
+        else
+        {
+            avio_closep(&muxer->fmt_ctx->pb);
+        }
+        avformat_free_context(muxer->fmt_ctx);
+        muxer->fmt_ctx = NULL;
+    }
+    FrameQueueDestroy(&muxer->queue[MP4_MUXER_VIDEO]);
+    FrameQueueDestroy(&muxer->queue[MP4_MUXER_AUDIO]);
+    PacketPoolDestroy(&muxer->pool[MP4_MUXER_VIDEO]);
+    PacketPoolDestroy(&muxer->pool[MP4_MUXER_AUDIO]);
+}
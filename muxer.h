@@ -0,0 +1,49 @@
+#ifndef _MUXER_H
+#define _MUXER_H
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdbool.h>
+#include <libavcodec/avcodec.h>
+#include <libavformat/avformat.h>
+#include "framequeue.h"
+#include "outputsink.h"
+#include "packetpool.h"
+
+#define MP4_MUXER_VIDEO 0
+#define MP4_MUXER_AUDIO 1
+#define MP4_MUXER_QUEUE_SIZE 128 // per stream, the audio queue adds the video encoder's delay
+
+/*
+ * fragmented mp4 writer fed by both encoders.
+ * the encoder threads hand packets over with Mp4MuxerSendPacket (one spsc
+ * queue per stream), Mp4MuxerRun merges them by dts and writes a moof/mdat
+ * fragment per gop, so the file can be played while it is being recorded.
+ * queued packets come from one PacketPool per stream, sized so a full queue
+ * plus the packet being merged never needs a new allocation. the audio queue
+ * also holds the audio that arrives before the video encoder's lookahead
+ * lets the matching video out.
+ */
+typedef struct
+{
+    AVFormatContext *fmt_ctx;
+    AVStream *streams[2];
+    AVRational time_base[2]; // encoder side time base of each stream
+    int64_t duration[2];     // per packet duration in time_base
+    FrameQueue queue[2];
+    PacketPool pool[2];
+    bool header_written;
+    int64_t packets[2];
+    bool use_sink; // fmt_ctx->pb writes into sink instead of a file opened by avio
+    OutputSink sink;
+} Mp4Muxer;
+
+bool Mp4MuxerInit(Mp4Muxer *muxer, const char *filename, AVCodecContext *video_ctx, AVCodecContext *audio_ctx);
+bool Mp4MuxerInitWithSink(Mp4Muxer *muxer, const char *filename, AVCodecContext *video_ctx, AVCodecContext *audio_ctx, int video_delay,
+                          const OutputSinkOption *sink_option);
+bool Mp4MuxerSendPacket(Mp4Muxer *muxer, int stream_index, AVPacket *pkt);
+void Mp4MuxerClose(Mp4Muxer *muxer, int stream_index);
+bool Mp4MuxerRun(Mp4Muxer *muxer);
+void *Mp4MuxerThread(void *args);
+void Mp4MuxerDestroy(Mp4Muxer *muxer);
+#endif
@@ -0,0 +1,459 @@
+#define _GNU_SOURCE
+#include "outputsink.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <limits.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+void OutputSinkOptionDefault(OutputSinkOption *option)
+{
+    option->backend = OUTPUT_SINK_BLOCKING;
+    option->direct = false;
+    option->prealloc = 0;
+    option->buffer_size = 1024 * 1024;
+    option->buffer_num = 8;
+    option->submit_batch = 4;
+}
+
+/* data goes through the staging buffers rather than straight to writev */
+static bool output_sink_staged(OutputSink *sink)
+{
+    return sink->backend == OUTPUT_SINK_URING || sink->direct;
+}
+
+static bool output_sink_pwrite(OutputSink *sink, const uint8_t *data, size_t size, uint64_t offset)
+{
+    while (size > 0)
+    {
+        ssize_t n = pwrite(sink->fd, data, size, offset);
+        sink->syscalls++;
+        if (n < 0 && errno == EINTR)
+        {
+            continue;
+        }
+        if (n <= 0)
+        {
+            perror("output sink write failed");
+            sink->error = true;
+            return false;
+        }
+        data += n;
+        size -= n;
+        offset += n;
+    }
+    return true;
+}
+
+static void output_sink_release(OutputSink *sink, int index)
+{
+    sink->free_list[sink->free_num++] = index;
+    sink->writes++;
+}
+
+#ifdef HAVE_LIBURING
+static bool output_sink_submit_queued(OutputSink *sink)
+{
+    while (sink->queued > 0)
+    {
+        int ret = io_uring_submit(&sink->ring);
+        sink->syscalls++;
+        if (ret < 0 && ret != -EINTR && ret != -EAGAIN && ret != -EBUSY)
+        {
+            errno = -ret;
+            perror("io_uring submit failed");
+            sink->error = true;
+            return false;
+        }
+        if (ret > 0)
+        {
+            sink->queued -= ret;
+            sink->inflight += ret;
+        }
+    }
+    return true;
+}
+
+/* recycles finished buffers, blocks for one completion when wait is set */
+static bool output_sink_reap(OutputSink *sink, bool wait)
+{
+    if (!output_sink_submit_queued(sink))
+    {
+        return false;
+    }
+    struct io_uring_cqe *cqe;
+    if (wait && sink->inflight > 0)
+    {
+        sink->syscalls++;
+        sink->waits++;
+        int ret = io_uring_wait_cqe(&sink->ring, &cqe);
+        if (ret < 0 && ret != -EINTR)
+        {
+            errno = -ret;
+            perror("io_uring wait failed");
+            sink->error = true;
+            return false;
+        }
+    }
+    while (sink->inflight > 0 && io_uring_peek_cqe(&sink->ring, &cqe) == 0)
+    {
+        int index = (int)(uintptr_t)io_uring_cqe_get_data(cqe);
+        int res = cqe->res;
+        io_uring_cqe_seen(&sink->ring, cqe);
+        sink->inflight--;
+        if (res < 0)
+        {
+            errno = -res;
+            perror("output sink write failed");
+            sink->error = true;
+        }
+        else if ((size_t)res < sink->buffer_len[index])
+        {
+            // short write, rare on regular files. the rest goes out synchronously
+            uint8_t *buf = sink->buffers + (size_t)index * sink->option.buffer_size;
+            output_sink_pwrite(sink, buf + res, sink->buffer_len[index] - res, sink->buffer_offset[index] + res);
+        }
+        output_sink_release(sink, index);
+    }
+    return !sink->error;
+}
+#else
+static bool output_sink_reap(OutputSink *sink, bool wait)
+{
+    (void)wait;
+    return !sink->error;
+}
+#endif
+
+/* sends the current buffer out. in direct mode a partial (last) buffer is zero padded */
+static bool output_sink_submit(OutputSink *sink)
+{
+    int index = sink->current;
+    uint8_t *buf = sink->buffers + (size_t)index * sink->option.buffer_size;
+    size_t len = sink->fill;
+    if (sink->direct && len % OUTPUT_SINK_ALIGN)
+    {
+        size_t padded = (len + OUTPUT_SINK_ALIGN - 1) / OUTPUT_SINK_ALIGN * OUTPUT_SINK_ALIGN;
+        memset(buf + len, 0, padded - len);
+        len = padded;
+    }
+    sink->buffer_len[index] = len;
+    sink->buffer_offset[index] = sink->offset;
+    sink->offset += sink->fill;
+    sink->size = sink->offset > sink->size ? sink->offset : sink->size;
+    sink->current = -1;
+    sink->fill = 0;
+
+#ifdef HAVE_LIBURING
+    if (sink->backend == OUTPUT_SINK_URING)
+    {
+        struct io_uring_sqe *sqe = io_uring_get_sqe(&sink->ring);
+        if (!sqe)
+        {
+            if (!output_sink_submit_queued(sink) || !(sqe = io_uring_get_sqe(&sink->ring)))
+            {
+                sink->error = true;
+                return false;
+            }
+        }
+        if (sink->fixed)
+        {
+            io_uring_prep_write_fixed(sqe, sink->fd, buf, len, sink->buffer_offset[index], index);
+        }
+        else
+        {
+            io_uring_prep_write(sqe, sink->fd, buf, len, sink->buffer_offset[index]);
+        }
+        io_uring_sqe_set_data(sqe, (void *)(uintptr_t)index);
+        if (++sink->queued >= sink->option.submit_batch && !output_sink_submit_queued(sink))
+        {
+            return false;
+        }
+        // pick up whatever finished meanwhile, without blocking
+        return output_sink_reap(sink, false);
+    }
+#endif
+    bool ok = output_sink_pwrite(sink, buf, len, sink->buffer_offset[index]);
+    output_sink_release(sink, index);
+    return ok;
+}
+
+static bool output_sink_write_staged(OutputSink *sink, const uint8_t *data, size_t size)
+{
+    while (size > 0)
+    {
+        if (sink->current < 0)
+        {
+            while (sink->free_num == 0)
+            {
+                if (!output_sink_reap(sink, true))
+                {
+                    return false;
+                }
+            }
+            sink->current = sink->free_list[--sink->free_num];
+            sink->fill = 0;
+        }
+        size_t n = sink->option.buffer_size - sink->fill;
+        n = n < size ? n : size;
+        memcpy(sink->buffers + (size_t)sink->current * sink->option.buffer_size + sink->fill, data, n);
+        sink->fill += n;
+        data += n;
+        size -= n;
+        sink->bytes += n;
+        if (sink->fill == (size_t)sink->option.buffer_size && !output_sink_submit(sink))
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+bool OutputSinkOpen(OutputSink *sink, const char *path, const OutputSinkOption *option)
+{
+    memset(sink, 0, sizeof(OutputSink));
+    sink->current = -1;
+    if (option)
+    {
+        sink->option = *option;
+    }
+    else
+    {
+        OutputSinkOptionDefault(&sink->option);
+    }
+    OutputSinkOption *opt = &sink->option;
+    opt->buffer_num = opt->buffer_num < 2 ? 2 : opt->buffer_num > OUTPUT_SINK_MAX_BUFFERS ? OUTPUT_SINK_MAX_BUFFERS : opt->buffer_num;
+    opt->buffer_size = opt->buffer_size < OUTPUT_SINK_ALIGN ? OUTPUT_SINK_ALIGN : opt->buffer_size / OUTPUT_SINK_ALIGN * OUTPUT_SINK_ALIGN;
+    opt->submit_batch = opt->submit_batch < 1 ? 1 : opt->submit_batch > opt->buffer_num ? opt->buffer_num : opt->submit_batch;
+
+    int flags = O_WRONLY | O_CREAT | O_TRUNC;
+    sink->fd = opt->direct ? open(path, flags | O_DIRECT, 0644) : -1;
+    sink->direct = sink->fd >= 0;
+    if (opt->direct && !sink->direct)
+    {
+        printf("%s: O_DIRECT not supported here, writing through the page cache\n", path);
+    }
+    if (sink->fd < 0)
+    {
+        sink->fd = open(path, flags, 0644);
+    }
+    if (sink->fd < 0)
+    {
+        perror("output sink open failed");
+        return false;
+    }
+    // reserve the extents up front, the file size only grows as data is written
+    if (opt->prealloc > 0 && fallocate(sink->fd, FALLOC_FL_KEEP_SIZE, 0, opt->prealloc) < 0)
+    {
+        perror("output sink fallocate failed, continuing without");
+    }
+
+    sink->backend = OUTPUT_SINK_BLOCKING;
+    if (opt->backend == OUTPUT_SINK_URING)
+    {
+#ifdef HAVE_LIBURING
+        int ret = io_uring_queue_init(opt->buffer_num, &sink->ring, 0);
+        if (ret < 0)
+        {
+            printf("io_uring unavailable (%s), using blocking writes\n", strerror(-ret));
+        }
+        else
+        {
+            sink->backend = OUTPUT_SINK_URING;
+        }
+#else
+        printf("built without HAVE_LIBURING, using blocking writes\n");
+#endif
+    }
+    if (output_sink_staged(sink))
+    {
+        if (posix_memalign((void **)&sink->buffers, OUTPUT_SINK_ALIGN, (size_t)opt->buffer_size * opt->buffer_num) != 0)
+        {
+            perror("output sink alloc failed");
+            OutputSinkClose(sink);
+            return false;
+        }
+        for (int i = opt->buffer_num - 1; i >= 0; i--)
+        {
+            sink->free_list[sink->free_num++] = i;
+        }
+#ifdef HAVE_LIBURING
+        if (sink->backend == OUTPUT_SINK_URING)
+        {
+            struct iovec iov[OUTPUT_SINK_MAX_BUFFERS];
+            for (int i = 0; i < opt->buffer_num; i++)
+            {
+                iov[i] = (struct iovec){sink->buffers + (size_t)i * opt->buffer_size, opt->buffer_size};
+            }
+            // registering pins the pages once instead of on every write, may fail on a low RLIMIT_MEMLOCK
+            sink->fixed = io_uring_register_buffers(&sink->ring, iov, opt->buffer_num) == 0;
+        }
+#endif
+    }
+    return true;
+}
+
+bool OutputSinkWrite(OutputSink *sink, const void *data, size_t size)
+{
+    struct iovec iov = {(void *)data, size};
+    return OutputSinkWritev(sink, &iov, 1);
+}
+
+/* iov is consumed: entries are advanced past what was written */
+bool OutputSinkWritev(OutputSink *sink, struct iovec *iov, int iov_num)
+{
+    if (sink->error)
+    {
+        return false;
+    }
+    if (output_sink_staged(sink))
+    {
+        for (int i = 0; i < iov_num; i++)
+        {
+            if (!output_sink_write_staged(sink, iov[i].iov_base, iov[i].iov_len))
+            {
+                return false;
+            }
+        }
+        return true;
+    }
+    while (iov_num > 0)
+    {
+        ssize_t n = writev(sink->fd, iov, iov_num > IOV_MAX ? IOV_MAX : iov_num);
+        sink->syscalls++;
+        if (n < 0)
+        {
+            if (errno == EINTR)
+            {
+                continue;
+            }
+            perror("output sink writev failed");
+            sink->error = true;
+            return false;
+        }
+        sink->writes++;
+        sink->bytes += n;
+        while (iov_num > 0 && (size_t)n >= iov->iov_len)
+        {
+            n -= iov->iov_len;
+            iov++;
+            iov_num--;
+        }
+        if (iov_num > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + n;
+            iov->iov_len -= n;
+        }
+    }
+    return true;
+}
+
+/*
+ * pushes out what is buffered without waiting for it. in direct mode a
+ * partial buffer stays until it fills up or the sink is closed, since a
+ * write can't end off alignment in the middle of the file.
+ */
+bool OutputSinkFlush(OutputSink *sink)
+{
+    if (output_sink_staged(sink) && !sink->direct && sink->current >= 0 && sink->fill > 0 && !output_sink_submit(sink))
+    {
+        return false;
+    }
+    return output_sink_reap(sink, false);
+}
+
+/* absolute seek for muxers that patch headers. not available with O_DIRECT */
+int64_t OutputSinkSeek(OutputSink *sink, int64_t offset)
+{
+    if (sink->direct || offset < 0)
+    {
+        return -1;
+    }
+    if (!output_sink_staged(sink))
+    {
+        return lseek(sink->fd, offset, SEEK_SET);
+    }
+    // writes in flight may overlap the region about to be rewritten, let them land first
+    if (!OutputSinkFlush(sink))
+    {
+        return -1;
+    }
+    while (sink->inflight > 0 || sink->queued > 0)
+    {
+        if (!output_sink_reap(sink, true))
+        {
+            return -1;
+        }
+    }
+    sink->offset = offset;
+    return offset;
+}
+
+int64_t OutputSinkTell(OutputSink *sink)
+{
+    if (!output_sink_staged(sink))
+    {
+        return lseek(sink->fd, 0, SEEK_CUR);
+    }
+    return sink->offset + (sink->current >= 0 ? sink->fill : 0);
+}
+
+void OutputSinkReport(OutputSink *sink, const char *name)
+{
+    printf("%s sink: %s%s%s, %ld bytes in %ld writes, %ld syscalls, waited for a buffer %ld times\n", name,
+           sink->backend == OUTPUT_SINK_URING ? "io_uring" : "blocking", sink->fixed ? " registered buffers" : "", sink->direct ? " O_DIRECT" : "",
+           sink->bytes, sink->writes, sink->syscalls, sink->waits);
+}
+
+/* writes what is left, waits for every completion and closes the file */
+bool OutputSinkClose(OutputSink *sink)
+{
+    bool ok = !sink->error;
+    if (sink->buffers)
+    {
+        if (sink->current >= 0 && sink->fill > 0)
+        {
+            ok = output_sink_submit(sink) && ok;
+        }
+        while (sink->inflight > 0 || sink->queued > 0)
+        {
+            if (!output_sink_reap(sink, true))
+            {
+                ok = false;
+                break;
+            }
+        }
+    }
+    // drop the zero padding of the last direct write, and preallocated blocks past the end
+    if (sink->fd >= 0 && sink->direct)
+    {
+        ok = ftruncate(sink->fd, sink->size) == 0 && ok;
+    }
+    else if (sink->fd >= 0 && sink->option.prealloc > 0)
+    {
+        off_t end = lseek(sink->fd, 0, SEEK_END);
+        ok = end >= 0 && ftruncate(sink->fd, end) == 0 && ok;
+    }
+#ifdef HAVE_LIBURING
+    // backend and fixed stay as they were for OutputSinkReport, the closed fd keeps this from running twice
+    if (sink->backend == OUTPUT_SINK_URING && sink->fd >= 0)
+    {
+        if (sink->fixed)
+        {
+            io_uring_unregister_buffers(&sink->ring);
+        }
+        io_uring_queue_exit(&sink->ring);
+    }
+#endif
+    free(sink->buffers);
+    sink->buffers = NULL;
+    if (sink->fd >= 0)
+    {
+        ok = close(sink->fd) == 0 && ok;
+        sink->fd = -1;
+    }
+    return ok;
+}
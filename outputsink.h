@@ -0,0 +1,77 @@
+#ifndef _OUTPUTSINK_H
+#define _OUTPUTSINK_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <sys/uio.h>
+#ifdef HAVE_LIBURING
+#include <liburing.h>
+#endif
+
+#define OUTPUT_SINK_ALIGN 4096 // O_DIRECT offset, length and address alignment
+#define OUTPUT_SINK_MAX_BUFFERS 64
+
+typedef enum
+{
+    OUTPUT_SINK_BLOCKING,
+    OUTPUT_SINK_URING // needs HAVE_LIBURING at build time and io_uring in the kernel, else blocking
+} OutputSinkBackend;
+
+typedef struct
+{
+    OutputSinkBackend backend;
+    bool direct;      // O_DIRECT, bypasses the page cache. ignored where the filesystem refuses it
+    int64_t prealloc; // bytes reserved with fallocate when opening, 0: none
+    int buffer_size;  // staging buffer, a multiple of OUTPUT_SINK_ALIGN
+    int buffer_num;   // staging buffers, i.e. writes in flight at most
+    int submit_batch; // writes queued before one io_uring_submit
+} OutputSinkOption;
+
+/*
+ * sequential output file. the blocking backend without O_DIRECT passes
+ * writes straight to writev. otherwise data is copied into aligned staging
+ * buffers (registered with io_uring when it is used) and a buffer goes out
+ * as one write once full. with io_uring the encode thread only queues it,
+ * the completion puts the buffer back on the free list, and the caller
+ * waits only when every buffer is still in flight.
+ */
+typedef struct
+{
+    int fd;
+    OutputSinkOption option;
+    OutputSinkBackend backend; // what is actually in use
+    bool direct;
+    bool fixed; // buffers are registered, writes use io_uring_prep_write_fixed
+    uint8_t *buffers;
+    int free_list[OUTPUT_SINK_MAX_BUFFERS];
+    int free_num;
+    size_t buffer_len[OUTPUT_SINK_MAX_BUFFERS];     // bytes submitted from each buffer
+    uint64_t buffer_offset[OUTPUT_SINK_MAX_BUFFERS]; // file offset they go to
+    int current; // buffer being filled, -1: none
+    size_t fill;
+    uint64_t offset; // file offset of the current buffer's first byte
+    uint64_t size;   // logical file size
+#ifdef HAVE_LIBURING
+    struct io_uring ring;
+#endif
+    int queued;   // prepared, not submitted yet
+    int inflight; // submitted, not completed yet
+    bool error;
+
+    int64_t bytes;
+    int64_t syscalls; // write/writev/submit/wait calls
+    int64_t writes;   // buffers or iovec batches written
+    int64_t waits;    // times the caller blocked for a free buffer
+} OutputSink;
+
+void OutputSinkOptionDefault(OutputSinkOption *option);
+bool OutputSinkOpen(OutputSink *sink, const char *path, const OutputSinkOption *option);
+bool OutputSinkWrite(OutputSink *sink, const void *data, size_t size);
+bool OutputSinkWritev(OutputSink *sink, struct iovec *iov, int iov_num);
+bool OutputSinkFlush(OutputSink *sink);
+int64_t OutputSinkSeek(OutputSink *sink, int64_t offset);
+int64_t OutputSinkTell(OutputSink *sink);
+void OutputSinkReport(OutputSink *sink, const char *name);
+bool OutputSinkClose(OutputSink *sink);
+#endif
@@ -1,56 +1,811 @@
-#include "../audio/lio_soundcard.h"
-#include "../video/lio_camera.h"
+#include "liodevice.h"
 #include "../video/format_convert.h"
+#include "yuvconvert.h"
+#include "framequeue.h"
+#include "codeh264.h"
+#include "codeaac.h"
+#include "muxer.h"
+#include "h264governor.h"
+#include "framediff.h"
+#include "framepool.h"
 #include <pthread.h>
+#include <string.h>
+#include <signal.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/epoll.h>
+
+/*
+ * capture -> encode in one process:
+ * gcc package.c codeh264.c h264governor.c framediff.c framepool.c codeaac.c encstats.c yuvconvert.c sampleconvert.c framequeue.c muxer.c outputsink.c packetpool.c liodevice.c ../audio/lio_soundcard.c ../video/lio_camera.c ../video/format_convert.c
+ *     -DLIO_NO_MAIN -o package -lavcodec -lavformat -lavutil -lswscale -lasound -lpthread
+ * writes a fragmented output.mp4 that can be played while recording,
+ * ./package --dump-raw additionally writes video.yuv/audio.pcm for debugging
+ * kill -USR1 <pid> makes the next video frame an IDR, for a viewer joining the stream
+ * ./package --drop oldest|non-ref|none chooses what happens to video when encoding falls behind, default oldest
+ *     (capture used to block until the encoder caught up, that is now --drop none)
+ * ./package --governor 0.8 lets video encoding use 80% of the frame interval, x264 steps down (and back) through the speed settings of the faster presets to stay inside, the stream headers stay the same
+ * ./package --skip-static 1.5 leaves out frames that barely differ from the last encoded one (at least 1 fps is kept)
+ * ./package --stats prints one JSON line of encoder statistics per encoder and second to stderr
+ * ./package --uring [--direct] writes output.mp4 through io_uring (build with -DHAVE_LIBURING -luring), optionally with O_DIRECT
+ * ./package --event-loop captures camera and sound card from one epoll thread instead of one blocking thread per device,
+ *     the thread never waits for an encoder so it can't be combined with --drop none
+ */
 
 #define TIME 10
+#define VIDEO_BUF_NUM 4
+#define AUDIO_BUF_NUM 16
+#define AUDIO_FRAME_BYTES 4 // s16 stereo
 
-pthread_mutex_t mutex = PTHREAD_MUTEX_INITIALIZER;
-void *camera_pthread(void *args)
+static H264EnCoder *key_frame_encoder;
+
+static void key_frame_signal(int signo)
 {
-    LioCamera *lio_camera = args;
-    FILE *fp = fopen("./video.yuv", "wb");
+    (void)signo;
+    // only an atomic store, fine inside a signal handler
+    H264EnCoderRequestKeyFrame(key_frame_encoder);
+}
 
-    int width = lio_camera->fmt.fmt.pix.width;
-    int height = lio_camera->fmt.fmt.pix.height;
-    unsigned char yuv_buff[width * height * 3 / 2];
-    unsigned char *yuyv_buff;
-    LioCameraStartStream(lio_camera);
-    int count = 0;
-    while (count < TIME * 10)
-    {
-        pthread_mutex_lock(&mutex);
-        yuyv_buff = LioCameraFetchStream(lio_camera);
-        pthread_mutex_unlock(&mutex);
-        yuyv422_to_yuv420(yuyv_buff, yuv_buff, width, height);
-        fwrite(yuv_buff, width * height * 1.5, 1, fp);
-        LioCameraPutStream(lio_camera);
-        count++;
-    }
-    LioCameraStopStream(lio_camera);
-    LioCameraDestroy(lio_camera);
+typedef struct CaptureChannel CaptureChannel;
+
+typedef enum
+{
+    CAPTURE_DROP_NONE,          // capture waits for a free buffer, the driver drops frames behind our back
+    CAPTURE_DROP_OLDEST,        // the oldest queued frame is dropped to make room
+    CAPTURE_DROP_NON_REFERENCE, // the new frame is dropped unless it starts a gop, gop starts replace the oldest frame
+} CaptureDropPolicy;
+
+typedef struct
+{
+    unsigned char *data;
+    AVBufferRef *ref; // pool buffer behind data, taken on acquire and handed on to the encoder
+    int64_t index;
+    int64_t capture_ns; // CLOCK_MONOTONIC when the device handed the data over
+    CaptureChannel *channel;
+} CaptureBuffer;
+
+/*
+ * every capture thread owns one queue pair: filled buffers go to its
+ * encoder thread through `queue`, and their descriptors come back through
+ * `free_queue`, which bounds the frames waiting for the encoder. the pixels
+ * or samples live in `pool` buffers that go back to the pool when their last
+ * reference, possibly the encoder's, is dropped.
+ * both queues are spsc, so capture and encode never share a lock.
+ */
+struct CaptureChannel
+{
+    FrameQueue queue;
+    FrameQueue free_queue;
+    FramePool pool;
+    CaptureBuffer *bufs;
+    CaptureBuffer *spare; // taken but no pool buffer was left for it, only touched by capture
+    int buf_num;
+    size_t buf_size;
+    CaptureDropPolicy drop_policy;
+    int gop_size;          // for CAPTURE_DROP_NON_REFERENCE
+    _Atomic int64_t dropped_new; // written by the capture thread, read by reports
+    _Atomic int64_t dropped_old;
+    _Atomic int64_t waits;       // times capture had to block, or defer a read, for a buffer
+    int64_t latency_ns;          // dequeue to encoder pickup, written by the encoder thread
+    int64_t latency_max_ns;
+    int64_t latency_num;
+};
+
+typedef struct
+{
+    LioCamera *lio_camera;
+    CaptureChannel channel;
+    int width;
+    int height;
+    FILE *raw_fp;
+    H264EnCoder h264_encoder;
+    H264Governor *governor; // NULL: fixed preset
+    StaticDetector *detector; // NULL: encode every frame
+    Mp4Muxer *muxer;
+} VideoPipe;
+
+typedef struct
+{
+    LioSoundCard *lio_soundcard;
+    CaptureChannel channel;
+    FILE *raw_fp;
+    AACEnCoder aac_encoder;
+    Mp4Muxer *muxer;
+} AudioPipe;
+
+/*
+ * one slab holds buf_num buffers plus a couple the encoder may still hold
+ * while capture already refills, hugepages for frame sized buffers
+ */
+bool CaptureChannelInit(CaptureChannel *channel, int buf_num, size_t buf_size, bool hugepages)
+{
+    if (!FrameQueueInit(&channel->queue, buf_num) || !FrameQueueInit(&channel->free_queue, buf_num) ||
+        !FramePoolInit(&channel->pool, buf_size, buf_num + 2, hugepages))
+    {
+        return false;
+    }
+    channel->bufs = calloc(buf_num, sizeof(CaptureBuffer));
+    if (!channel->bufs)
+    {
+        perror("capture buffer alloc failed");
+        return false;
+    }
+    channel->buf_num = buf_num;
+    channel->buf_size = buf_size;
+    channel->spare = NULL;
+    channel->drop_policy = CAPTURE_DROP_NONE;
+    channel->gop_size = 0;
+    channel->dropped_new = 0;
+    channel->dropped_old = 0;
+    channel->waits = 0;
+    channel->latency_ns = 0;
+    channel->latency_max_ns = 0;
+    channel->latency_num = 0;
+    // warm the pool up front, capture then never allocates
+    for (int i = 0; i < buf_num; i++)
+    {
+        channel->bufs[i].channel = channel;
+        channel->bufs[i].ref = FramePoolGet(&channel->pool);
+        if (!channel->bufs[i].ref)
+        {
+            perror("capture buffer alloc failed");
+            return false;
+        }
+    }
+    for (int i = 0; i < buf_num; i++)
+    {
+        av_buffer_unref(&channel->bufs[i].ref);
+        FrameQueuePush(&channel->free_queue, &channel->bufs[i]);
+    }
+    return true;
+}
+
+void CaptureChannelReport(CaptureChannel *channel, const char *name)
+{
+    printf("%s queue depth:%zu/%zu max:%zu dropped new:%ld old:%ld waits:%ld latency avg:%.1fms max:%.1fms\n", name, FrameQueueDepth(&channel->queue),
+           FrameQueueCapacity(&channel->queue), FrameQueueMaxDepth(&channel->queue), channel->dropped_new, channel->dropped_old, channel->waits,
+           channel->latency_num ? channel->latency_ns / 1e6 / channel->latency_num : 0, channel->latency_max_ns / 1e6);
+}
+
+/* called by the encoder thread as it picks buf up */
+void CaptureChannelLatency(CaptureChannel *channel, CaptureBuffer *buf)
+{
+    int64_t latency = EncoderStatsNow() - buf->capture_ns;
+    channel->latency_ns += latency;
+    channel->latency_max_ns = latency > channel->latency_max_ns ? latency : channel->latency_max_ns;
+    channel->latency_num++;
+}
+
+/* a descriptor fresh from free_queue gets a pool buffer, an evicted one keeps its own */
+static CaptureBuffer *capture_buffer_attach(CaptureChannel *channel, CaptureBuffer *buf)
+{
+    if (!buf || buf->ref)
+    {
+        return buf;
+    }
+    buf->ref = FramePoolGet(&channel->pool);
+    if (!buf->ref)
+    {
+        perror("capture buffer alloc failed");
+        // free_queue only has the encoder as producer, keep it for the next acquire instead
+        channel->spare = buf;
+        channel->dropped_new++;
+        return NULL;
+    }
+    buf->data = buf->ref->data;
+    return buf;
+}
+
+static CaptureBuffer *capture_channel_take(CaptureChannel *channel, int64_t index, bool wait)
+{
+    CaptureBuffer *buf = channel->spare;
+    if (buf)
+    {
+        channel->spare = NULL;
+        return buf;
+    }
+    if (channel->drop_policy != CAPTURE_DROP_NONE)
+    {
+        bool gop_start = channel->gop_size > 0 && index % channel->gop_size == 0;
+        if (channel->drop_policy == CAPTURE_DROP_NON_REFERENCE && !gop_start)
+        {
+            // the last free buffer is kept for the next gop start, so it never has to evict one
+            if (FrameQueueDepth(&channel->free_queue) > 1 && (buf = FrameQueueTryPop(&channel->free_queue)) != NULL)
+            {
+                return buf;
+            }
+            channel->dropped_new++;
+            return NULL;
+        }
+        if ((buf = FrameQueueTryPop(&channel->free_queue)) != NULL)
+        {
+            return buf;
+        }
+        /*
+         * with CAPTURE_DROP_NON_REFERENCE only a gop start can take the last
+         * free buffer, so when none is left the newest queued frame is a gop
+         * start. the oldest one evicted here is then either not a gop start or
+         * an older one that the newer queued gop start supersedes.
+         */
+        if ((buf = FrameQueueTryPop(&channel->queue)) != NULL)
+        {
+            channel->dropped_old++;
+            return buf;
+        }
+    }
+    if ((buf = FrameQueueTryPop(&channel->free_queue)) == NULL)
+    {
+        if (!wait)
+        {
+            // under a drop policy the frame is lost like the policy's own drops, without one the caller retries later
+            channel->dropped_new += channel->drop_policy != CAPTURE_DROP_NONE;
+            return NULL;
+        }
+        channel->waits++;
+        buf = FrameQueuePop(&channel->free_queue);
+    }
+    return buf;
+}
+
+/*
+ * buffer for the captured frame with this index, NULL when the policy drops
+ * it. only blocks with CAPTURE_DROP_NONE, or when every buffer is inside the
+ * encoder and none is queued. a dropped frame just leaves a gap in the
+ * indexes, which are the pts, so the timeline stays right.
+ */
+CaptureBuffer *CaptureChannelAcquire(CaptureChannel *channel, int64_t index)
+{
+    return capture_buffer_attach(channel, capture_channel_take(channel, index, true));
+}
+
+/* CaptureChannelAcquire that returns NULL instead of blocking when no buffer is free, counted as a drop under a drop policy */
+CaptureBuffer *CaptureChannelTryAcquire(CaptureChannel *channel, int64_t index)
+{
+    return capture_buffer_attach(channel, capture_channel_take(channel, index, false));
+}
+
+/* the encoder is done with buf: its reference goes back to the pool, the descriptor to capture */
+void CaptureChannelRelease(CaptureChannel *channel, CaptureBuffer *buf)
+{
+    av_buffer_unref(&buf->ref);
+    buf->data = NULL;
+    FrameQueuePush(&channel->free_queue, buf);
+}
+
+void CaptureChannelDestroy(CaptureChannel *channel)
+{
+    for (int i = 0; i < channel->buf_num; i++)
+    {
+        av_buffer_unref(&channel->bufs[i].ref);
+    }
+    free(channel->bufs);
+    FramePoolUninit(&channel->pool);
+    FrameQueueDestroy(&channel->queue);
+    FrameQueueDestroy(&channel->free_queue);
+}
+
+/* yuv420p planes of a video buffer, every plane and line FRAME_POOL_ALIGN aligned */
+void video_buffer_planes(VideoPipe *video_pipe, CaptureBuffer *buf, uint8_t *data[4], int linesize[4])
+{
+    av_image_fill_arrays(data, linesize, buf->data, AV_PIX_FMT_YUV420P, video_pipe->width, video_pipe->height, FRAME_POOL_ALIGN);
+}
+
+/*
+ * dequeues one camera frame, converts it into a capture buffer unless the
+ * policy drops it, and requeues the v4l2 buffer. without wait a frame that
+ * finds no free buffer is dropped instead of waiting for the encoder.
+ */
+void camera_capture_frame(VideoPipe *video_pipe, int64_t count, bool wait)
+{
+    LioCamera *lio_camera = video_pipe->lio_camera;
+    uint8_t *data[4];
+    int linesize[4];
+    unsigned char *yuyv_buff = LioCameraFetchStream(lio_camera);
+    int64_t capture_ns = EncoderStatsNow();
+    // 编码跟不上时按策略丢帧, 不让摄像头缓冲区被占满
+    CaptureBuffer *buf = wait ? CaptureChannelAcquire(&video_pipe->channel, count) : CaptureChannelTryAcquire(&video_pipe->channel, count);
+    if (buf)
+    {
+        video_buffer_planes(video_pipe, buf, data, linesize);
+        yuyv422_to_yuv420p(yuyv_buff, video_pipe->width * 2, data, linesize, video_pipe->width, video_pipe->height, YUYV_CHROMA_AVERAGE);
+    }
+    LioCameraPutStream(lio_camera);
+    if (buf)
+    {
+        buf->index = count;
+        buf->capture_ns = capture_ns;
+        FrameQueuePush(&video_pipe->channel.queue, buf);
+    }
+}
+
+void camera_capture_end(VideoPipe *video_pipe)
+{
+    FrameQueueClose(&video_pipe->channel.queue);
+    LioCameraStopStream(video_pipe->lio_camera);
+    LioCameraDestroy(video_pipe->lio_camera);
+}
+
+void *camera_pthread(void *args)
+{
+    VideoPipe *video_pipe = args;
+    LioCameraStartStream(video_pipe->lio_camera);
+    for (int count = 0; count < TIME * 10; count++)
+    {
+        camera_capture_frame(video_pipe, count, true);
+    }
+    camera_capture_end(video_pipe);
     return NULL;
 };
 
+/* reads one period into a capture buffer, false when there is none to read into */
+bool audio_capture_period(AudioPipe *audio_pipe, int64_t count)
+{
+    LioSoundCard *lio_soundcard = audio_pipe->lio_soundcard;
+    LioSoundCardFetchFrame(lio_soundcard);
+    int64_t capture_ns = EncoderStatsNow();
+    // audio is never dropped, its pts count samples so a gap would shift it against video
+    CaptureBuffer *buf = CaptureChannelAcquire(&audio_pipe->channel, count);
+    if (!buf)
+    {
+        return false;
+    }
+    memcpy(buf->data, lio_soundcard->rw_buf.rw_buffer, lio_soundcard->read_buffer_size);
+    buf->index = count;
+    buf->capture_ns = capture_ns;
+    FrameQueuePush(&audio_pipe->channel.queue, buf);
+    return true;
+}
+
+void audio_capture_end(AudioPipe *audio_pipe)
+{
+    FrameQueueClose(&audio_pipe->channel.queue);
+    LioSoundCardClose(audio_pipe->lio_soundcard);
+}
+
 void *audio_pthread(void *args)
 {
-    LioSoundCard *lio_soundcard = args;
-    FILE *fp = fopen("audio.pcm", "wb");
+    AudioPipe *audio_pipe = args;
     int sum = 44100 * TIME;
     int count = 0;
-    while (count < sum)
+    while (count < sum && audio_capture_period(audio_pipe, count))
     {
-        pthread_mutex_lock(&mutex);
-        LioSoundCardFetchFrame(lio_soundcard);
-        pthread_mutex_unlock(&mutex);
-        fwrite(lio_soundcard->rw_buf.rw_buffer, lio_soundcard->read_buffer_size, 1, fp);
-        count += 1024;
+        count += audio_pipe->lio_soundcard->read_buffer_size / AUDIO_FRAME_BYTES;
     }
-    LioSoundCardClose(lio_soundcard);
+    audio_capture_end(audio_pipe);
     return NULL;
 };
-int main(void)
+
+#define CAPTURE_LOOP_MAX_FDS 8
+#define CAPTURE_LOOP_CAMERA CAPTURE_LOOP_MAX_FDS // epoll tag of the camera, sound card fds are tagged with their pollfd index
+#define CAPTURE_LOOP_RETRY_MS 5                  // how often deferred audio looks for a free buffer again
+
+/*
+ * both devices on one thread: the v4l2 fd and the alsa poll descriptors sit
+ * in one epoll set, and a device is only read once it is ready, so neither
+ * read blocks and the encoder threads are the only busy ones. nothing waits
+ * for an encoder either: a camera frame without a free buffer is dropped,
+ * and when audio has none its period stays in the pcm and the loop retries
+ * later, the camera keeps being served meanwhile.
+ */
+typedef struct
+{
+    VideoPipe *video_pipe;
+    AudioPipe *audio_pipe;
+    int epoll_fd;
+    struct pollfd pfds[CAPTURE_LOOP_MAX_FDS];
+    int pfd_num;
+    snd_pcm_t *pcm;
+    snd_pcm_sframes_t period;
+    int64_t audio_count;    // samples handed to the encoder, silence included
+    int64_t audio_start_ns; // CLOCK_MONOTONIC of snd_pcm_start
+    int64_t silence_periods; // owed for samples an overrun lost
+    bool audio_done;
+    bool audio_deferred; // out of the epoll set until a buffer is free
+    int64_t wakeups;
+    int64_t xruns;
+    int64_t silence;
+} CaptureLoop;
+
+static bool capture_loop_add_audio(CaptureLoop *loop)
+{
+    for (int i = 0; i < loop->pfd_num; i++)
+    {
+        struct epoll_event event = {.events = loop->pfds[i].events, .data.u32 = i};
+        if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, loop->pfds[i].fd, &event) != 0)
+        {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void capture_loop_remove_audio(CaptureLoop *loop)
 {
+    for (int i = 0; i < loop->pfd_num; i++)
+    {
+        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, loop->pfds[i].fd, NULL);
+    }
+}
+
+bool CaptureLoopInit(CaptureLoop *loop, VideoPipe *video_pipe, AudioPipe *audio_pipe)
+{
+    memset(loop, 0, sizeof(CaptureLoop));
+    loop->video_pipe = video_pipe;
+    loop->audio_pipe = audio_pipe;
+    loop->pcm = LioSoundCardGetPcm(audio_pipe->lio_soundcard);
+    loop->period = audio_pipe->channel.buf_size / AUDIO_FRAME_BYTES;
+    loop->pfd_num = snd_pcm_poll_descriptors_count(loop->pcm);
+    if (loop->pfd_num <= 0 || loop->pfd_num > CAPTURE_LOOP_MAX_FDS || snd_pcm_poll_descriptors(loop->pcm, loop->pfds, loop->pfd_num) != loop->pfd_num)
+    {
+        printf("sound card has no usable poll descriptors\n");
+        return false;
+    }
+    loop->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+    if (loop->epoll_fd < 0)
+    {
+        perror("epoll_create1 failed");
+        return false;
+    }
+    struct epoll_event event = {.events = EPOLLIN, .data.u32 = CAPTURE_LOOP_CAMERA};
+    if (epoll_ctl(loop->epoll_fd, EPOLL_CTL_ADD, LioCameraGetFd(video_pipe->lio_camera), &event) != 0 || !capture_loop_add_audio(loop))
+    {
+        perror("epoll_ctl failed");
+        close(loop->epoll_fd);
+        return false;
+    }
+    return true;
+}
+
+/* reads one period once a buffer is free for it, false leaves it in the pcm */
+static bool capture_loop_read_period(CaptureLoop *loop)
+{
+    AudioPipe *audio_pipe = loop->audio_pipe;
+    CaptureBuffer *buf = CaptureChannelTryAcquire(&audio_pipe->channel, loop->audio_count);
+    if (!buf)
+    {
+        return false;
+    }
+    // avail covers a period, so this read doesn't block
+    LioSoundCardFetchFrame(audio_pipe->lio_soundcard);
+    buf->capture_ns = EncoderStatsNow();
+    memcpy(buf->data, audio_pipe->lio_soundcard->rw_buf.rw_buffer, audio_pipe->channel.buf_size);
+    buf->index = loop->audio_count;
+    FrameQueuePush(&audio_pipe->channel.queue, buf);
+    return true;
+}
+
+/* one period of silence in place of samples an overrun lost */
+static bool capture_loop_silence_period(CaptureLoop *loop)
+{
+    AudioPipe *audio_pipe = loop->audio_pipe;
+    CaptureBuffer *buf = CaptureChannelTryAcquire(&audio_pipe->channel, loop->audio_count);
+    if (!buf)
+    {
+        return false;
+    }
+    buf->capture_ns = EncoderStatsNow();
+    memset(buf->data, 0, audio_pipe->channel.buf_size);
+    buf->index = loop->audio_count;
+    FrameQueuePush(&audio_pipe->channel.queue, buf);
+    loop->silence++;
+    return true;
+}
+
+/* reads every period the pcm has ready, and defers audio when the encoder holds every buffer */
+static void capture_loop_audio(CaptureLoop *loop)
+{
+    bool blocked = false;
+    while (!loop->audio_done)
+    {
+        if (loop->silence_periods > 0)
+        {
+            // the silence goes out before anything read after the overrun
+            if (!capture_loop_silence_period(loop))
+            {
+                blocked = true;
+                break;
+            }
+            loop->silence_periods--;
+        }
+        else
+        {
+            snd_pcm_sframes_t avail = snd_pcm_avail_update(loop->pcm);
+            if (avail < 0)
+            {
+                // overrun: the encoder side was too slow to hand buffers back, restart the pcm
+                loop->xruns++;
+                if (snd_pcm_recover(loop->pcm, avail, 1) < 0 || snd_pcm_start(loop->pcm) < 0)
+                {
+                    printf("sound card recover failed\n");
+                    loop->audio_done = true;
+                    break;
+                }
+                // the pcm dropped what it held, the clock says how much: fill that with silence so aac pts keep pace with video
+                int64_t expected = (EncoderStatsNow() - loop->audio_start_ns) * 44100 / 1000000000;
+                int64_t lost = (expected - loop->audio_count + loop->period / 2) / loop->period;
+                loop->silence_periods = lost > 0 ? lost : 0;
+                continue;
+            }
+            if (avail < loop->period)
+            {
+                break;
+            }
+            if (!capture_loop_read_period(loop))
+            {
+                blocked = true;
+                break;
+            }
+        }
+        loop->audio_count += loop->period;
+        loop->audio_done = loop->audio_count >= 44100 * TIME;
+    }
+    bool listening = !loop->audio_deferred;
+    loop->audio_deferred = blocked;
+    if (listening && (blocked || loop->audio_done))
+    {
+        // a level triggered pcm would wake the loop over and over while nothing can be read
+        capture_loop_remove_audio(loop);
+        loop->audio_pipe->channel.waits += blocked;
+    }
+    else if (!listening && !blocked && !loop->audio_done && !capture_loop_add_audio(loop))
+    {
+        perror("epoll_ctl failed");
+        loop->audio_done = true;
+    }
+}
+
+void *capture_loop_pthread(void *args)
+{
+    CaptureLoop *loop = args;
+    VideoPipe *video_pipe = loop->video_pipe;
+    int64_t video_count = 0;
+    bool video_done = false;
+    struct epoll_event events[CAPTURE_LOOP_MAX_FDS + 1];
+
+    LioCameraStartStream(video_pipe->lio_camera);
+    // a capture pcm only starts by itself on the first read, and nothing reads before poll says so
+    snd_pcm_start(loop->pcm);
+    loop->audio_start_ns = EncoderStatsNow();
+    while (!video_done || !loop->audio_done)
+    {
+        int n = epoll_wait(loop->epoll_fd, events, CAPTURE_LOOP_MAX_FDS + 1, loop->audio_deferred ? CAPTURE_LOOP_RETRY_MS : 1000);
+        if (n < 0 && errno == EINTR)
+        {
+            continue; // SIGUSR1
+        }
+        if (n < 0)
+        {
+            perror("epoll_wait failed");
+            break;
+        }
+        if (n == 0 && !loop->audio_deferred)
+        {
+            printf("capture: no device ready for 1s\n");
+            continue;
+        }
+        loop->wakeups += n > 0;
+        bool audio_event = false;
+        for (int i = 0; i < loop->pfd_num; i++)
+        {
+            loop->pfds[i].revents = 0;
+        }
+        for (int i = 0; i < n; i++)
+        {
+            if (events[i].data.u32 == CAPTURE_LOOP_CAMERA)
+            {
+                if (!video_done)
+                {
+                    // the loop also serves the sound card, it must not wait for the video encoder
+                    camera_capture_frame(video_pipe, video_count++, false);
+                    if (video_count >= TIME * 10)
+                    {
+                        video_done = true;
+                        epoll_ctl(loop->epoll_fd, EPOLL_CTL_DEL, LioCameraGetFd(video_pipe->lio_camera), NULL);
+                    }
+                }
+            }
+            else
+            {
+                loop->pfds[events[i].data.u32].revents = events[i].events;
+                audio_event = true;
+            }
+        }
+        if (loop->audio_done)
+        {
+            continue;
+        }
+        if (!loop->audio_deferred)
+        {
+            if (!audio_event)
+            {
+                continue;
+            }
+            // alsa may use several descriptors that only together mean "readable"
+            unsigned short revents = 0;
+            snd_pcm_poll_descriptors_revents(loop->pcm, loop->pfds, loop->pfd_num, &revents);
+            if (!(revents & (POLLIN | POLLERR)))
+            {
+                continue;
+            }
+        }
+        capture_loop_audio(loop);
+    }
+    camera_capture_end(video_pipe);
+    audio_capture_end(loop->audio_pipe);
+    printf("capture loop: %ld wakeups for %ld video frames and %ld audio samples, %ld xruns, %ld silent periods\n", loop->wakeups, video_count,
+           loop->audio_count, loop->xruns, loop->silence);
+    return NULL;
+}
+
+void CaptureLoopDestroy(CaptureLoop *loop)
+{
+    if (loop->epoll_fd >= 0)
+    {
+        close(loop->epoll_fd);
+        loop->epoll_fd = -1;
+    }
+}
+
+void h264_mux_packets(VideoPipe *video_pipe)
+{
+    while (H264EnCoderEncode(&video_pipe->h264_encoder) > 0)
+    {
+        Mp4MuxerSendPacket(video_pipe->muxer, MP4_MUXER_VIDEO, video_pipe->h264_encoder.pkt);
+    }
+}
+
+void *video_encode_pthread(void *args)
+{
+    VideoPipe *video_pipe = args;
+    H264EnCoder *h264_encoder = &video_pipe->h264_encoder;
+    CaptureBuffer *buf;
+    uint8_t *data[4];
+    int linesize[4];
+    while ((buf = FrameQueuePop(&video_pipe->channel.queue)) != NULL)
+    {
+        CaptureChannelLatency(&video_pipe->channel, buf);
+        video_buffer_planes(video_pipe, buf, data, linesize);
+        if (video_pipe->raw_fp)
+        {
+            // rows are padded in the buffer, the dump is plain yuv420p
+            for (int i = 0; i < 3; i++)
+            {
+                int plane_w = i ? video_pipe->width / 2 : video_pipe->width;
+                int plane_h = i ? video_pipe->height / 2 : video_pipe->height;
+                for (int y = 0; y < plane_h; y++)
+                {
+                    fwrite(data[i] + y * linesize[i], 1, plane_w, video_pipe->raw_fp);
+                }
+            }
+        }
+        if (buf->index % 10 == 0)
+        {
+            CaptureChannelReport(&video_pipe->channel, "video");
+        }
+        if (video_pipe->detector && StaticDetectorSkip(video_pipe->detector, data, linesize))
+        {
+            // no pts is spent, the previous frame lasts until the next encoded one
+            CaptureChannelRelease(&video_pipe->channel, buf);
+            continue;
+        }
+        // the converted buffer goes to x264 as is, the pool gets it back when x264's reference is dropped
+        double encode_start = video_pipe->governor ? H264GovernorNow() : 0;
+        h264_encoder->frame->pts = buf->index;
+        if (video_pipe->channel.drop_policy == CAPTURE_DROP_NON_REFERENCE && buf->index % video_pipe->channel.gop_size == 0)
+        {
+            // the gop starts are counted on capture indexes, x264 only makes the idrs asked for here
+            H264EnCoderRequestKeyFrame(h264_encoder);
+        }
+        // the reference is handed over, so the descriptor can go back to capture right away
+        bool fetched = H264EnCoderFetchBuffer(h264_encoder, buf->ref, data, linesize);
+        buf->ref = NULL;
+        int64_t index = buf->index;
+        CaptureChannelRelease(&video_pipe->channel, buf);
+        if (!fetched)
+        {
+            printf("fetch error!\n");
+            break;
+        }
+        h264_mux_packets(video_pipe);
+        if (video_pipe->governor)
+        {
+            H264GovernorFrame(video_pipe->governor, index, H264GovernorNow() - encode_start);
+        }
+    }
+    H264EnCoderFlush(h264_encoder);
+    h264_mux_packets(video_pipe);
+    Mp4MuxerClose(video_pipe->muxer, MP4_MUXER_VIDEO);
+    return NULL;
+}
+
+void aac_mux_packets(AudioPipe *audio_pipe)
+{
+    while (AACEnCoderEnCode(&audio_pipe->aac_encoder) > 0)
+    {
+        Mp4MuxerSendPacket(audio_pipe->muxer, MP4_MUXER_AUDIO, audio_pipe->aac_encoder.pkt);
+    }
+}
+
+void *audio_encode_pthread(void *args)
+{
+    AudioPipe *audio_pipe = args;
+    AACEnCoder *aac_encoder = &audio_pipe->aac_encoder;
+    CaptureBuffer *buf;
+    while ((buf = FrameQueuePop(&audio_pipe->channel.queue)) != NULL)
+    {
+        CaptureChannelLatency(&audio_pipe->channel, buf);
+        if (audio_pipe->raw_fp)
+        {
+            fwrite(buf->data, audio_pipe->channel.buf_size, 1, audio_pipe->raw_fp);
+        }
+        if (buf->index % 44100 < (int64_t)(audio_pipe->channel.buf_size / AUDIO_FRAME_BYTES))
+        {
+            CaptureChannelReport(&audio_pipe->channel, "audio");
+        }
+        // s16 interleaved is converted to fltp on its way into the encoder fifo,
+        // the period size doesn't have to match the aac frame size
+        bool fetched = AACEnCoderFetchSamples(aac_encoder, buf->data, audio_pipe->channel.buf_size / AUDIO_FRAME_BYTES);
+        CaptureChannelRelease(&audio_pipe->channel, buf);
+        if (!fetched)
+        {
+            break;
+        }
+        aac_mux_packets(audio_pipe);
+    }
+    AACEncoderFlush(aac_encoder);
+    aac_mux_packets(audio_pipe);
+    Mp4MuxerClose(audio_pipe->muxer, MP4_MUXER_AUDIO);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    bool dump_raw = false;
+    bool stats = false;
+    CaptureDropPolicy drop_policy = CAPTURE_DROP_OLDEST;
+    double cpu_budget = 0;
+    double static_threshold = 0;
+    bool use_sink = false;
+    bool event_loop = false;
+    OutputSinkOption sink_option;
+    OutputSinkOptionDefault(&sink_option);
+    for (int i = 1; i < argc; i++)
+    {
+        dump_raw = dump_raw || strcmp(argv[i], "--dump-raw") == 0;
+        stats = stats || strcmp(argv[i], "--stats") == 0;
+        event_loop = event_loop || strcmp(argv[i], "--event-loop") == 0;
+        if (strcmp(argv[i], "--uring") == 0)
+        {
+            use_sink = true;
+            sink_option.backend = OUTPUT_SINK_URING;
+        }
+        if (strcmp(argv[i], "--direct") == 0)
+        {
+            use_sink = true;
+            sink_option.direct = true;
+            // 10 秒 400k 视频 + 128k 音频, 多留一些
+            sink_option.prealloc = 4 * 1024 * 1024;
+        }
+        if (strcmp(argv[i], "--drop") == 0 && i + 1 < argc)
+        {
+            i++;
+            drop_policy = strcmp(argv[i], "none") == 0 ? CAPTURE_DROP_NONE : strcmp(argv[i], "non-ref") == 0 ? CAPTURE_DROP_NON_REFERENCE : CAPTURE_DROP_OLDEST;
+        }
+        if (strcmp(argv[i], "--governor") == 0 && i + 1 < argc)
+        {
+            cpu_budget = atof(argv[++i]);
+        }
+        if (strcmp(argv[i], "--skip-static") == 0 && i + 1 < argc)
+        {
+            static_threshold = atof(argv[++i]);
+        }
+    }
+
+    if (event_loop && drop_policy == CAPTURE_DROP_NONE)
+    {
+        printf("--event-loop can't wait for the video encoder, use --drop oldest or non-ref\n");
+        return -1;
+    }
 
     LioCamera lio_camera;
     LioSoundCard lio_soundcard;
@@ -61,14 +816,128 @@ int main(void)
 
     LioSoundCardInit(&lio_soundcard, SND_PCM_STREAM_CAPTURE, 44100, 1024, SND_PCM_ACCESS_RW_INTERLEAVED, SND_PCM_FORMAT_S16_LE, 2);
 
-    pthread_t pthread_camera, pthread_audio;
-    pthread_create(&pthread_camera, NULL, camera_pthread, &lio_camera);
-    pthread_create(&pthread_audio, NULL, audio_pthread, &lio_soundcard);
-    // pthread_detach(pthread_camera);
-    // pthread_detach(pthread_audio);
-    pthread_join(pthread_camera, NULL);
-    pthread_join(pthread_audio, NULL);
+    VideoPipe video_pipe = {.lio_camera = &lio_camera};
+    video_pipe.width = lio_camera.fmt.fmt.pix.width;
+    video_pipe.height = lio_camera.fmt.fmt.pix.height;
+    AudioPipe audio_pipe = {.lio_soundcard = &lio_soundcard};
+    if (dump_raw)
+    {
+        video_pipe.raw_fp = fopen("video.yuv", "wb");
+        audio_pipe.raw_fp = fopen("audio.pcm", "wb");
+        if (!video_pipe.raw_fp || !audio_pipe.raw_fp)
+        {
+            perror("open video.yuv/audio.pcm failed, not dumping raw data");
+            if (video_pipe.raw_fp)
+            {
+                fclose(video_pipe.raw_fp);
+            }
+            if (audio_pipe.raw_fp)
+            {
+                fclose(audio_pipe.raw_fp);
+            }
+            video_pipe.raw_fp = NULL;
+            audio_pipe.raw_fp = NULL;
+            dump_raw = false;
+        }
+    }
+    if (!CaptureChannelInit(&video_pipe.channel, VIDEO_BUF_NUM, FramePoolImageSize(AV_PIX_FMT_YUV420P, video_pipe.width, video_pipe.height), true) ||
+        !CaptureChannelInit(&audio_pipe.channel, AUDIO_BUF_NUM, lio_soundcard.read_buffer_size, false))
+    {
+        return -1;
+    }
+
+    H264EnCoderOption h264_option;
+    H264EnCoderOptionDefault(&h264_option);
+    // non-ref 按采集序号每 gop_size 帧请求 IDR, 丢帧后 x264 自己的 keyint 计数会对不上, 只留请求的 IDR
+    h264_option.requested_idr_only = drop_policy == CAPTURE_DROP_NON_REFERENCE;
+    H264EnCoderInitWithOption(&video_pipe.h264_encoder, 400 * 1024, video_pipe.width, video_pipe.height, (AVRational){10, 1}, FF_PROFILE_H264_HIGH,
+                              AV_PIX_FMT_YUV420P, &h264_option);
+    // 只有视频会丢帧, 音频等空闲缓冲: 线程模式阻塞, epoll 模式留在声卡里稍后再读
+    video_pipe.channel.drop_policy = drop_policy;
+    video_pipe.channel.gop_size = video_pipe.h264_encoder.codec_ctx->gop_size;
+    H264Governor governor;
+    if (cpu_budget > 0)
+    {
+        H264GovernorInit(&governor, &video_pipe.h264_encoder, cpu_budget, stdout);
+        video_pipe.governor = &governor;
+    }
+    StaticDetector detector;
+    if (static_threshold > 0)
+    {
+        if (!StaticDetectorInit(&detector, video_pipe.width, video_pipe.height, static_threshold, 10))
+        {
+            return -1;
+        }
+        video_pipe.detector = &detector;
+    }
+    AACEnCoderInit(&audio_pipe.aac_encoder, 128 * 1024, AV_CH_LAYOUT_STEREO, 44100, FF_PROFILE_AAC_LOW, AV_SAMPLE_FMT_FLTP);
+    AACEnCoderSetInputFormat(&audio_pipe.aac_encoder, AV_SAMPLE_FMT_S16);
+    if (stats)
+    {
+        H264EnCoderEnableStats(&video_pipe.h264_encoder, stderr, 1000);
+        AACEnCoderEnableStats(&audio_pipe.aac_encoder, stderr, 1000);
+    }
+    key_frame_encoder = &video_pipe.h264_encoder;
+    signal(SIGUSR1, key_frame_signal);
+    Mp4Muxer muxer;
+    if (!Mp4MuxerInitWithSink(&muxer, "output.mp4", video_pipe.h264_encoder.codec_ctx, audio_pipe.aac_encoder.codec_ctx,
+                              H264EnCoderDelay(&video_pipe.h264_encoder), use_sink ? &sink_option : NULL))
+    {
+        return -1;
+    }
+    video_pipe.muxer = &muxer;
+    audio_pipe.muxer = &muxer;
+
+    pthread_t pthread_camera, pthread_audio, pthread_video_encode, pthread_audio_encode, pthread_muxer;
+    pthread_create(&pthread_muxer, NULL, Mp4MuxerThread, &muxer);
+    pthread_create(&pthread_video_encode, NULL, video_encode_pthread, &video_pipe);
+    pthread_create(&pthread_audio_encode, NULL, audio_encode_pthread, &audio_pipe);
+    CaptureLoop capture_loop;
+    // 单线程 epoll 采集, 声卡拿不到 poll 描述符时退回每个设备一个线程
+    event_loop = event_loop && CaptureLoopInit(&capture_loop, &video_pipe, &audio_pipe);
+    if (event_loop)
+    {
+        pthread_create(&pthread_camera, NULL, capture_loop_pthread, &capture_loop);
+        pthread_join(pthread_camera, NULL);
+        CaptureLoopDestroy(&capture_loop);
+    }
+    else
+    {
+        pthread_create(&pthread_camera, NULL, camera_pthread, &video_pipe);
+        pthread_create(&pthread_audio, NULL, audio_pthread, &audio_pipe);
+        // pthread_detach(pthread_camera);
+        // pthread_detach(pthread_audio);
+        pthread_join(pthread_camera, NULL);
+        pthread_join(pthread_audio, NULL);
+    }
+    pthread_join(pthread_video_encode, NULL);
+    pthread_join(pthread_audio_encode, NULL);
+    pthread_join(pthread_muxer, NULL);
+    if (stats)
+    {
+        EncoderStatsWriteJson(&video_pipe.h264_encoder.stats, stderr);
+        EncoderStatsWriteJson(&audio_pipe.aac_encoder.stats, stderr);
+    }
+    Mp4MuxerDestroy(&muxer);
+    H264EnCoderDestroy(&video_pipe.h264_encoder);
+    AACEncoderDestroy(&audio_pipe.aac_encoder);
+    CaptureChannelReport(&video_pipe.channel, "video");
+    CaptureChannelReport(&audio_pipe.channel, "audio");
+    FramePoolReport(&video_pipe.channel.pool, "video");
+    FramePoolReport(&audio_pipe.channel.pool, "audio");
+    if (video_pipe.detector)
+    {
+        StaticDetectorReport(&detector, "video");
+        StaticDetectorDestroy(&detector);
+    }
+    CaptureChannelDestroy(&video_pipe.channel);
+    CaptureChannelDestroy(&audio_pipe.channel);
+    if (dump_raw)
+    {
+        fclose(video_pipe.raw_fp);
+        fclose(audio_pipe.raw_fp);
+    }
     return 0;
     // pthread_exit(NULL);
     //  return 0;
-}
\ No newline at end of file
+}
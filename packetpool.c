@@ -0,0 +1,112 @@
+#include "packetpool.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+bool PacketPoolInit(PacketPool *pool, int capacity, bool grow)
+{
+    memset(pool, 0, sizeof(PacketPool));
+    pool->packets = calloc(capacity, sizeof(AVPacket *));
+    if (!pool->packets)
+    {
+        perror("packet pool alloc failed");
+        return false;
+    }
+    pool->capacity = capacity;
+    pool->grow = grow;
+    pthread_mutex_init(&pool->lock, NULL);
+    for (int i = 0; i < capacity; i++)
+    {
+        pool->packets[i] = av_packet_alloc();
+        if (!pool->packets[i])
+        {
+            perror("packet pool alloc failed");
+            PacketPoolDestroy(pool);
+            return false;
+        }
+        pool->free_num++;
+    }
+    return true;
+}
+
+/* src is left blank. NULL when the pool is empty and may not grow */
+AVPacket *PacketPoolTake(PacketPool *pool, AVPacket *src)
+{
+    AVPacket *pkt = NULL;
+    pthread_mutex_lock(&pool->lock);
+    pool->takes++;
+    if (pool->free_num > 0)
+    {
+        pkt = pool->packets[--pool->free_num];
+    }
+    else
+    {
+        pool->exhausted++;
+    }
+    pthread_mutex_unlock(&pool->lock);
+
+    if (!pkt && pool->grow)
+    {
+        pkt = av_packet_alloc();
+        if (pkt)
+        {
+            pthread_mutex_lock(&pool->lock);
+            pool->allocs++;
+            pthread_mutex_unlock(&pool->lock);
+        }
+    }
+    if (!pkt)
+    {
+        return NULL;
+    }
+    av_packet_move_ref(pkt, src);
+    pthread_mutex_lock(&pool->lock);
+    pool->in_use++;
+    pool->max_in_use = pool->in_use > pool->max_in_use ? pool->in_use : pool->max_in_use;
+    pthread_mutex_unlock(&pool->lock);
+    return pkt;
+}
+
+/* drops the payload reference and puts the packet back, extra packets from growing are freed */
+void PacketPoolRelease(PacketPool *pool, AVPacket *pkt)
+{
+    if (!pkt)
+    {
+        return;
+    }
+    av_packet_unref(pkt);
+    pthread_mutex_lock(&pool->lock);
+    pool->in_use--;
+    if (pool->free_num < pool->capacity)
+    {
+        pool->packets[pool->free_num++] = pkt;
+        pkt = NULL;
+    }
+    pthread_mutex_unlock(&pool->lock);
+    av_packet_free(&pkt);
+}
+
+void PacketPoolReport(PacketPool *pool, const char *name)
+{
+    pthread_mutex_lock(&pool->lock);
+    printf("%s packet pool: %d packets, %ld takes, at most %d in use, exhausted %ld times, %ld extra allocations\n", name, pool->capacity, pool->takes,
+           pool->max_in_use, pool->exhausted, pool->allocs);
+    pthread_mutex_unlock(&pool->lock);
+}
+
+/* packets still held by a consumer are not freed here, release them first */
+void PacketPoolDestroy(PacketPool *pool)
+{
+    if (!pool->packets)
+    {
+        return;
+    }
+    for (int i = 0; i < pool->free_num; i++)
+    {
+        av_packet_free(&pool->packets[i]);
+    }
+    free(pool->packets);
+    pool->packets = NULL;
+    pool->free_num = 0;
+    pthread_mutex_destroy(&pool->lock);
+}
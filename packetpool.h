@@ -0,0 +1,37 @@
+#ifndef _PACKETPOOL_H
+#define _PACKETPOOL_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+
+/*
+ * preallocated AVPackets for handing encoded data to another thread.
+ * PacketPoolTake moves the encoder's packet into a pooled one with
+ * av_packet_move_ref, so the payload is never copied and the encoder's own
+ * pkt is blank again for the next receive. whoever holds the packet gives it
+ * back with PacketPoolRelease, from any thread.
+ * when every packet is out the pool either allocates one more (grow) or
+ * returns NULL; both count as exhaustion, which means capacity is too small.
+ */
+typedef struct
+{
+    AVPacket **packets; // free stack
+    int capacity;
+    int free_num;
+    bool grow;
+    pthread_mutex_t lock;
+    int64_t takes;
+    int64_t exhausted; // takes that found the pool empty
+    int64_t allocs;    // packets allocated after init because of that
+    int in_use;
+    int max_in_use;
+} PacketPool;
+
+bool PacketPoolInit(PacketPool *pool, int capacity, bool grow);
+AVPacket *PacketPoolTake(PacketPool *pool, AVPacket *src);
+void PacketPoolRelease(PacketPool *pool, AVPacket *pkt);
+void PacketPoolReport(PacketPool *pool, const char *name);
+void PacketPoolDestroy(PacketPool *pool);
+#endif
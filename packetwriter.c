@@ -0,0 +1,272 @@
+#define _GNU_SOURCE
+#include "packetwriter.h"
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+static int64_t packet_writer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/* hands the whole batch to the sink and drops the references */
+static bool packet_batch_write(PacketWriter *writer, PacketBatch *batch)
+{
+    struct iovec iov[PACKET_WRITER_SLOTS * 2];
+    int iov_num = 0;
+    for (int i = 0; i < batch->count; i++)
+    {
+        if (batch->header_sizes[i] > 0)
+        {
+            iov[iov_num++] = (struct iovec){batch->headers[i], batch->header_sizes[i]};
+        }
+        iov[iov_num++] = (struct iovec){batch->pkts[i]->data, batch->pkts[i]->size};
+    }
+    // the sink may stage bytes, flushing it keeps the age threshold meaningful for the file
+    bool ok = OutputSinkWritev(&writer->sink, iov, iov_num) && OutputSinkFlush(&writer->sink);
+    writer->batches_written++;
+    for (int i = 0; i < batch->count; i++)
+    {
+        av_packet_unref(batch->pkts[i]);
+    }
+    batch->count = 0;
+    batch->bytes = 0;
+    return ok;
+}
+
+static void *packet_writer_thread(void *args)
+{
+    PacketWriter *writer = args;
+    pthread_mutex_lock(&writer->mutex);
+    while (true)
+    {
+        while (!writer->pending && !writer->stop)
+        {
+            pthread_cond_wait(&writer->cond, &writer->mutex);
+        }
+        if (!writer->pending)
+        {
+            break;
+        }
+        PacketBatch *batch = writer->pending;
+        pthread_mutex_unlock(&writer->mutex);
+        bool ok = packet_batch_write(writer, batch);
+        pthread_mutex_lock(&writer->mutex);
+        writer->error = writer->error || !ok;
+        writer->pending = NULL;
+        pthread_cond_broadcast(&writer->cond);
+    }
+    pthread_mutex_unlock(&writer->mutex);
+    return NULL;
+}
+
+/* what stdio hands to the kernel, counted on the sink so the report reads the same for every mode */
+static ssize_t packet_writer_stdio_write(void *cookie, const char *buf, size_t size)
+{
+    OutputSink *sink = cookie;
+    ssize_t ret = write(sink->fd, buf, size);
+    sink->syscalls++;
+    if (ret > 0)
+    {
+        sink->bytes += ret;
+        sink->writes++;
+    }
+    return ret;
+}
+
+/* opened on the sink's fd, PacketWriterClose closes it */
+bool PacketWriterOpenStdio(PacketWriter *writer, const char *path)
+{
+    memset(writer, 0, sizeof(PacketWriter));
+    if (!OutputSinkOpen(&writer->sink, path, NULL))
+    {
+        return false;
+    }
+    writer->opened = true;
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    cookie_io_functions_t funcs = {.write = packet_writer_stdio_write};
+    writer->unbatched = true;
+    writer->stdio = fopencookie(&writer->sink, "w", funcs);
+    if (!writer->stdio)
+    {
+        perror("packet writer stdio open failed");
+        PacketWriterClose(writer);
+        return false;
+    }
+    // the buffer fopen would pick for this file, a cookie stream alone gets BUFSIZ
+    struct stat st;
+    if (fstat(writer->sink.fd, &st) == 0 && st.st_blksize > 0)
+    {
+        setvbuf(writer->stdio, NULL, _IOFBF, st.st_blksize);
+    }
+    writer->start_ns = packet_writer_now();
+    return true;
+}
+
+bool PacketWriterOpen(PacketWriter *writer, const char *path, size_t flush_bytes, int flush_ms, bool threaded, const OutputSinkOption *sink_option)
+{
+    memset(writer, 0, sizeof(PacketWriter));
+    if (!OutputSinkOpen(&writer->sink, path, sink_option))
+    {
+        return false;
+    }
+    writer->opened = true;
+    pthread_mutex_init(&writer->mutex, NULL);
+    pthread_cond_init(&writer->cond, NULL);
+    for (int i = 0; i < 2; i++)
+    {
+        for (int j = 0; j < PACKET_WRITER_SLOTS; j++)
+        {
+            writer->batches[i].pkts[j] = av_packet_alloc();
+            if (!writer->batches[i].pkts[j])
+            {
+                perror("packet writer alloc failed");
+                PacketWriterClose(writer);
+                return false;
+            }
+        }
+    }
+    writer->flush_bytes = flush_bytes;
+    writer->flush_ns = (int64_t)flush_ms * 1000000;
+    writer->start_ns = packet_writer_now();
+    if (threaded && pthread_create(&writer->thread, NULL, packet_writer_thread, writer) == 0)
+    {
+        writer->threaded = true;
+    }
+    return true;
+}
+
+/* sends the active batch out, on the writer thread once the previous batch is done */
+bool PacketWriterFlush(PacketWriter *writer)
+{
+    if (writer->stdio)
+    {
+        writer->error = fflush(writer->stdio) != 0 || writer->error;
+        return !writer->error;
+    }
+    PacketBatch *batch = &writer->batches[writer->active];
+    if (batch->count == 0)
+    {
+        return !writer->error;
+    }
+    if (!writer->threaded)
+    {
+        writer->error = !packet_batch_write(writer, batch) || writer->error;
+        return !writer->error;
+    }
+    pthread_mutex_lock(&writer->mutex);
+    while (writer->pending)
+    {
+        pthread_cond_wait(&writer->cond, &writer->mutex);
+    }
+    writer->pending = batch;
+    pthread_cond_broadcast(&writer->cond);
+    bool ok = !writer->error;
+    pthread_mutex_unlock(&writer->mutex);
+    writer->active ^= 1;
+    return ok;
+}
+
+bool PacketWriterWrite(PacketWriter *writer, const AVPacket *pkt, const uint8_t *header, int header_size)
+{
+    if (header_size < 0 || header_size > PACKET_WRITER_HEADER_MAX)
+    {
+        return false;
+    }
+    if (writer->stdio)
+    {
+        if ((header_size > 0 && fwrite(header, 1, header_size, writer->stdio) != (size_t)header_size) ||
+            fwrite(pkt->data, 1, pkt->size, writer->stdio) != (size_t)pkt->size)
+        {
+            writer->error = true;
+        }
+        writer->packets++;
+        writer->bytes += header_size + pkt->size;
+        return !writer->error;
+    }
+    PacketBatch *batch = &writer->batches[writer->active];
+    int i = batch->count;
+    // a refcounted packet just gains a reference, the encoder may reuse its AVPacket right away
+    if (av_packet_ref(batch->pkts[i], pkt) < 0)
+    {
+        perror("packet writer ref failed");
+        return false;
+    }
+    if (header_size > 0)
+    {
+        memcpy(batch->headers[i], header, header_size);
+    }
+    batch->header_sizes[i] = header_size;
+    int64_t now = packet_writer_now();
+    if (batch->count++ == 0)
+    {
+        batch->first_ns = now;
+    }
+    batch->bytes += header_size + pkt->size;
+    writer->packets++;
+    writer->bytes += header_size + pkt->size;
+    if (batch->count == PACKET_WRITER_SLOTS || batch->bytes >= writer->flush_bytes || now - batch->first_ns >= writer->flush_ns)
+    {
+        return PacketWriterFlush(writer);
+    }
+    return !writer->error;
+}
+
+/* flushes what is left and closes the file, the counters stay for PacketWriterReport */
+bool PacketWriterClose(PacketWriter *writer)
+{
+    bool ok = true;
+    if (writer->stdio)
+    {
+        ok = fclose(writer->stdio) == 0 && !writer->error;
+        writer->stdio = NULL;
+    }
+    else if (writer->opened)
+    {
+        ok = PacketWriterFlush(writer);
+    }
+    if (writer->threaded && !writer->stop)
+    {
+        pthread_mutex_lock(&writer->mutex);
+        writer->stop = true;
+        pthread_cond_broadcast(&writer->cond);
+        pthread_mutex_unlock(&writer->mutex);
+        pthread_join(writer->thread, NULL);
+        ok = ok && !writer->error;
+    }
+    for (int i = 0; i < 2; i++)
+    {
+        for (int j = 0; j < PACKET_WRITER_SLOTS; j++)
+        {
+            av_packet_free(&writer->batches[i].pkts[j]);
+        }
+    }
+    if (writer->opened)
+    {
+        ok = OutputSinkClose(&writer->sink) && ok;
+        writer->opened = false;
+        pthread_mutex_destroy(&writer->mutex);
+        pthread_cond_destroy(&writer->cond);
+    }
+    writer->end_ns = packet_writer_now();
+    return ok;
+}
+
+/* after PacketWriterClose: the last batch is written and the writer thread no longer touches the counters */
+void PacketWriterReport(PacketWriter *writer, const char *name)
+{
+    double elapsed = (writer->end_ns - writer->start_ns) / 1e9;
+    if (elapsed <= 0)
+    {
+        elapsed = 1e-9;
+    }
+    printf("%s writer: %s, %ld packets %ld bytes, %ld batches, %ld syscalls (%.1f/s)\n", name,
+           writer->unbatched ? "fwrite per packet" : writer->threaded ? "writev batches, writer thread" : "writev batches",
+           writer->packets, writer->bytes, writer->batches_written, writer->sink.syscalls, writer->sink.syscalls / elapsed);
+    OutputSinkReport(&writer->sink, name);
+}
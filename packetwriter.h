@@ -0,0 +1,69 @@
+#ifndef _PACKETWRITER_H
+#define _PACKETWRITER_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <pthread.h>
+#include <libavcodec/avcodec.h>
+#include "outputsink.h"
+
+#define PACKET_WRITER_SLOTS 256    // packets per batch, two iovecs each stays well under IOV_MAX
+#define PACKET_WRITER_HEADER_MAX 16 // adts is 7 bytes, 9 with crc
+
+typedef struct
+{
+    AVPacket *pkts[PACKET_WRITER_SLOTS]; // references, the payload is never copied
+    uint8_t headers[PACKET_WRITER_SLOTS][PACKET_WRITER_HEADER_MAX];
+    int header_sizes[PACKET_WRITER_SLOTS];
+    int count;
+    size_t bytes;
+    int64_t first_ns; // when the oldest packet in the batch arrived
+} PacketBatch;
+
+/*
+ * appends encoded packets to a file, an optional per packet header (adts)
+ * in front of each. packets are referenced, not copied, and go out as one
+ * writev of header/payload pairs once flush_bytes are pending, the oldest
+ * packet is flush_ms old or the batch is full.
+ * threaded: the writev runs on a writer thread while the caller fills the
+ * other batch, a slow disk then only stalls the encoder when both are full.
+ * the batches go to an OutputSink, blocking writev unless sink_option asks
+ * for io_uring or O_DIRECT.
+ * PacketWriterOpenStdio is the unbatched baseline instead: one fwrite per
+ * header and payload on a stdio stream whose write(2) calls are counted, so
+ * the report compares real syscall numbers.
+ */
+typedef struct
+{
+    OutputSink sink;
+    bool opened;
+    size_t flush_bytes;
+    int64_t flush_ns;
+    bool threaded;
+    PacketBatch batches[2];
+    int active;
+    _Atomic bool error; // also set by the writer thread
+    bool unbatched; // PacketWriterOpenStdio
+    FILE *stdio;    // open until PacketWriterClose
+
+    pthread_t thread;
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    PacketBatch *pending; // handed to the writer thread, NULL once written
+    bool stop;
+
+    int64_t packets;
+    int64_t bytes;
+    int64_t batches_written;
+    int64_t start_ns;
+    int64_t end_ns; // set by PacketWriterClose
+} PacketWriter;
+
+bool PacketWriterOpen(PacketWriter *writer, const char *path, size_t flush_bytes, int flush_ms, bool threaded, const OutputSinkOption *sink_option);
+bool PacketWriterOpenStdio(PacketWriter *writer, const char *path);
+bool PacketWriterWrite(PacketWriter *writer, const AVPacket *pkt, const uint8_t *header, int header_size);
+bool PacketWriterFlush(PacketWriter *writer);
+bool PacketWriterClose(PacketWriter *writer);
+void PacketWriterReport(PacketWriter *writer, const char *name);
+#endif
@@ -0,0 +1,253 @@
+#include "rendition.h"
+#include <string.h>
+#include <time.h>
+
+static double rendition_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+bool RenditionSetInit(RenditionSet *set, AVRational framerate, bool live)
+{
+    memset(set, 0, sizeof(RenditionSet));
+    set->framerate = framerate;
+    set->live = live;
+    return true;
+}
+
+/* the encoder runs at the source rate divided by fps_divisor, pts follow */
+bool RenditionSetAdd(RenditionSet *set, int width, int height, int64_t bit_rate, int fps_divisor, const char *path)
+{
+    if (set->rendition_num == RENDITION_MAX)
+    {
+        printf("too many renditions\n");
+        return false;
+    }
+    Rendition *rendition = &set->renditions[set->rendition_num];
+    rendition->width = width;
+    rendition->height = height;
+    rendition->bit_rate = bit_rate;
+    rendition->fps_divisor = fps_divisor > 0 ? fps_divisor : 1;
+    rendition->fp = fopen(path, "wb");
+    if (!rendition->fp)
+    {
+        perror("open rendition output failed");
+        return false;
+    }
+    if (!FrameQueueInit(&rendition->queue, RENDITION_QUEUE_SIZE))
+    {
+        fclose(rendition->fp);
+        return false;
+    }
+    AVRational framerate = {set->framerate.num, set->framerate.den * rendition->fps_divisor};
+    H264EnCoderInit(&rendition->h264_encoder, bit_rate, width, height, framerate, FF_PROFILE_H264_HIGH, AV_PIX_FMT_YUV420P);
+    set->rendition_num++;
+    return true;
+}
+
+static void rendition_drain(Rendition *rendition)
+{
+    while (H264EnCoderEncode(&rendition->h264_encoder) > 0)
+    {
+        fwrite(rendition->h264_encoder.pkt->data, 1, rendition->h264_encoder.pkt->size, rendition->fp);
+        rendition->bytes += rendition->h264_encoder.pkt->size;
+    }
+}
+
+static bool rendition_encode(Rendition *rendition, AVFrame *src)
+{
+    H264EnCoder *h264_encoder = &rendition->h264_encoder;
+    int64_t pts = src->pts / rendition->fps_divisor;
+    if (src->width == rendition->width && src->height == rendition->height && src->format == AV_PIX_FMT_YUV420P)
+    {
+        // same size: the source planes go to x264 without a copy. x264 has
+        // copied them before send returns and src is unref'd after that, so
+        // one reference is enough even if the planes live in several buffers
+        AVBufferRef *buf = av_buffer_ref(src->buf[0]);
+        if (!buf)
+        {
+            return false;
+        }
+        h264_encoder->frame->pts = pts;
+        return H264EnCoderFetchBuffer(h264_encoder, buf, src->data, src->linesize);
+    }
+
+    // same arguments every frame, so this only builds a context on the first call or a source change
+    rendition->sws_ctx = sws_getCachedContext(rendition->sws_ctx, src->width, src->height, src->format,
+                                              rendition->width, rendition->height, AV_PIX_FMT_YUV420P, SWS_BILINEAR, NULL, NULL, NULL);
+    if (!rendition->sws_ctx || !H264EnCoderFrameWritable(h264_encoder))
+    {
+        return false;
+    }
+    sws_scale(rendition->sws_ctx, (const uint8_t *const *)src->data, src->linesize, 0, src->height,
+              h264_encoder->frame->data, h264_encoder->frame->linesize);
+    h264_encoder->frame->pts = pts;
+    return H264EnCoderFetchFrame(h264_encoder);
+}
+
+static void *rendition_pthread(void *args)
+{
+    Rendition *rendition = args;
+    AVFrame *src;
+    while ((src = FrameQueuePop(&rendition->queue)) != NULL)
+    {
+        bool ok = rendition_encode(rendition, src);
+        av_frame_free(&src);
+        if (!ok)
+        {
+            printf("rendition %dx%d encode error\n", rendition->width, rendition->height);
+            // keep popping so the sender never waits on this queue
+            continue;
+        }
+        rendition->frames++;
+        rendition_drain(rendition);
+    }
+    H264EnCoderFlush(&rendition->h264_encoder);
+    rendition_drain(rendition);
+    return NULL;
+}
+
+bool RenditionSetStart(RenditionSet *set)
+{
+    set->start = rendition_now();
+    for (int i = 0; i < set->rendition_num; i++)
+    {
+        if (pthread_create(&set->renditions[i].thread, NULL, rendition_pthread, &set->renditions[i]) != 0)
+        {
+            perror("create rendition thread failed");
+            set->rendition_num = i;
+            return false;
+        }
+    }
+    return true;
+}
+
+/*
+ * fans src out to every rendition as a new reference to the same buffers,
+ * nothing is copied. src stays owned by the caller. with a live source a
+ * rendition whose queue is full skips the frame rather than holding back the
+ * others.
+ */
+void RenditionSetSend(RenditionSet *set, const AVFrame *src)
+{
+    for (int i = 0; i < set->rendition_num; i++)
+    {
+        Rendition *rendition = &set->renditions[i];
+        if (src->pts % rendition->fps_divisor != 0)
+        {
+            continue;
+        }
+        AVFrame *ref = av_frame_clone(src);
+        bool queued = ref && (set->live ? FrameQueueTryPush(&rendition->queue, ref) : FrameQueuePush(&rendition->queue, ref));
+        if (!queued)
+        {
+            av_frame_free(&ref);
+            rendition->dropped++;
+        }
+    }
+}
+
+/* no more frames, waits until every rendition has flushed its encoder */
+void RenditionSetFinish(RenditionSet *set)
+{
+    for (int i = 0; i < set->rendition_num; i++)
+    {
+        FrameQueueClose(&set->renditions[i].queue);
+    }
+    for (int i = 0; i < set->rendition_num; i++)
+    {
+        pthread_join(set->renditions[i].thread, NULL);
+        set->renditions[i].elapsed = rendition_now() - set->start;
+    }
+}
+
+void RenditionSetReport(RenditionSet *set)
+{
+    for (int i = 0; i < set->rendition_num; i++)
+    {
+        Rendition *rendition = &set->renditions[i];
+        printf("%dx%d\tframes:%ld\t%.1f fps\tdropped:%ld\tbytes:%ld\n", rendition->width, rendition->height, rendition->frames,
+               rendition->elapsed > 0 ? rendition->frames / rendition->elapsed : 0, rendition->dropped, rendition->bytes);
+    }
+}
+
+void RenditionSetDestroy(RenditionSet *set)
+{
+    for (int i = 0; i < set->rendition_num; i++)
+    {
+        Rendition *rendition = &set->renditions[i];
+        H264EnCoderDestroy(&rendition->h264_encoder);
+        sws_freeContext(rendition->sws_ctx);
+        FrameQueueDestroy(&rendition->queue);
+        fclose(rendition->fp);
+    }
+    set->rendition_num = 0;
+}
+
+#ifndef LIO_NO_MAIN
+#include "yuvreader.h"
+
+static void rendition_view_release(void *opaque, uint8_t *data)
+{
+    YUVReaderRelease(opaque, data);
+}
+
+/*
+ * gcc rendition.c codeh264.c framepool.c encstats.c yuvreader.c framequeue.c -o rendition -lavcodec -lavformat -lavutil -lswscale -lpthread
+ * ./rendition [video.yuv]
+ * 1280x720 的 yuv 同时编码成 720p, 480p 和 240p(5fps) 三路, 源帧按引用分发, 不拷贝
+ */
+int main(int argc, char **argv)
+{
+    int width = 1280;
+    int height = 720;
+    const char *input = argc > 1 ? argv[1] : "video.yuv";
+    YUVReader reader;
+    YUVFrameView view;
+    // mmap: release is a no-op, so the last reference can drop on any rendition thread
+    if (!YUVReaderOpen(&reader, input, width, height, YUV_READER_MMAP))
+    {
+        printf("无法打开输入文件\n");
+        return -1;
+    }
+
+    RenditionSet set;
+    RenditionSetInit(&set, (AVRational){10, 1}, false);
+    if (!RenditionSetAdd(&set, 1280, 720, 400 * 1024, 1, "video_720p.h264") ||
+        !RenditionSetAdd(&set, 854, 480, 200 * 1024, 1, "video_480p.h264") ||
+        !RenditionSetAdd(&set, 426, 240, 80 * 1024, 2, "video_240p.h264") ||
+        !RenditionSetStart(&set))
+    {
+        return -1;
+    }
+
+    AVFrame *src = av_frame_alloc();
+    while (YUVReaderNext(&reader, &view))
+    {
+        src->format = AV_PIX_FMT_YUV420P;
+        src->width = width;
+        src->height = height;
+        src->pts = view.index;
+        src->buf[0] = av_buffer_create(view.data[0], reader.frame_bytes, rendition_view_release, &reader, AV_BUFFER_FLAG_READONLY);
+        if (!src->buf[0])
+        {
+            break;
+        }
+        for (int i = 0; i < 3; i++)
+        {
+            src->data[i] = view.data[i];
+            src->linesize[i] = view.linesize[i];
+        }
+        RenditionSetSend(&set, src);
+        av_frame_unref(src);
+    }
+    av_frame_free(&src);
+    RenditionSetFinish(&set);
+    RenditionSetReport(&set);
+    RenditionSetDestroy(&set);
+    YUVReaderClose(&reader);
+    return 0;
+}
+#endif
@@ -0,0 +1,50 @@
+#ifndef _RENDITION_H
+#define _RENDITION_H
+
+#include <pthread.h>
+#include "codeh264.h"
+#include "framequeue.h"
+
+#define RENDITION_MAX 4
+#define RENDITION_QUEUE_SIZE 4
+
+/*
+ * one output of a multi rendition pipeline. source frames arrive as extra
+ * references to the same refcounted AVFrame, the rendition thread scales
+ * them into its encoder frame (or hands them over as is at source size) and
+ * writes Annex-B to fp.
+ */
+typedef struct
+{
+    int width;
+    int height;
+    int64_t bit_rate;
+    int fps_divisor; // encode every fps_divisor-th source frame
+    FILE *fp;
+    H264EnCoder h264_encoder;
+    struct SwsContext *sws_ctx;
+    FrameQueue queue; // AVFrame *, each one a reference owned by the rendition thread
+    pthread_t thread;
+    int64_t frames;
+    int64_t dropped; // source frames skipped because this rendition was behind
+    int64_t bytes;
+    double elapsed;
+} Rendition;
+
+typedef struct
+{
+    Rendition renditions[RENDITION_MAX];
+    int rendition_num;
+    AVRational framerate; // of the source
+    bool live;            // live sources skip frames for a rendition that is behind, files wait for it
+    double start;
+} RenditionSet;
+
+bool RenditionSetInit(RenditionSet *set, AVRational framerate, bool live);
+bool RenditionSetAdd(RenditionSet *set, int width, int height, int64_t bit_rate, int fps_divisor, const char *path);
+bool RenditionSetStart(RenditionSet *set);
+void RenditionSetSend(RenditionSet *set, const AVFrame *src);
+void RenditionSetFinish(RenditionSet *set);
+void RenditionSetReport(RenditionSet *set);
+void RenditionSetDestroy(RenditionSet *set);
+#endif
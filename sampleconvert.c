@@ -0,0 +1,325 @@
+#include "sampleconvert.h"
+#include <string.h>
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define SAMPLE_CONVERT_X86 1
+#endif
+
+#define S16_SCALE (1.0f / 32768.0f)
+#define S32_SCALE (1.0f / 2147483648.0f)
+
+bool sample_convert_supported(enum AVSampleFormat src_fmt)
+{
+    return src_fmt == AV_SAMPLE_FMT_S16 || src_fmt == AV_SAMPLE_FMT_S32 || src_fmt == AV_SAMPLE_FMT_FLT;
+}
+
+/* converts samples [i, nb_samples), the simd kernels use it for their tails and for 3+ channels */
+static inline void s16_to_fltp_tail(const int16_t *src, float *const *dst, int dst_offset, int channels, int i, int nb_samples)
+{
+    for (; i < nb_samples; i++)
+    {
+        for (int c = 0; c < channels; c++)
+        {
+            dst[c][dst_offset + i] = src[i * channels + c] * S16_SCALE;
+        }
+    }
+}
+
+static inline void s32_to_fltp_tail(const int32_t *src, float *const *dst, int dst_offset, int channels, int i, int nb_samples)
+{
+    for (; i < nb_samples; i++)
+    {
+        for (int c = 0; c < channels; c++)
+        {
+            dst[c][dst_offset + i] = (float)src[i * channels + c] * S32_SCALE;
+        }
+    }
+}
+
+static inline void flt_to_fltp_tail(const float *src, float *const *dst, int dst_offset, int channels, int i, int nb_samples)
+{
+    for (; i < nb_samples; i++)
+    {
+        for (int c = 0; c < channels; c++)
+        {
+            dst[c][dst_offset + i] = src[i * channels + c];
+        }
+    }
+}
+
+void sample_s16_to_fltp_c(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    s16_to_fltp_tail(src, dst, dst_offset, channels, 0, nb_samples);
+}
+
+void sample_s32_to_fltp_c(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    s32_to_fltp_tail(src, dst, dst_offset, channels, 0, nb_samples);
+}
+
+void sample_flt_to_fltp_c(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    if (channels == 1)
+    {
+        memcpy(dst[0] + dst_offset, src, sizeof(float) * nb_samples);
+        return;
+    }
+    flt_to_fltp_tail(src, dst, dst_offset, channels, 0, nb_samples);
+}
+
+#ifdef SAMPLE_CONVERT_X86
+void sample_s16_to_fltp_sse2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    const int16_t *in = src;
+    const __m128 scale = _mm_set1_ps(S16_SCALE);
+    int i = 0;
+    if (channels == 1)
+    {
+        float *out = dst[0] + dst_offset;
+        for (; i + 8 <= nb_samples; i += 8)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+            // duplicate every sample into a 32 bit lane and shift it down with sign
+            __m128i lo = _mm_srai_epi32(_mm_unpacklo_epi16(x, x), 16);
+            __m128i hi = _mm_srai_epi32(_mm_unpackhi_epi16(x, x), 16);
+            _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+            _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+        }
+    }
+    else if (channels == 2)
+    {
+        float *left = dst[0] + dst_offset;
+        float *right = dst[1] + dst_offset;
+        for (; i + 4 <= nb_samples; i += 4)
+        {
+            // every 32 bit lane is one L R pair
+            __m128i x = _mm_loadu_si128((const __m128i *)(in + i * 2));
+            __m128i l = _mm_srai_epi32(_mm_slli_epi32(x, 16), 16);
+            __m128i r = _mm_srai_epi32(x, 16);
+            _mm_storeu_ps(left + i, _mm_mul_ps(_mm_cvtepi32_ps(l), scale));
+            _mm_storeu_ps(right + i, _mm_mul_ps(_mm_cvtepi32_ps(r), scale));
+        }
+    }
+    s16_to_fltp_tail(in, dst, dst_offset, channels, i, nb_samples);
+}
+
+/* L0 R0 L1 R1 | L2 R2 L3 R3 -> L0 L1 L2 L3 and R0 R1 R2 R3 */
+static inline void deinterleave_ps(__m128 a, __m128 b, float *left, float *right)
+{
+    _mm_storeu_ps(left, _mm_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0)));
+    _mm_storeu_ps(right, _mm_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1)));
+}
+
+void sample_s32_to_fltp_sse2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    const int32_t *in = src;
+    const __m128 scale = _mm_set1_ps(S32_SCALE);
+    int i = 0;
+    if (channels == 1)
+    {
+        float *out = dst[0] + dst_offset;
+        for (; i + 4 <= nb_samples; i += 4)
+        {
+            __m128i x = _mm_loadu_si128((const __m128i *)(in + i));
+            _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(x), scale));
+        }
+    }
+    else if (channels == 2)
+    {
+        for (; i + 4 <= nb_samples; i += 4)
+        {
+            __m128 a = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(in + i * 2))), scale);
+            __m128 b = _mm_mul_ps(_mm_cvtepi32_ps(_mm_loadu_si128((const __m128i *)(in + i * 2 + 4))), scale);
+            deinterleave_ps(a, b, dst[0] + dst_offset + i, dst[1] + dst_offset + i);
+        }
+    }
+    s32_to_fltp_tail(in, dst, dst_offset, channels, i, nb_samples);
+}
+
+void sample_flt_to_fltp_sse2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    const float *in = src;
+    int i = 0;
+    if (channels == 1)
+    {
+        memcpy(dst[0] + dst_offset, src, sizeof(float) * nb_samples);
+        return;
+    }
+    else if (channels == 2)
+    {
+        for (; i + 4 <= nb_samples; i += 4)
+        {
+            deinterleave_ps(_mm_loadu_ps(in + i * 2), _mm_loadu_ps(in + i * 2 + 4), dst[0] + dst_offset + i, dst[1] + dst_offset + i);
+        }
+    }
+    flt_to_fltp_tail(in, dst, dst_offset, channels, i, nb_samples);
+}
+
+__attribute__((target("avx2"))) void sample_s16_to_fltp_avx2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    const int16_t *in = src;
+    const __m256 scale = _mm256_set1_ps(S16_SCALE);
+    int i = 0;
+    if (channels == 1)
+    {
+        float *out = dst[0] + dst_offset;
+        for (; i + 8 <= nb_samples; i += 8)
+        {
+            __m256i x = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)(in + i)));
+            _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+        }
+    }
+    else if (channels == 2)
+    {
+        float *left = dst[0] + dst_offset;
+        float *right = dst[1] + dst_offset;
+        for (; i + 8 <= nb_samples; i += 8)
+        {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(in + i * 2));
+            __m256i l = _mm256_srai_epi32(_mm256_slli_epi32(x, 16), 16);
+            __m256i r = _mm256_srai_epi32(x, 16);
+            _mm256_storeu_ps(left + i, _mm256_mul_ps(_mm256_cvtepi32_ps(l), scale));
+            _mm256_storeu_ps(right + i, _mm256_mul_ps(_mm256_cvtepi32_ps(r), scale));
+        }
+    }
+    s16_to_fltp_tail(in, dst, dst_offset, channels, i, nb_samples);
+}
+
+/* shuffle_ps works per 128 bit lane, 0xD8 puts the 64 bit halves back in order */
+__attribute__((target("avx2"))) static inline void deinterleave256_ps(__m256 a, __m256 b, float *left, float *right)
+{
+    __m256 l = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(2, 0, 2, 0));
+    __m256 r = _mm256_shuffle_ps(a, b, _MM_SHUFFLE(3, 1, 3, 1));
+    _mm256_storeu_ps(left, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(l), 0xD8)));
+    _mm256_storeu_ps(right, _mm256_castpd_ps(_mm256_permute4x64_pd(_mm256_castps_pd(r), 0xD8)));
+}
+
+__attribute__((target("avx2"))) void sample_s32_to_fltp_avx2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    const int32_t *in = src;
+    const __m256 scale = _mm256_set1_ps(S32_SCALE);
+    int i = 0;
+    if (channels == 1)
+    {
+        float *out = dst[0] + dst_offset;
+        for (; i + 8 <= nb_samples; i += 8)
+        {
+            __m256i x = _mm256_loadu_si256((const __m256i *)(in + i));
+            _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(x), scale));
+        }
+    }
+    else if (channels == 2)
+    {
+        for (; i + 8 <= nb_samples; i += 8)
+        {
+            __m256 a = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(in + i * 2))), scale);
+            __m256 b = _mm256_mul_ps(_mm256_cvtepi32_ps(_mm256_loadu_si256((const __m256i *)(in + i * 2 + 8))), scale);
+            deinterleave256_ps(a, b, dst[0] + dst_offset + i, dst[1] + dst_offset + i);
+        }
+    }
+    s32_to_fltp_tail(in, dst, dst_offset, channels, i, nb_samples);
+}
+
+__attribute__((target("avx2"))) void sample_flt_to_fltp_avx2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    const float *in = src;
+    int i = 0;
+    if (channels == 1)
+    {
+        memcpy(dst[0] + dst_offset, src, sizeof(float) * nb_samples);
+        return;
+    }
+    else if (channels == 2)
+    {
+        for (; i + 8 <= nb_samples; i += 8)
+        {
+            deinterleave256_ps(_mm256_loadu_ps(in + i * 2), _mm256_loadu_ps(in + i * 2 + 8), dst[0] + dst_offset + i, dst[1] + dst_offset + i);
+        }
+    }
+    flt_to_fltp_tail(in, dst, dst_offset, channels, i, nb_samples);
+}
+#else
+void sample_s16_to_fltp_sse2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    sample_s16_to_fltp_c(src, dst, dst_offset, channels, nb_samples);
+}
+
+void sample_s32_to_fltp_sse2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    sample_s32_to_fltp_c(src, dst, dst_offset, channels, nb_samples);
+}
+
+void sample_flt_to_fltp_sse2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    sample_flt_to_fltp_c(src, dst, dst_offset, channels, nb_samples);
+}
+
+void sample_s16_to_fltp_avx2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    sample_s16_to_fltp_c(src, dst, dst_offset, channels, nb_samples);
+}
+
+void sample_s32_to_fltp_avx2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    sample_s32_to_fltp_c(src, dst, dst_offset, channels, nb_samples);
+}
+
+void sample_flt_to_fltp_avx2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    sample_flt_to_fltp_c(src, dst, dst_offset, channels, nb_samples);
+}
+#endif
+
+static pthread_once_t convert_once = PTHREAD_ONCE_INIT;
+static SampleConvertFunc s16_func = sample_s16_to_fltp_c;
+static SampleConvertFunc s32_func = sample_s32_to_fltp_c;
+static SampleConvertFunc flt_func = sample_flt_to_fltp_c;
+static const char *convert_name = "c";
+
+static void sample_convert_select(void)
+{
+#ifdef SAMPLE_CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        s16_func = sample_s16_to_fltp_avx2;
+        s32_func = sample_s32_to_fltp_avx2;
+        flt_func = sample_flt_to_fltp_avx2;
+        convert_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        s16_func = sample_s16_to_fltp_sse2;
+        s32_func = sample_s32_to_fltp_sse2;
+        flt_func = sample_flt_to_fltp_sse2;
+        convert_name = "sse2";
+    }
+#endif
+}
+
+bool sample_convert_to_fltp(const void *src, enum AVSampleFormat src_fmt, float *const *dst, int dst_offset, int channels, int nb_samples)
+{
+    pthread_once(&convert_once, sample_convert_select);
+    switch (src_fmt)
+    {
+    case AV_SAMPLE_FMT_S16:
+        s16_func(src, dst, dst_offset, channels, nb_samples);
+        return true;
+    case AV_SAMPLE_FMT_S32:
+        s32_func(src, dst, dst_offset, channels, nb_samples);
+        return true;
+    case AV_SAMPLE_FMT_FLT:
+        flt_func(src, dst, dst_offset, channels, nb_samples);
+        return true;
+    default:
+        return false;
+    }
+}
+
+const char *sample_convert_name(void)
+{
+    pthread_once(&convert_once, sample_convert_select);
+    return convert_name;
+}
@@ -0,0 +1,31 @@
+#ifndef _SAMPLECONVERT_H
+#define _SAMPLECONVERT_H
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <libavutil/samplefmt.h>
+
+/*
+ * interleaved AV_SAMPLE_FMT_S16/S32/FLT -> planar float (AV_SAMPLE_FMT_FLTP).
+ * dst[c] + dst_offset receives nb_samples samples of channel c, so a
+ * converter can write straight into AVFrame data or part way into it.
+ * integer input is scaled to [-1.0, 1.0).
+ */
+typedef void (*SampleConvertFunc)(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples);
+
+bool sample_convert_supported(enum AVSampleFormat src_fmt);
+
+void sample_s16_to_fltp_c(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples);
+void sample_s32_to_fltp_c(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples);
+void sample_flt_to_fltp_c(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples);
+void sample_s16_to_fltp_sse2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples);
+void sample_s32_to_fltp_sse2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples);
+void sample_flt_to_fltp_sse2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples);
+void sample_s16_to_fltp_avx2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples);
+void sample_s32_to_fltp_avx2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples);
+void sample_flt_to_fltp_avx2(const void *src, float *const *dst, int dst_offset, int channels, int nb_samples);
+
+/* picks the widest kernel the running cpu supports, false for other formats */
+bool sample_convert_to_fltp(const void *src, enum AVSampleFormat src_fmt, float *const *dst, int dst_offset, int channels, int nb_samples);
+const char *sample_convert_name(void);
+#endif
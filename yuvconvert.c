@@ -0,0 +1,196 @@
+#include "yuvconvert.h"
+#include <pthread.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define YUV_CONVERT_X86 1
+#endif
+
+/*
+ * converts pixels [x, width) of one row pair.
+ * row1 == row0 and y1 == NULL for the last row of an odd height picture.
+ */
+static inline void yuyv_rows_c(const uint8_t *row0, const uint8_t *row1, uint8_t *y0, uint8_t *y1, uint8_t *u, uint8_t *v, int x, int width, YUYV_CHROMA_MODE chroma_mode)
+{
+    for (; x < width; x += 2)
+    {
+        const uint8_t *p0 = row0 + x * 2;
+        const uint8_t *p1 = row1 + x * 2;
+        y0[x] = p0[0];
+        y0[x + 1] = p0[2];
+        if (y1)
+        {
+            y1[x] = p1[0];
+            y1[x + 1] = p1[2];
+        }
+        if (chroma_mode == YUYV_CHROMA_AVERAGE)
+        {
+            u[x / 2] = (p0[1] + p1[1] + 1) >> 1;
+            v[x / 2] = (p0[3] + p1[3] + 1) >> 1;
+        }
+        else
+        {
+            u[x / 2] = p0[1];
+            v[x / 2] = p0[3];
+        }
+    }
+}
+
+void yuyv422_to_yuv420p_c(const uint8_t *src, int src_stride, uint8_t *const dst[3], const int dst_stride[3], int width, int height, YUYV_CHROMA_MODE chroma_mode)
+{
+    for (int j = 0; j < height; j += 2)
+    {
+        const uint8_t *row0 = src + (size_t)j * src_stride;
+        int pair = j + 1 < height;
+        yuyv_rows_c(row0, pair ? row0 + src_stride : row0,
+                    dst[0] + (size_t)j * dst_stride[0], pair ? dst[0] + (size_t)(j + 1) * dst_stride[0] : NULL,
+                    dst[1] + (size_t)(j / 2) * dst_stride[1], dst[2] + (size_t)(j / 2) * dst_stride[2],
+                    0, width, chroma_mode);
+    }
+}
+
+#ifdef YUV_CONVERT_X86
+void yuyv422_to_yuv420p_sse2(const uint8_t *src, int src_stride, uint8_t *const dst[3], const int dst_stride[3], int width, int height, YUYV_CHROMA_MODE chroma_mode)
+{
+    const __m128i mask = _mm_set1_epi16(0x00FF);
+    int simd_width = width & ~15;
+    for (int j = 0; j < height; j += 2)
+    {
+        const uint8_t *row0 = src + (size_t)j * src_stride;
+        if (j + 1 >= height)
+        {
+            yuyv_rows_c(row0, row0, dst[0] + (size_t)j * dst_stride[0], NULL,
+                        dst[1] + (size_t)(j / 2) * dst_stride[1], dst[2] + (size_t)(j / 2) * dst_stride[2],
+                        0, width, chroma_mode);
+            break;
+        }
+        const uint8_t *row1 = row0 + src_stride;
+        uint8_t *y0 = dst[0] + (size_t)j * dst_stride[0];
+        uint8_t *y1 = y0 + dst_stride[0];
+        uint8_t *u = dst[1] + (size_t)(j / 2) * dst_stride[1];
+        uint8_t *v = dst[2] + (size_t)(j / 2) * dst_stride[2];
+        for (int x = 0; x < simd_width; x += 16)
+        {
+            // 16 pixels: Y0 U0 Y1 V0 ... in two 16 byte loads per row
+            __m128i a0 = _mm_loadu_si128((const __m128i *)(row0 + x * 2));
+            __m128i a1 = _mm_loadu_si128((const __m128i *)(row0 + x * 2 + 16));
+            __m128i b0 = _mm_loadu_si128((const __m128i *)(row1 + x * 2));
+            __m128i b1 = _mm_loadu_si128((const __m128i *)(row1 + x * 2 + 16));
+
+            _mm_storeu_si128((__m128i *)(y0 + x), _mm_packus_epi16(_mm_and_si128(a0, mask), _mm_and_si128(a1, mask)));
+            _mm_storeu_si128((__m128i *)(y1 + x), _mm_packus_epi16(_mm_and_si128(b0, mask), _mm_and_si128(b1, mask)));
+
+            __m128i c0 = a0, c1 = a1;
+            if (chroma_mode == YUYV_CHROMA_AVERAGE)
+            {
+                c0 = _mm_avg_epu8(a0, b0);
+                c1 = _mm_avg_epu8(a1, b1);
+            }
+            // U0 V0 U1 V1 ... then split into 8 U and 8 V
+            __m128i uv = _mm_packus_epi16(_mm_srli_epi16(c0, 8), _mm_srli_epi16(c1, 8));
+            __m128i uu = _mm_packus_epi16(_mm_and_si128(uv, mask), _mm_setzero_si128());
+            __m128i vv = _mm_packus_epi16(_mm_srli_epi16(uv, 8), _mm_setzero_si128());
+            _mm_storel_epi64((__m128i *)(u + x / 2), uu);
+            _mm_storel_epi64((__m128i *)(v + x / 2), vv);
+        }
+        yuyv_rows_c(row0, row1, y0, y1, u, v, simd_width, width, chroma_mode);
+    }
+}
+
+__attribute__((target("avx2"))) void yuyv422_to_yuv420p_avx2(const uint8_t *src, int src_stride, uint8_t *const dst[3], const int dst_stride[3], int width, int height, YUYV_CHROMA_MODE chroma_mode)
+{
+    const __m256i mask = _mm256_set1_epi16(0x00FF);
+    int simd_width = width & ~31;
+    for (int j = 0; j < height; j += 2)
+    {
+        const uint8_t *row0 = src + (size_t)j * src_stride;
+        if (j + 1 >= height)
+        {
+            yuyv_rows_c(row0, row0, dst[0] + (size_t)j * dst_stride[0], NULL,
+                        dst[1] + (size_t)(j / 2) * dst_stride[1], dst[2] + (size_t)(j / 2) * dst_stride[2],
+                        0, width, chroma_mode);
+            break;
+        }
+        const uint8_t *row1 = row0 + src_stride;
+        uint8_t *y0 = dst[0] + (size_t)j * dst_stride[0];
+        uint8_t *y1 = y0 + dst_stride[0];
+        uint8_t *u = dst[1] + (size_t)(j / 2) * dst_stride[1];
+        uint8_t *v = dst[2] + (size_t)(j / 2) * dst_stride[2];
+        for (int x = 0; x < simd_width; x += 32)
+        {
+            __m256i a0 = _mm256_loadu_si256((const __m256i *)(row0 + x * 2));
+            __m256i a1 = _mm256_loadu_si256((const __m256i *)(row0 + x * 2 + 32));
+            __m256i b0 = _mm256_loadu_si256((const __m256i *)(row1 + x * 2));
+            __m256i b1 = _mm256_loadu_si256((const __m256i *)(row1 + x * 2 + 32));
+
+            // packus works per 128 bit lane, 0xD8 puts the lanes back in order
+            __m256i ya = _mm256_packus_epi16(_mm256_and_si256(a0, mask), _mm256_and_si256(a1, mask));
+            __m256i yb = _mm256_packus_epi16(_mm256_and_si256(b0, mask), _mm256_and_si256(b1, mask));
+            _mm256_storeu_si256((__m256i *)(y0 + x), _mm256_permute4x64_epi64(ya, 0xD8));
+            _mm256_storeu_si256((__m256i *)(y1 + x), _mm256_permute4x64_epi64(yb, 0xD8));
+
+            __m256i c0 = a0, c1 = a1;
+            if (chroma_mode == YUYV_CHROMA_AVERAGE)
+            {
+                c0 = _mm256_avg_epu8(a0, b0);
+                c1 = _mm256_avg_epu8(a1, b1);
+            }
+            __m256i uv = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_srli_epi16(c0, 8), _mm256_srli_epi16(c1, 8)), 0xD8);
+            __m256i uuvv = _mm256_permute4x64_epi64(_mm256_packus_epi16(_mm256_and_si256(uv, mask), _mm256_srli_epi16(uv, 8)), 0xD8);
+            _mm_storeu_si128((__m128i *)(u + x / 2), _mm256_castsi256_si128(uuvv));
+            _mm_storeu_si128((__m128i *)(v + x / 2), _mm256_extracti128_si256(uuvv, 1));
+        }
+        yuyv_rows_c(row0, row1, y0, y1, u, v, simd_width, width, chroma_mode);
+    }
+}
+#else
+void yuyv422_to_yuv420p_sse2(const uint8_t *src, int src_stride, uint8_t *const dst[3], const int dst_stride[3], int width, int height, YUYV_CHROMA_MODE chroma_mode)
+{
+    yuyv422_to_yuv420p_c(src, src_stride, dst, dst_stride, width, height, chroma_mode);
+}
+
+void yuyv422_to_yuv420p_avx2(const uint8_t *src, int src_stride, uint8_t *const dst[3], const int dst_stride[3], int width, int height, YUYV_CHROMA_MODE chroma_mode)
+{
+    yuyv422_to_yuv420p_c(src, src_stride, dst, dst_stride, width, height, chroma_mode);
+}
+#endif
+
+static pthread_once_t convert_once = PTHREAD_ONCE_INIT;
+static YUYVConvertFunc convert_func = yuyv422_to_yuv420p_c;
+static const char *convert_name = "c";
+
+static void yuyv_convert_select(void)
+{
+#ifdef YUV_CONVERT_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+    {
+        convert_func = yuyv422_to_yuv420p_avx2;
+        convert_name = "avx2";
+    }
+    else if (__builtin_cpu_supports("sse2"))
+    {
+        convert_func = yuyv422_to_yuv420p_sse2;
+        convert_name = "sse2";
+    }
+#endif
+}
+
+void yuyv422_to_yuv420p(const uint8_t *src, int src_stride, uint8_t *const dst[3], const int dst_stride[3], int width, int height, YUYV_CHROMA_MODE chroma_mode)
+{
+    pthread_once(&convert_once, yuyv_convert_select);
+    convert_func(src, src_stride, dst, dst_stride, width, height, chroma_mode);
+}
+
+const char *yuyv422_to_yuv420p_name(void)
+{
+    pthread_once(&convert_once, yuyv_convert_select);
+    return convert_name;
+}
+
+void yuyv422_to_yuv420p_packed(const uint8_t *yuyv_ptr, uint8_t *yuv_ptr, int width, int height, YUYV_CHROMA_MODE chroma_mode)
+{
+    uint8_t *dst[3] = {yuv_ptr, yuv_ptr + width * height, yuv_ptr + width * height + width * height / 4};
+    const int dst_stride[3] = {width, width / 2, width / 2};
+    yuyv422_to_yuv420p(yuyv_ptr, width * 2, dst, dst_stride, width, height, chroma_mode);
+}
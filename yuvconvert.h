@@ -0,0 +1,29 @@
+#ifndef _YUVCONVERT_H
+#define _YUVCONVERT_H
+
+#include <stdint.h>
+
+/*
+ * YUYV422(packed) -> YUV420P(planar) conversion.
+ * dst/dst_stride follow the AVFrame data/linesize layout, so a converter can
+ * write straight into an encoder frame.
+ */
+typedef enum
+{
+    YUYV_CHROMA_AVERAGE, // chroma = (even row + odd row + 1) >> 1
+    YUYV_CHROMA_DROP     // chroma taken from even rows only, same as yuyv422_to_yuv420
+} YUYV_CHROMA_MODE;
+
+typedef void (*YUYVConvertFunc)(const uint8_t *src, int src_stride, uint8_t *const dst[3], const int dst_stride[3], int width, int height, YUYV_CHROMA_MODE chroma_mode);
+
+void yuyv422_to_yuv420p_c(const uint8_t *src, int src_stride, uint8_t *const dst[3], const int dst_stride[3], int width, int height, YUYV_CHROMA_MODE chroma_mode);
+void yuyv422_to_yuv420p_sse2(const uint8_t *src, int src_stride, uint8_t *const dst[3], const int dst_stride[3], int width, int height, YUYV_CHROMA_MODE chroma_mode);
+void yuyv422_to_yuv420p_avx2(const uint8_t *src, int src_stride, uint8_t *const dst[3], const int dst_stride[3], int width, int height, YUYV_CHROMA_MODE chroma_mode);
+
+/* picks the widest kernel the running cpu supports */
+void yuyv422_to_yuv420p(const uint8_t *src, int src_stride, uint8_t *const dst[3], const int dst_stride[3], int width, int height, YUYV_CHROMA_MODE chroma_mode);
+const char *yuyv422_to_yuv420p_name(void);
+
+/* contiguous y/u/v buffer, drop-in for yuyv422_to_yuv420 */
+void yuyv422_to_yuv420p_packed(const uint8_t *yuyv_ptr, uint8_t *yuv_ptr, int width, int height, YUYV_CHROMA_MODE chroma_mode);
+#endif
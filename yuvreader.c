@@ -0,0 +1,180 @@
+#include "yuvreader.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+static void yuv_reader_fill_view(YUVReader *reader, YUVFrameView *view, uint8_t *frame, int64_t index)
+{
+    size_t luma = (size_t)reader->width * reader->height;
+    view->data[0] = frame;
+    view->data[1] = frame + luma;
+    view->data[2] = frame + luma + luma / 4;
+    view->linesize[0] = reader->width;
+    view->linesize[1] = reader->width / 2;
+    view->linesize[2] = reader->width / 2;
+    view->index = index;
+}
+
+static void *yuv_reader_pthread(void *args)
+{
+    YUVReader *reader = args;
+    for (int64_t i = 0; i < reader->frame_num; i++)
+    {
+        uint8_t *buf = FrameQueuePop(&reader->free_queue);
+        if (!buf)
+        {
+            break;
+        }
+        size_t done = 0;
+        while (done < reader->frame_bytes)
+        {
+            ssize_t ret = pread(reader->fd, buf + done, reader->frame_bytes - done, i * reader->frame_bytes + done);
+            if (ret <= 0)
+            {
+                break;
+            }
+            done += ret;
+        }
+        if (done < reader->frame_bytes || !FrameQueuePush(&reader->queue, buf))
+        {
+            break;
+        }
+    }
+    FrameQueueClose(&reader->queue);
+    return NULL;
+}
+
+bool YUVReaderOpen(YUVReader *reader, const char *path, int width, int height, YUV_READER_MODE mode)
+{
+    memset(reader, 0, sizeof(YUVReader));
+    reader->mode = mode;
+    reader->width = width;
+    reader->height = height;
+    reader->frame_bytes = (size_t)width * height * 3 / 2;
+    reader->fd = open(path, O_RDONLY);
+    if (reader->fd < 0)
+    {
+        perror("can't open yuv file");
+        return false;
+    }
+    struct stat st;
+    if (fstat(reader->fd, &st) < 0)
+    {
+        perror("can't stat yuv file");
+        return false;
+    }
+    reader->frame_num = st.st_size / reader->frame_bytes;
+
+    if (mode == YUV_READER_MMAP)
+    {
+        reader->map_size = reader->frame_num * reader->frame_bytes;
+        if (reader->map_size == 0)
+        {
+            return true;
+        }
+        reader->map = mmap(NULL, reader->map_size, PROT_READ, MAP_PRIVATE, reader->fd, 0);
+        if (reader->map == MAP_FAILED)
+        {
+            perror("mmap yuv file failed");
+            reader->map = NULL;
+            return false;
+        }
+        madvise(reader->map, reader->map_size, MADV_SEQUENTIAL);
+        return true;
+    }
+
+    if (!FrameQueueInit(&reader->queue, YUV_READER_AHEAD) || !FrameQueueInit(&reader->free_queue, YUV_READER_AHEAD))
+    {
+        return false;
+    }
+    reader->bufs = malloc(reader->frame_bytes * YUV_READER_AHEAD);
+    if (!reader->bufs)
+    {
+        perror("yuv reader alloc failed");
+        return false;
+    }
+    for (int i = 0; i < YUV_READER_AHEAD; i++)
+    {
+        FrameQueuePush(&reader->free_queue, reader->bufs + i * reader->frame_bytes);
+    }
+    if (pthread_create(&reader->thread, NULL, yuv_reader_pthread, reader) != 0)
+    {
+        perror("yuv reader thread failed");
+        return false;
+    }
+    reader->thread_started = true;
+    return true;
+}
+
+/* false at end of file. the view stays valid until YUVReaderRelease */
+bool YUVReaderNext(YUVReader *reader, YUVFrameView *view)
+{
+    if (reader->mode == YUV_READER_MMAP)
+    {
+        if (reader->next >= reader->frame_num)
+        {
+            return false;
+        }
+        uint8_t *frame = reader->map + reader->next * reader->frame_bytes;
+        // fault in the frames after this one while the encoder works on it
+        size_t offset = (reader->next + 1) * reader->frame_bytes;
+        if (offset < reader->map_size)
+        {
+            size_t start = offset & ~((size_t)sysconf(_SC_PAGESIZE) - 1);
+            size_t ahead = reader->frame_bytes * YUV_READER_AHEAD;
+            madvise(reader->map + start, ahead < reader->map_size - start ? ahead : reader->map_size - start, MADV_WILLNEED);
+        }
+        yuv_reader_fill_view(reader, view, frame, reader->next);
+        reader->next++;
+        return true;
+    }
+
+    uint8_t *buf = FrameQueuePop(&reader->queue);
+    if (!buf)
+    {
+        return false;
+    }
+    yuv_reader_fill_view(reader, view, buf, reader->next);
+    reader->next++;
+    return true;
+}
+
+/*
+ * gives view.data[0] of a finished frame back, the signature fits
+ * H264EnCoderFetchExternalFrame's release callback.
+ * must be called from the thread that calls YUVReaderNext
+ */
+void YUVReaderRelease(YUVReader *reader, uint8_t *data)
+{
+    if (reader->mode == YUV_READER_READAHEAD)
+    {
+        FrameQueuePush(&reader->free_queue, data);
+    }
+}
+
+void YUVReaderClose(YUVReader *reader)
+{
+    if (reader->thread_started)
+    {
+        // unblocks the reader thread whichever queue it is waiting on
+        FrameQueueClose(&reader->free_queue);
+        FrameQueueClose(&reader->queue);
+        pthread_join(reader->thread, NULL);
+        FrameQueueDestroy(&reader->queue);
+        FrameQueueDestroy(&reader->free_queue);
+        free(reader->bufs);
+    }
+    if (reader->map)
+    {
+        munmap(reader->map, reader->map_size);
+    }
+    if (reader->fd >= 0)
+    {
+        close(reader->fd);
+    }
+    reader->fd = -1;
+}
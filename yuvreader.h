@@ -0,0 +1,57 @@
+#ifndef _YUVREADER_H
+#define _YUVREADER_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include <pthread.h>
+#include "framequeue.h"
+
+/*
+ * raw yuv420p file source for the file based encoders.
+ * frames are handed out as pointer views instead of being fread into
+ * encoder buffers:
+ *  YUV_READER_MMAP       views point straight into a read only mapping
+ *  YUV_READER_READAHEAD  a thread preads the next few frames into buffers,
+ *                        for files that can't be mapped (pipes, fuse...)
+ */
+typedef enum
+{
+    YUV_READER_MMAP,
+    YUV_READER_READAHEAD
+} YUV_READER_MODE;
+
+#define YUV_READER_AHEAD 4
+
+typedef struct
+{
+    uint8_t *data[3];
+    int linesize[3];
+    int64_t index;
+} YUVFrameView;
+
+typedef struct YUVReader
+{
+    YUV_READER_MODE mode;
+    int fd;
+    int width;
+    int height;
+    size_t frame_bytes;
+    int64_t frame_num;
+    int64_t next;
+
+    uint8_t *map;
+    size_t map_size;
+
+    FrameQueue queue;
+    FrameQueue free_queue;
+    uint8_t *bufs;
+    pthread_t thread;
+    bool thread_started;
+} YUVReader;
+
+bool YUVReaderOpen(YUVReader *reader, const char *path, int width, int height, YUV_READER_MODE mode);
+bool YUVReaderNext(YUVReader *reader, YUVFrameView *view);
+void YUVReaderRelease(YUVReader *reader, uint8_t *data);
+void YUVReaderClose(YUVReader *reader);
+#endif